@@ -28,6 +28,9 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include "winwidget.h"
 #include "filelist.h"
 #include "options.h"
+#include "http.h"
+#include "decode.h"
+#include "readahead.h"
 
 void init_collage_mode(void)
 {
@@ -120,15 +123,17 @@ void init_collage_mode(void)
 			filelist = feh_file_remove_from_list(filelist, last);
 			last = NULL;
 		}
+		feh_http_prefetch_list(l);
+		feh_decode_prefetch_list(l, opt.thumb_w, opt.thumb_h, NULL);
+		feh_readahead_list(l);
 		D(("About to load image %s\n", file->filename));
-		if (feh_load_image(&im_temp, file) != 0) {
+		if (feh_load_image_scaled(&im_temp, file, opt.thumb_w, opt.thumb_h,
+					&ww, &hh) != 0) {
 			D(("Successfully loaded %s\n", file->filename));
 			if (opt.verbose)
 				feh_display_status('.');
 			www = opt.thumb_w;
 			hhh = opt.thumb_h;
-			ww = gib_imlib_image_get_width(im_temp);
-			hh = gib_imlib_image_get_height(im_temp);
 
 			if (opt.aspect) {
 				double ratio = 0.0;
@@ -153,8 +158,9 @@ void init_collage_mode(void)
 			yyy = ((h - hhh) * ((double) rand() / RAND_MAX));
 			D(("image going on at x=%d, y=%d\n", xxx, yyy));
 
-			im_thumb = gib_imlib_create_cropped_scaled_image(im_temp,
-					0, 0, ww, hh, www, hhh, 1);
+			im_thumb = gib_imlib_create_cropped_scaled_image(im_temp, 0, 0,
+					gib_imlib_image_get_width(im_temp),
+					gib_imlib_image_get_height(im_temp), www, hhh, 1);
 			gib_imlib_free_image_and_decache(im_temp);
 
 			if (opt.alpha) {
@@ -181,8 +187,10 @@ void init_collage_mode(void)
 				exit(0);
 		}
 	}
-	if (opt.verbose)
+	if (opt.verbose) {
 		fprintf(stdout, "\n");
+		feh_readahead_report();
+	}
 
 	if (opt.output && opt.output_file) {
 		char output_buf[1024];
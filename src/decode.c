@@ -0,0 +1,948 @@
+/* decode.c
+
+Copyright (C) 2011 by Daniel Friesel
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to
+deal in the Software without restriction, including without limitation the
+rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies of the Software and its documentation and acknowledgment shall be
+given in the documentation and software packages that this Software was
+used.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+#define _GNU_SOURCE		/* memfd_create */
+
+#include "feh.h"
+#include "filelist.h"
+#include "options.h"
+#include "decode.h"
+#include "feh_png.h"
+#include "timers.h"
+#include "thumbnail.h"
+
+#include <pthread.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+
+/*
+ * Decode service. The next images of the file list are decoded in the
+ * background while the main thread is busy with the current one. A finished
+ * image belongs to the service until the main thread claims it, at which
+ * point it is turned into an Imlib image owned by the caller.
+ *
+ * There are two kinds of workers:
+ *
+ * Threads (the default) use feh's own libpng decoder and produce plain ARGB
+ * buffers -- Imlib2 keeps global state (image cache, loader list, context)
+ * and must only be used from the main thread. Files they cannot decode are
+ * reported as failed, and the caller falls back to the normal loader.
+ *
+ * Processes (--decode-processes) are forked decoders with their own copy of
+ * Imlib2, so they handle every format. They receive filenames over a socket,
+ * scale the image down if only a thumbnail is needed, and send the pixels
+ * back in a memfd (or unlinked temporary file). A decoder that crashes only
+ * takes the file it was working on with it. While the main thread waits for
+ * a decoder, X events are still handled; one which has not answered
+ * DECODE_TIMEOUT seconds after it got the file is restarted, and the caller
+ * loads the file itself.
+ *
+ * In thumbnail mode with --cache-thumbnails, jobs also carry a function which
+ * names the cached thumbnail, or returns NULL for files which failed to load
+ * before. The worker looks the file up once: if the thumbnail is up to date,
+ * it is loaded instead of the image, and known failures are not loaded at
+ * all, so both reading cached thumbnails and generating new ones happen in
+ * parallel. Thread workers only generate thumbnails of PNG images, anything
+ * else is left to the main thread unless decoder processes are used.
+ */
+
+#define JOB_QUEUED  0
+#define JOB_RUNNING 1
+#define JOB_DONE    2
+
+#define DECODE_TIMEOUT 30
+
+struct decode_job {
+	char *filename;
+	char *(*cache_name) (char *);
+	int min_w, min_h;
+	int state;
+	DATA32 *data;
+	size_t map_len;		/* data is mapped from a decoder process */
+	int w, h, orig_w, orig_h, has_alpha;
+	int cached;		/* data is the cached thumbnail */
+	int abandoned;		/* nobody will claim it, drop once finished */
+};
+
+/*
+ * request to a decoder process, followed by len bytes of filename. The
+ * decoders are forked without exec, so cache_name is valid in them as well.
+ */
+struct decode_request {
+	int min_w, min_h, len;
+	char *(*cache_name) (char *);
+};
+
+/* answer of a decoder process, the pixels come with it as a file descriptor */
+struct decode_reply {
+	int ok, w, h, orig_w, orig_h, has_alpha, cached;
+};
+
+struct decode_proc {
+	pid_t pid;
+	int sock;
+	struct decode_job *job;	/* being decoded, or NULL if idle */
+	double started;		/* when job was handed to it */
+};
+
+static pthread_mutex_t decode_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t decode_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t decode_done = PTHREAD_COND_INITIALIZER;
+
+/* all jobs, oldest first. Protected by decode_lock. */
+static gib_list *jobs = NULL;
+static int shutting_down = 0;
+
+static pthread_t *workers = NULL;
+static struct decode_proc *procs = NULL;
+static int num_workers = 0;
+
+/* set while X events are handled during a wait, see feh_decode_poll_proc */
+static int decode_waiting = 0;
+
+static void feh_decode_job_free_data(struct decode_job *job)
+{
+	if (job->map_len && job->data)
+		munmap(job->data, job->map_len);
+	else
+		free(job->data);
+	job->data = NULL;
+	job->map_len = 0;
+	return;
+}
+
+static void feh_decode_job_free(struct decode_job *job)
+{
+	free(job->filename);
+	feh_decode_job_free_data(job);
+	free(job);
+}
+
+static void *feh_decode_worker(void *arg __attribute__ ((unused)))
+{
+	gib_list *l;
+	struct decode_job *job;
+	char *thumb_file;
+	int valid;
+
+	pthread_mutex_lock(&decode_lock);
+	while (!shutting_down) {
+		for (l = jobs; l; l = l->next)
+			if (((struct decode_job *) l->data)->state == JOB_QUEUED)
+				break;
+		if (!l) {
+			pthread_cond_wait(&decode_queued, &decode_lock);
+			continue;
+		}
+		job = l->data;
+		job->state = JOB_RUNNING;
+		pthread_mutex_unlock(&decode_lock);
+
+		thumb_file = job->cache_name ? job->cache_name(job->filename) : NULL;
+		if (thumb_file && (job->data = feh_thumbnail_cache_decode(
+						job->filename, thumb_file, &job->w, &job->h,
+						&job->orig_w, &job->orig_h, &job->has_alpha, &valid)))
+			job->cached = 1;
+		else if (thumb_file || !job->cache_name)
+			job->data = feh_png_decode(job->filename, job->min_w, job->min_h,
+					&job->w, &job->h, &job->orig_w, &job->orig_h,
+					&job->has_alpha);
+		free(thumb_file);
+
+		pthread_mutex_lock(&decode_lock);
+		job->state = JOB_DONE;
+		pthread_cond_broadcast(&decode_done);
+	}
+	pthread_mutex_unlock(&decode_lock);
+	return(NULL);
+}
+
+static int feh_decode_io(int fd, void *buf, size_t len, int writing)
+{
+	char *p = buf;
+	ssize_t ret;
+
+	while (len > 0) {
+		if (writing)
+			ret = send(fd, p, len, MSG_NOSIGNAL);
+		else
+			ret = read(fd, p, len);
+		if ((ret < 0) && (errno == EINTR))
+			continue;
+		if (ret <= 0)
+			return(0);
+		p += ret;
+		len -= ret;
+	}
+	return(1);
+}
+
+/* Returns a file descriptor containing len bytes of data, or -1 */
+static int feh_decode_shm(void *data, size_t len)
+{
+	int fd = -1;
+	char *name;
+	char *p = data;
+	ssize_t ret;
+
+#ifdef MFD_CLOEXEC
+	fd = memfd_create("feh-decode", MFD_CLOEXEC);
+#endif
+	if (fd == -1) {
+		name = feh_unique_filename("/tmp/", "decode");
+		fd = open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+		unlink(name);
+		free(name);
+		if (fd == -1)
+			return(-1);
+	}
+
+	while (len > 0) {
+		if ((ret = write(fd, p, len)) < 0) {
+			if (errno == EINTR)
+				continue;
+			close(fd);
+			return(-1);
+		}
+		p += ret;
+		len -= ret;
+	}
+	return(fd);
+}
+
+static int feh_decode_send_reply(int sock, struct decode_reply *rep, int fd)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char control[CMSG_SPACE(sizeof(int))];
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = rep;
+	iov.iov_len = sizeof(struct decode_reply);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	if (fd != -1) {
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+
+	return(sendmsg(sock, &msg, MSG_NOSIGNAL) == sizeof(struct decode_reply));
+}
+
+/* Returns 0 if the decoder is gone. *fd is -1 if no pixels were sent. */
+static int feh_decode_recv_reply(int sock, struct decode_reply *rep, int *fd)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char control[CMSG_SPACE(sizeof(int))];
+	ssize_t ret;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = rep;
+	iov.iov_len = sizeof(struct decode_reply);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	do
+		ret = recvmsg(sock, &msg, 0);
+	while ((ret < 0) && (errno == EINTR));
+
+	*fd = -1;
+	if (ret != sizeof(struct decode_reply))
+		return(0);
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+		if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_RIGHTS))
+			memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+	return(1);
+}
+
+/* Main loop of a decoder process */
+static void feh_decode_child(int sock)
+{
+	struct decode_request req;
+	struct decode_reply rep;
+	Imlib_Image im, scaled;
+	DATA32 *data;
+	char *name, *thumb_file;
+	int fd, valid;
+	double scale;
+
+	while (feh_decode_io(sock, &req, sizeof(req), 0)) {
+		name = emalloc(req.len + 1);
+		if (!feh_decode_io(sock, name, req.len, 0))
+			break;
+		name[req.len] = '\0';
+		thumb_file = req.cache_name ? req.cache_name(name) : NULL;
+
+		memset(&rep, 0, sizeof(rep));
+		fd = -1;
+		im = NULL;
+		data = NULL;
+		valid = 0;
+		if (thumb_file && (data = feh_thumbnail_cache_decode(name,
+						thumb_file, &rep.w, &rep.h, &rep.orig_w, &rep.orig_h,
+						&rep.has_alpha, &valid)))
+			rep.cached = 1;
+		else if (valid && (im = imlib_load_image_without_cache(thumb_file))) {
+			rep.w = gib_imlib_image_get_width(im);
+			rep.h = gib_imlib_image_get_height(im);
+			rep.has_alpha = gib_imlib_image_has_alpha(im);
+			rep.cached = 1;
+		} else if ((thumb_file || !req.cache_name)
+				&& (im = imlib_load_image_without_cache(name))) {
+			rep.orig_w = rep.w = gib_imlib_image_get_width(im);
+			rep.orig_h = rep.h = gib_imlib_image_get_height(im);
+			rep.has_alpha = gib_imlib_image_has_alpha(im);
+
+			/* only a thumbnail is needed, no point in sending all pixels */
+			if ((req.min_w > 0) && (req.min_h > 0)
+					&& (rep.w >= 2 * req.min_w) && (rep.h >= 2 * req.min_h)) {
+				scale = (double) req.min_w / rep.w;
+				if ((double) req.min_h / rep.h > scale)
+					scale = (double) req.min_h / rep.h;
+				rep.w = ceil(rep.w * scale);
+				rep.h = ceil(rep.h * scale);
+				scaled = gib_imlib_create_cropped_scaled_image(im, 0, 0,
+						rep.orig_w, rep.orig_h, rep.w, rep.h, 1);
+				gib_imlib_free_image_and_decache(im);
+				im = scaled;
+			}
+		}
+
+		if (data) {
+			fd = feh_decode_shm(data, rep.w * rep.h * sizeof(DATA32));
+			free(data);
+		} else if (im) {
+			imlib_context_set_image(im);
+			fd = feh_decode_shm(imlib_image_get_data_for_reading_only(),
+					rep.w * rep.h * sizeof(DATA32));
+			gib_imlib_free_image_and_decache(im);
+		}
+		rep.ok = (fd != -1);
+		free(name);
+		free(thumb_file);
+
+		if (!feh_decode_send_reply(sock, &rep, fd))
+			break;
+		if (fd != -1)
+			close(fd);
+	}
+	_exit(0);
+}
+
+static int feh_decode_spawn(struct decode_proc *p)
+{
+	int sv[2], i;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+		return(0);
+	fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+	fflush(stdout);
+
+	if ((p->pid = fork()) < 0) {
+		close(sv[0]);
+		close(sv[1]);
+		return(0);
+	}
+	if (p->pid == 0) {
+		/* the other decoders must see EOF when the main process goes away */
+		for (i = 0; i < opt.decode_jobs; i++)
+			if (procs[i].sock != -1)
+				close(procs[i].sock);
+		close(sv[0]);
+		feh_decode_child(sv[1]);
+	}
+	close(sv[1]);
+	p->sock = sv[0];
+	p->job = NULL;
+	return(1);
+}
+
+/* Reaps a dead (or hung) decoder and starts a new one in its place */
+static void feh_decode_respawn(struct decode_proc *p)
+{
+	close(p->sock);
+	p->sock = -1;
+	kill(p->pid, SIGKILL);
+	waitpid(p->pid, NULL, 0);
+	if (!feh_decode_spawn(p)) {
+		p->pid = -1;
+		p->sock = -1;
+	}
+	p->job = NULL;
+	return;
+}
+
+/*
+ * Called with decode_lock held. Waits until the reply of decoder p can be
+ * read, handling X events in the meantime so the windows stay responsive.
+ * Returns 0 if p has been busy with its job for more than DECODE_TIMEOUT
+ * seconds.
+ */
+static int feh_decode_poll_proc(struct decode_proc *p)
+{
+	struct pollfd pfd[2];
+	double left;
+	int ret, nfds = 1;
+
+	pfd[0].fd = p->sock;
+	pfd[0].events = POLLIN;
+	if (disp && window_num) {
+		pfd[1].fd = ConnectionNumber(disp);
+		pfd[1].events = POLLIN;
+		nfds = 2;
+	}
+
+	for (;;) {
+		if ((left = p->started + DECODE_TIMEOUT - feh_get_time()) <= 0.0)
+			return(0);
+
+		if ((nfds == 2) && XPending(disp)) {
+			/* nothing in here may be touched until we are done */
+			decode_waiting = 1;
+			pthread_mutex_unlock(&decode_lock);
+			feh_main_iteration(0);
+			pthread_mutex_lock(&decode_lock);
+			decode_waiting = 0;
+			if (!window_num)
+				nfds = 1;
+		}
+
+		ret = poll(pfd, nfds, ceil(left * 1000));
+		if ((ret < 0) && (errno != EINTR))
+			return(1);
+		if ((ret > 0) && pfd[0].revents)
+			return(1);
+	}
+}
+
+/*
+ * Reads the reply of decoder p to its job. Returns 1 if the job has pixels,
+ * 0 if the decoder could not load the file, and -1 if it crashed.
+ */
+static int feh_decode_collect(struct decode_proc *p)
+{
+	struct decode_job *job = p->job;
+	struct decode_reply rep;
+	void *map;
+	size_t len;
+	int fd;
+
+	if (!feh_decode_recv_reply(p->sock, &rep, &fd)) {
+		if (!opt.quiet && !job->abandoned)
+			weprintf("%s - decoder crashed, skipping", job->filename);
+		feh_decode_respawn(p);
+		return(-1);
+	}
+	p->job = NULL;
+
+	if (!rep.ok || (fd == -1)) {
+		if (fd != -1)
+			close(fd);
+		return(0);
+	}
+
+	len = rep.w * rep.h * sizeof(DATA32);
+	map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return(0);
+
+	/* feh_decode_finish copies it into the Imlib image and unmaps it */
+	job->data = map;
+	job->map_len = len;
+
+	job->w = rep.w;
+	job->h = rep.h;
+	job->orig_w = rep.orig_w;
+	job->orig_h = rep.orig_h;
+	job->has_alpha = rep.has_alpha;
+	job->cached = rep.cached;
+	return(1);
+}
+
+/*
+ * Frees abandoned jobs whose decoder has finished, or restarts the decoder
+ * if it takes too long. Never blocks.
+ */
+static void feh_decode_reap(void)
+{
+	struct decode_job *job;
+	struct pollfd pfd;
+	gib_list *l;
+	int i;
+
+	for (i = 0; i < num_workers; i++) {
+		if (!(job = procs[i].job) || !job->abandoned)
+			continue;
+		pfd.fd = procs[i].sock;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 0) > 0)
+			feh_decode_collect(&procs[i]);
+		else if (feh_get_time() - procs[i].started > DECODE_TIMEOUT)
+			feh_decode_respawn(&procs[i]);
+		else
+			continue;
+		for (l = jobs; l->data != job; l = l->next);
+		jobs = gib_list_remove(jobs, l);
+		feh_decode_job_free(job);
+	}
+	return;
+}
+
+/* Hands queued jobs to idle decoder processes */
+static void feh_decode_dispatch(void)
+{
+	gib_list *l;
+	struct decode_job *job;
+	struct decode_request req;
+	int i;
+
+	feh_decode_reap();
+
+	for (i = 0; i < num_workers; i++) {
+		if (procs[i].job || (procs[i].pid == -1))
+			continue;
+		for (l = jobs; l; l = l->next)
+			if (((struct decode_job *) l->data)->state == JOB_QUEUED)
+				break;
+		if (!l)
+			return;
+		job = l->data;
+
+		req.min_w = job->min_w;
+		req.min_h = job->min_h;
+		req.len = strlen(job->filename);
+		req.cache_name = job->cache_name;
+		if (!feh_decode_io(procs[i].sock, &req, sizeof(req), 1)
+				|| !feh_decode_io(procs[i].sock, job->filename, req.len, 1)) {
+			feh_decode_respawn(&procs[i]);
+			continue;
+		}
+		job->state = JOB_RUNNING;
+		procs[i].job = job;
+		procs[i].started = feh_get_time();
+	}
+	return;
+}
+
+static int feh_decode_start(void)
+{
+	int i;
+
+	if (workers || procs)
+		return(num_workers);
+	if (opt.decode_jobs <= 0)
+		return(0);
+
+	if (opt.decode_processes) {
+		procs = emalloc(opt.decode_jobs * sizeof(struct decode_proc));
+		for (i = 0; i < opt.decode_jobs; i++) {
+			procs[i].pid = -1;
+			procs[i].sock = -1;
+			procs[i].job = NULL;
+		}
+		for (i = 0; i < opt.decode_jobs; i++)
+			if (!feh_decode_spawn(&procs[i]))
+				break;
+		num_workers = i;
+		if (!num_workers)
+			weprintf("cannot start decoder processes:");
+	} else {
+		workers = emalloc(opt.decode_jobs * sizeof(pthread_t));
+		for (i = 0; i < opt.decode_jobs; i++)
+			if (pthread_create(&workers[i], NULL, feh_decode_worker, NULL))
+				break;
+		num_workers = i;
+		if (!num_workers)
+			weprintf("cannot start decoder threads:");
+	}
+	return(num_workers);
+}
+
+static gib_list *feh_decode_find(char *filename, int min_w, int min_h)
+{
+	gib_list *l;
+	struct decode_job *job;
+
+	for (l = jobs; l; l = l->next) {
+		job = l->data;
+		if (!job->abandoned && (job->min_w == min_w) && (job->min_h == min_h)
+				&& !strcmp(job->filename, filename))
+			return(l);
+	}
+	return(NULL);
+}
+
+/*
+ * Queues filename for decoding so that it covers min_w x min_h pixels (0 x 0
+ * for full size). If cache_name is set, the worker loads the cached thumbnail
+ * it names instead, if that is up to date, and skips the file if it returns
+ * NULL. Does nothing if it is already queued.
+ */
+void feh_decode_submit(char *filename, char *(*cache_name) (char *),
+		int min_w, int min_h)
+{
+	struct decode_job *job;
+
+	if (decode_waiting || !feh_decode_start())
+		return;
+
+	pthread_mutex_lock(&decode_lock);
+	if (!feh_decode_find(filename, min_w, min_h)) {
+		job = emalloc(sizeof(struct decode_job));
+		memset(job, 0, sizeof(struct decode_job));
+		job->filename = estrdup(filename);
+		job->cache_name = cache_name;
+		job->min_w = min_w;
+		job->min_h = min_h;
+		job->state = JOB_QUEUED;
+		jobs = gib_list_add_end(jobs, job);
+		pthread_cond_signal(&decode_queued);
+	}
+	pthread_mutex_unlock(&decode_lock);
+
+	if (procs)
+		feh_decode_dispatch();
+	return;
+}
+
+/* Waits for the decoder process working on job. See feh_decode_claim. */
+static int feh_decode_claim_proc(struct decode_job *job)
+{
+	struct decode_proc *p = NULL;
+	int i;
+
+	for (i = 0; i < num_workers; i++)
+		if (procs[i].job == job)
+			p = &procs[i];
+	if (!p)
+		return(0);
+
+	if (!feh_decode_poll_proc(p)) {
+		/* it may just be a huge image, so don't give up on the file */
+		if (!opt.quiet)
+			weprintf("%s - decoder too slow, loading it directly",
+					job->filename);
+		feh_decode_respawn(p);
+		return(0);
+	}
+	return(feh_decode_collect(p));
+}
+
+/*
+ * Called with decode_lock held. Waits until no worker is busy with job
+ * anymore. Returns 1 if job is done (or was never started), 0 if the caller
+ * should load the file itself, and -1 if a decoder process crashed on it.
+ */
+static int feh_decode_wait(struct decode_job *job)
+{
+	int ret = 1;
+
+	if (procs) {
+		if (job->state == JOB_RUNNING)
+			ret = feh_decode_claim_proc(job);
+	} else {
+		while (job->state == JOB_RUNNING)
+			pthread_cond_wait(&decode_done, &decode_lock);
+	}
+	if (job->state == JOB_RUNNING)
+		job->state = JOB_DONE;
+	return(ret);
+}
+
+/* Turns the result of an unlisted job into an Imlib image and frees the job */
+static int feh_decode_finish(struct decode_job *job, int ret, Imlib_Image * im,
+		int *orig_w, int *orig_h)
+{
+	*im = NULL;
+	if ((ret == 1) && job->data
+			&& (*im = imlib_create_image_using_copied_data(job->w, job->h,
+					job->data))) {
+		imlib_context_set_image(*im);
+		imlib_image_set_has_alpha(job->has_alpha);
+		*orig_w = job->orig_w;
+		*orig_h = job->orig_h;
+	}
+	feh_decode_job_free(job);
+
+	if (ret == -1)
+		return(-1);
+	return(*im != NULL);
+}
+
+/*
+ * Takes over the result of a submitted job. If a worker is busy with it, waits
+ * for it; if no worker has started it yet, it is dropped so the caller can
+ * load the file right away.
+ *
+ * Returns 1 and stores the image in im (owned by the caller) on success, 0 if
+ * the caller has to load the file itself, and -1 if a decoder process
+ * crashed on it (so the file should be considered unloadable).
+ */
+int feh_decode_claim(char *filename, int min_w, int min_h, Imlib_Image * im,
+		int *orig_w, int *orig_h)
+{
+	gib_list *l;
+	struct decode_job *job;
+	int ret;
+
+	if ((!workers && !procs) || decode_waiting)
+		return(0);
+
+	pthread_mutex_lock(&decode_lock);
+	if (!(l = feh_decode_find(filename, min_w, min_h))) {
+		pthread_mutex_unlock(&decode_lock);
+		return(0);
+	}
+	job = l->data;
+	ret = feh_decode_wait(job);
+	jobs = gib_list_remove(jobs, l);
+	pthread_mutex_unlock(&decode_lock);
+
+	if (procs)
+		feh_decode_dispatch();
+
+	/* the caller wants the image itself, not its cached thumbnail */
+	if (job->cached)
+		feh_decode_job_free_data(job);
+	return(feh_decode_finish(job, ret, im, orig_w, orig_h));
+}
+
+/*
+ * Like feh_decode_claim, but only takes over the result if the worker found
+ * an up-to-date cached thumbnail. Otherwise the decoded image stays available
+ * to feh_decode_claim, for generating a new thumbnail from it.
+ */
+int feh_decode_claim_cached(char *filename, int min_w, int min_h,
+		Imlib_Image * im, int *orig_w, int *orig_h)
+{
+	gib_list *l;
+	struct decode_job *job;
+	int ret;
+
+	if ((!workers && !procs) || decode_waiting)
+		return(0);
+
+	pthread_mutex_lock(&decode_lock);
+	if (!(l = feh_decode_find(filename, min_w, min_h))) {
+		pthread_mutex_unlock(&decode_lock);
+		return(0);
+	}
+	job = l->data;
+	if (job->state == JOB_QUEUED) {
+		/* not started yet, the caller is quicker on its own */
+		jobs = gib_list_remove(jobs, l);
+		pthread_mutex_unlock(&decode_lock);
+		feh_decode_job_free(job);
+		return(0);
+	}
+	ret = feh_decode_wait(job);
+	if ((ret == 1) && !job->cached) {
+		pthread_mutex_unlock(&decode_lock);
+		if (procs)
+			feh_decode_dispatch();
+		return(0);
+	}
+	jobs = gib_list_remove(jobs, l);
+	pthread_mutex_unlock(&decode_lock);
+
+	if (procs)
+		feh_decode_dispatch();
+
+	return(feh_decode_finish(job, ret, im, orig_w, orig_h));
+}
+
+/*
+ * Drops the jobs of files outside of the n files starting at l. Nobody is
+ * going to claim them anymore, e.g. because an EXIF preview was used instead.
+ */
+static void feh_decode_prune(gib_list * l, int n)
+{
+	gib_list *j, *next, *f;
+	struct decode_job *job;
+	int i;
+
+	pthread_mutex_lock(&decode_lock);
+	for (j = jobs; j; j = next) {
+		next = j->next;
+		job = j->data;
+		for (i = 0, f = l; f && (i < n); i++, f = f->next)
+			if (!strcmp(FEH_FILE(f->data)->filename, job->filename))
+				break;
+		if ((f && (i < n)) || job->abandoned)
+			continue;
+		if (job->state == JOB_RUNNING) {
+			/* a decoder process stays busy until its reply is read */
+			if (procs)
+				job->abandoned = 1;
+			continue;
+		}
+		jobs = gib_list_remove(jobs, j);
+		feh_decode_job_free(job);
+	}
+	pthread_mutex_unlock(&decode_lock);
+	return;
+}
+
+/*
+ * Returns 1 if feh_decode_claim would not have to wait for a worker, because
+ * the job of the file is done or there is none, and 0 while it is queued or
+ * being decoded.
+ */
+int feh_decode_ready(char *filename, int min_w, int min_h)
+{
+	gib_list *l;
+	struct decode_job *job;
+	struct pollfd pfd;
+	int i, ready = 1;
+
+	if (!workers && !procs)
+		return(1);
+	if (decode_waiting)
+		return(0);
+
+	/* decoder processes only get new work when we hand it to them */
+	if (procs)
+		feh_decode_dispatch();
+
+	pthread_mutex_lock(&decode_lock);
+	if ((l = feh_decode_find(filename, min_w, min_h))) {
+		job = l->data;
+		if (job->state == JOB_QUEUED)
+			ready = 0;
+		else if ((job->state == JOB_RUNNING) && !procs)
+			ready = 0;
+		else if (job->state == JOB_RUNNING) {
+			for (i = 0; i < num_workers; i++) {
+				if (procs[i].job != job)
+					continue;
+				pfd.fd = procs[i].sock;
+				pfd.events = POLLIN;
+				/* feh_decode_claim gives up on it right away if it hangs */
+				ready = (poll(&pfd, 1, 0) > 0)
+					|| (feh_get_time() - procs[i].started > DECODE_TIMEOUT);
+			}
+		}
+	}
+	pthread_mutex_unlock(&decode_lock);
+	return(ready);
+}
+
+/* Submits the n local files starting at l */
+static void feh_decode_submit_list(gib_list * l, int n, int min_w, int min_h,
+		char *(*cache_name) (char *))
+{
+	int i;
+	char *name;
+
+	for (i = 0; l && (i < n); i++, l = l->next) {
+		name = FEH_FILE(l->data)->filename;
+		if (strncmp(name, "http://", 7) && strncmp(name, "https://", 8)
+				&& strncmp(name, "ftp://", 6))
+			feh_decode_submit(name, cache_name, min_w, min_h);
+	}
+	return;
+}
+
+/*
+ * Queues the files following l. With a cache_name function, jobs look for a
+ * cached thumbnail of that name first (see feh_decode_submit).
+ */
+void feh_decode_prefetch_list(gib_list * l, int min_w, int min_h,
+		char *(*cache_name) (char *))
+{
+	if (!l || decode_waiting || !feh_decode_start())
+		return;
+
+	feh_decode_prune(l, 2 * num_workers + 1);
+	feh_decode_submit_list(l->next, 2 * num_workers, min_w, min_h,
+			cache_name);
+	return;
+}
+
+/*
+ * Queues the n files starting at l, in that order, and drops the jobs of all
+ * others. For callers which show several files at once and pick them up as
+ * they are done, see feh_decode_ready.
+ */
+void feh_decode_queue_list(gib_list * l, int n, int min_w, int min_h,
+		char *(*cache_name) (char *))
+{
+	if (!l || decode_waiting || !feh_decode_start())
+		return;
+
+	feh_decode_prune(l, n);
+	feh_decode_submit_list(l, n, min_w, min_h, cache_name);
+	return;
+}
+
+void feh_decode_cleanup(void)
+{
+	int i;
+	gib_list *l;
+
+	if (workers) {
+		pthread_mutex_lock(&decode_lock);
+		shutting_down = 1;
+		pthread_cond_broadcast(&decode_queued);
+		pthread_mutex_unlock(&decode_lock);
+
+		for (i = 0; i < num_workers; i++)
+			pthread_join(workers[i], NULL);
+		free(workers);
+		workers = NULL;
+	}
+
+	if (procs) {
+		for (i = 0; i < num_workers; i++) {
+			if (procs[i].pid == -1)
+				continue;
+			close(procs[i].sock);
+			kill(procs[i].pid, SIGTERM);
+			waitpid(procs[i].pid, NULL, 0);
+		}
+		free(procs);
+		procs = NULL;
+	}
+	num_workers = 0;
+
+	for (l = jobs; l; l = l->next)
+		feh_decode_job_free(l->data);
+	gib_list_free(jobs);
+	jobs = NULL;
+	return;
+}
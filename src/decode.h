@@ -0,0 +1,41 @@
+/* decode.h
+
+Copyright (C) 2011 by Daniel Friesel
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to
+deal in the Software without restriction, including without limitation the
+rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies of the Software and its documentation and acknowledgment shall be
+given in the documentation and software packages that this Software was
+used.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+#ifndef DECODE_H
+#define DECODE_H
+
+void feh_decode_submit(char *filename, char *(*cache_name) (char *),
+		int min_w, int min_h);
+int feh_decode_claim(char *filename, int min_w, int min_h, Imlib_Image * im,
+		int *orig_w, int *orig_h);
+int feh_decode_claim_cached(char *filename, int min_w, int min_h,
+		Imlib_Image * im, int *orig_w, int *orig_h);
+int feh_decode_ready(char *filename, int min_w, int min_h);
+void feh_decode_prefetch_list(gib_list * l, int min_w, int min_h,
+		char *(*cache_name) (char *));
+void feh_decode_queue_list(gib_list * l, int n, int min_w, int min_h,
+		char *(*cache_name) (char *));
+void feh_decode_cleanup(void);
+
+#endif
@@ -131,11 +131,17 @@ static void feh_event_handle_ButtonPress(XEvent * ev)
 		if ((winwid != NULL)
 				&& (winwid->type == WIN_TYPE_SLIDESHOW))
 			slideshow_change_image(winwid, SLIDE_PREV);
+		else if ((winwid != NULL)
+				&& (winwid->type == WIN_TYPE_THUMBNAIL))
+			feh_thumbnail_scroll(winwid, -1, 0);
 	} else if (ev->xbutton.button == opt.next_button) {
 		D(("Next Button Press event\n"));
 		if ((winwid != NULL)
 				&& (winwid->type == WIN_TYPE_SLIDESHOW))
 			slideshow_change_image(winwid, SLIDE_NEXT);
+		else if ((winwid != NULL)
+				&& (winwid->type == WIN_TYPE_THUMBNAIL))
+			feh_thumbnail_scroll(winwid, 1, 0);
 	} else {
 		D(("Received other ButtonPress event\n"));
 	}
@@ -0,0 +1,196 @@
+/* exif.c
+
+Copyright (C) 2011 by Daniel Friesel
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to
+deal in the Software without restriction, including without limitation the
+rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies of the Software and its documentation and acknowledgment shall be
+given in the documentation and software packages that this Software was
+used.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+#include "feh.h"
+#include "exif.h"
+
+/*
+ * Minimal JPEG / EXIF header parser. Digital cameras store a small JPEG
+ * preview (typically 160x120) in IFD1 of the EXIF data; it is located here
+ * so thumbnail mode can decode it instead of the full image.
+ */
+
+/* the EXIF segment and the frame header normally are within the first 64K */
+#define EXIF_HEADER_SIZE 131072
+
+static unsigned int exif_get16(unsigned char *p, int motorola)
+{
+	if (motorola)
+		return((p[0] << 8) | p[1]);
+	return((p[1] << 8) | p[0]);
+}
+
+static unsigned int exif_get32(unsigned char *p, int motorola)
+{
+	if (motorola)
+		return(((unsigned int) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]);
+	return(((unsigned int) p[3] << 24) | (p[2] << 16) | (p[1] << 8) | p[0]);
+}
+
+/*
+ * Returns the number of entries of the IFD at offset, or -1 if it (including
+ * the link to the next IFD) does not fit into the EXIF data.
+ */
+static int exif_ifd_entries(unsigned char *tiff, int tiff_len,
+		unsigned int offset, int motorola)
+{
+	unsigned int entries;
+
+	/* offset comes from the file, so don't let any of this wrap around */
+	if ((offset < 8) || (offset > (unsigned int) tiff_len - 2))
+		return(-1);
+	entries = exif_get16(tiff + offset, motorola);
+	if ((offset > (unsigned int) tiff_len - 6)
+			|| (entries > ((unsigned int) tiff_len - offset - 6) / 12))
+		return(-1);
+	return(entries);
+}
+
+/*
+ * Walks the markers of the JPEG data in buf. Stores the frame size in
+ * width / height and, if app1 is not NULL, the location of the EXIF APP1
+ * segment payload. Returns 1 if a frame header was found.
+ */
+static int exif_jpeg_scan(unsigned char *buf, int len, int *width,
+		int *height, unsigned char **app1, int *app1_len)
+{
+	int pos = 2, seglen;
+	unsigned char marker;
+
+	if ((len < 4) || (buf[0] != 0xff) || (buf[1] != 0xd8))
+		return(0);
+
+	while (pos + 4 <= len) {
+		if (buf[pos] != 0xff)
+			return(0);
+		marker = buf[pos + 1];
+		if (marker == 0xff) {
+			/* fill byte */
+			pos++;
+			continue;
+		}
+		if ((marker == 0xd9) || (marker == 0xda))
+			return(0);
+		seglen = (buf[pos + 2] << 8) | buf[pos + 3];
+		if (seglen < 2)
+			return(0);
+
+		if ((marker == 0xe1) && app1 && !*app1 && (pos + 2 + seglen <= len)
+				&& (seglen >= 8) && !memcmp(buf + pos + 4, "Exif\0\0", 6)) {
+			*app1 = buf + pos + 10;
+			*app1_len = seglen - 8;
+		}
+
+		/* SOF0 - SOF15, except DHT, JPG and DAC */
+		if ((marker >= 0xc0) && (marker <= 0xcf) && (marker != 0xc4)
+				&& (marker != 0xc8) && (marker != 0xcc)) {
+			if (pos + 9 > len)
+				return(0);
+			*height = (buf[pos + 5] << 8) | buf[pos + 6];
+			*width = (buf[pos + 7] << 8) | buf[pos + 8];
+			return((*width > 0) && (*height > 0));
+		}
+		pos += 2 + seglen;
+	}
+	return(0);
+}
+
+/*
+ * Looks for the JPEG preview in the EXIF data of filename. On success,
+ * returns a newly allocated copy of it (length in thumb_len) and stores the
+ * size of the main image in width / height and that of the preview in
+ * thumb_w / thumb_h. Returns NULL otherwise.
+ */
+unsigned char *feh_exif_thumbnail(char *filename, int *thumb_len,
+		int *width, int *height, int *thumb_w, int *thumb_h)
+{
+	FILE *fp;
+	unsigned char *buf, *tiff = NULL, *ifd, *ret = NULL;
+	int len, tiff_len, motorola, entries, i;
+	unsigned int offset, tag, value, thumb_off = 0, thumb_size = 0;
+	unsigned int compression = 6;
+
+	if (!(fp = fopen(filename, "rb")))
+		return(NULL);
+	buf = emalloc(EXIF_HEADER_SIZE);
+	len = fread(buf, 1, EXIF_HEADER_SIZE, fp);
+	fclose(fp);
+
+	if (!exif_jpeg_scan(buf, len, width, height, &tiff, &tiff_len)
+			|| !tiff || (tiff_len < 8)) {
+		free(buf);
+		return(NULL);
+	}
+
+	if (!memcmp(tiff, "MM", 2))
+		motorola = 1;
+	else if (!memcmp(tiff, "II", 2))
+		motorola = 0;
+	else {
+		free(buf);
+		return(NULL);
+	}
+
+	/* skip IFD0, the preview is described by IFD1 */
+	offset = exif_get32(tiff + 4, motorola);
+	if ((entries = exif_ifd_entries(tiff, tiff_len, offset, motorola)) < 0) {
+		free(buf);
+		return(NULL);
+	}
+	offset = exif_get32(tiff + offset + 2 + entries * 12, motorola);
+	if (!offset
+			|| (entries = exif_ifd_entries(tiff, tiff_len, offset, motorola)) < 0) {
+		free(buf);
+		return(NULL);
+	}
+
+	for (i = 0, ifd = tiff + offset + 2; i < entries; i++, ifd += 12) {
+		tag = exif_get16(ifd, motorola);
+		/* SHORT values are left-aligned in the value field */
+		if (exif_get16(ifd + 2, motorola) == 3)
+			value = exif_get16(ifd + 8, motorola);
+		else
+			value = exif_get32(ifd + 8, motorola);
+
+		if (tag == 0x0103)
+			compression = value;
+		else if (tag == 0x0201)
+			thumb_off = value;
+		else if (tag == 0x0202)
+			thumb_size = value;
+	}
+
+	if ((compression == 6) && thumb_off && thumb_size
+			&& (thumb_off < (unsigned int) tiff_len)
+			&& (thumb_size <= (unsigned int) tiff_len - thumb_off)
+			&& exif_jpeg_scan(tiff + thumb_off, thumb_size, thumb_w, thumb_h,
+				NULL, NULL)) {
+		ret = emalloc(thumb_size);
+		memcpy(ret, tiff + thumb_off, thumb_size);
+		*thumb_len = thumb_size;
+	}
+
+	free(buf);
+	return(ret);
+}
@@ -95,7 +95,8 @@ enum bgmode_type { BG_MODE_NONE = 0, BG_MODE_TILE, BG_MODE_CENTER,
 
 enum slide_change { SLIDE_NEXT, SLIDE_PREV, SLIDE_RAND, SLIDE_FIRST, SLIDE_LAST,
 	SLIDE_JUMP_FWD,
-	SLIDE_JUMP_BACK
+	SLIDE_JUMP_BACK,
+	SLIDE_CURRENT
 };
 
 typedef void (*sighandler_t) (int);
@@ -117,20 +118,31 @@ void init_loadables_mode(void);
 void init_unloadables_mode(void);
 void feh_clean_exit(void);
 int feh_load_image(Imlib_Image * im, feh_file * file);
+int feh_load_image_scaled(Imlib_Image * im, feh_file * file, int w, int h,
+		int *orig_w, int *orig_h);
 void show_mini_usage(void);
 void slideshow_change_image(winwidget winwid, int change);
 void slideshow_pause_toggle(winwidget w);
 char *slideshow_create_name(feh_file * file);
 void init_keyevents(void);
 void feh_event_handle_keypress(XEvent * ev);
+Bool feh_event_is_navigation(Display * d, XEvent * ev, XPointer arg);
 void feh_action_run(feh_file * file, char *action);
 char *feh_printf(char *str, feh_file * file);
 void feh_draw_zoom(winwidget w);
 void feh_draw_checks(winwidget win);
 void cb_slide_timer(void *data);
 void cb_reload_timer(void *data);
+void cb_slide_resume(void *data);
 char *feh_http_load_image(char *url);
+char *feh_http_tmpname(char *url);
+int feh_http_fetch(char *url, char *tmpname);
+int feh_http_fetch_uncached(char *url, char *tmpname);
+int feh_http_builtin_get(char *url, char *tmpname, char *extra_headers,
+		char *resp_headers, int resp_size);
 int feh_load_image_char(Imlib_Image * im, char *filename);
+int feh_load_set_interruptible(int interruptible);
+void feh_load_set_progress_window(winwidget w);
 void feh_draw_filename(winwidget w);
 void feh_draw_actions(winwidget w);
 void feh_draw_caption(winwidget w);
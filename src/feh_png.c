@@ -30,7 +30,7 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include <stdio.h>
 #include <stdarg.h>
 
-#define FEH_PNG_COMPRESSION 3
+#define FEH_PNG_COMPRESSION 1
 #define FEH_PNG_NUM_COMMENTS 4
 
 gib_hash *feh_png_read_comments(char *file)
@@ -94,46 +94,51 @@ gib_hash *feh_png_read_comments(char *file)
 }
 
 /* grab image data from image and write info file with comments ... */
-int feh_png_write_png(Imlib_Image image, char *file, ...)
+/*
+ * Writes the w x h ARGB pixels in data to file as an RGBA PNG with the
+ * tEXt key/value pairs in comments (NULL terminated, may be NULL). The
+ * image goes to a temporary file which is renamed to file once complete,
+ * so readers never see a partial one. Does not use Imlib2, so it may be
+ * called from any thread. Returns 1 on success.
+ */
+int feh_png_write_data(char *file, DATA32 * data, int w, int h,
+		char **comments)
 {
 	FILE *fp;
-	int i, w, h;
+	int i, fd;
+	char *tmp_file;
 
 	png_structp png_ptr;
 	png_infop info_ptr;
 	png_color_8 sig_bit;
 
-	DATA32 *ptr;
-
 #ifdef PNG_TEXT_SUPPORTED
-	va_list args;
 	png_text text[FEH_PNG_NUM_COMMENTS];
-	char *pair_key, *pair_text;
 #endif				/* PNG_TEXT_SUPPORTED */
 
-	if (!(fp = fopen(file, "wb")))
+	tmp_file = estrjoin("", file, ".XXXXXX", NULL);
+	if ((fd = mkstemp(tmp_file)) == -1) {
+		free(tmp_file);
 		return 0;
-
-	png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-	if (!png_ptr)
-		return 0;
-
-	info_ptr = png_create_info_struct(png_ptr);
-	if (!info_ptr) {
-		png_destroy_write_struct(&png_ptr, (png_infopp) NULL);
+	}
+	if (!(fp = fdopen(fd, "wb"))) {
+		close(fd);
+		unlink(tmp_file);
+		free(tmp_file);
 		return 0;
 	}
 
-	if (setjmp(png_ptr->jmpbuf)) {
+	png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	info_ptr = png_ptr ? png_create_info_struct(png_ptr) : NULL;
+	if (!info_ptr || setjmp(png_jmpbuf(png_ptr))) {
+		if (png_ptr)
+			png_destroy_write_struct(&png_ptr, &info_ptr);
 		fclose(fp);
-		png_destroy_write_struct(&png_ptr, &info_ptr);
-		png_destroy_info_struct(png_ptr, &info_ptr);
+		unlink(tmp_file);
+		free(tmp_file);
 		return 0;
 	}
 
-	w = gib_imlib_image_get_width(image);
-	h = gib_imlib_image_get_height(image);
-
 	png_init_io(png_ptr, fp);
 
 	png_set_IHDR(png_ptr, info_ptr, w, h, 8, PNG_COLOR_TYPE_RGB_ALPHA,
@@ -152,41 +157,356 @@ int feh_png_write_png(Imlib_Image image, char *file, ...)
 	png_set_sBIT(png_ptr, info_ptr, &sig_bit);
 
 #ifdef PNG_TEXT_SUPPORTED
-	va_start(args, file);
-	for (i = 0; i < FEH_PNG_NUM_COMMENTS; i++) {
-		if ((pair_key = va_arg(args, char *))
-		    && (pair_text = va_arg(args, char *))) {
-			/* got a complete pair, add to info structure */
-			text[i].key = pair_key;
-			text[i].text = pair_text;
-			text[i].compression = PNG_TEXT_COMPRESSION_NONE;
-		} else
-			break;
+	for (i = 0; comments && (i < FEH_PNG_NUM_COMMENTS)
+			&& comments[2 * i] && comments[2 * i + 1]; i++) {
+		text[i].key = comments[2 * i];
+		text[i].text = comments[2 * i + 1];
+		text[i].compression = PNG_TEXT_COMPRESSION_NONE;
 	}
-	va_end(args);
 
 	if (i > 0)
 		png_set_text(png_ptr, info_ptr, text, i);
 #endif				/* PNG_TEXT_SUPPORTED */
 
+	/*
+	 * Thumbnails are small and read far more often than written, but
+	 * writing them is a large part of generating them: use the fastest
+	 * zlib level with one cheap filter instead of trying all five.
+	 */
 	png_set_compression_level(png_ptr, FEH_PNG_COMPRESSION);
+	png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, PNG_FILTER_SUB);
 	png_write_info(png_ptr, info_ptr);
 	png_set_shift(png_ptr, &sig_bit);
 	png_set_packing(png_ptr);
 
 	/* write image data */
-	imlib_context_set_image(image);
-	ptr = imlib_image_get_data();
-	for (i = 0; i < h; i++, ptr += w)
-		png_write_row(png_ptr, (png_bytep) ptr);
+	for (i = 0; i < h; i++, data += w)
+		png_write_row(png_ptr, (png_bytep) data);
 
 	png_write_end(png_ptr, info_ptr);
 	png_destroy_write_struct(&png_ptr, &info_ptr);
-	png_destroy_info_struct(png_ptr, &info_ptr);
 
+	if (fclose(fp) || rename(tmp_file, file)) {
+		unlink(tmp_file);
+		free(tmp_file);
+		return 0;
+	}
+
+	free(tmp_file);
+	return 1;
+}
+
+/*
+ * Writes image to file, followed by up to FEH_PNG_NUM_COMMENTS tEXt
+ * key/value pairs and a NULL. See feh_png_write_data.
+ */
+int feh_png_write_png(Imlib_Image image, char *file, ...)
+{
+	va_list args;
+	char *comments[2 * FEH_PNG_NUM_COMMENTS + 1];
+	int i;
+
+	va_start(args, file);
+	for (i = 0; i < 2 * FEH_PNG_NUM_COMMENTS; i++)
+		if (!(comments[i] = va_arg(args, char *)))
+			break;
+	va_end(args);
+	comments[i] = NULL;
+
+	imlib_context_set_image(image);
+	return feh_png_write_data(file, imlib_image_get_data_for_reading_only(),
+			gib_imlib_image_get_width(image),
+			gib_imlib_image_get_height(image), comments);
+}
+
+/* buffers of feh_png_decode, kept together so they survive a longjmp */
+struct feh_png_scale {
+	unsigned char *row;
+	double *sum;
+	int *xmap;
+	int *xcount;
+	DATA32 *data;
+};
+
+static void feh_png_scale_free(struct feh_png_scale *s)
+{
+	free(s->row);
+	free(s->sum);
+	free(s->xmap);
+	free(s->xcount);
+	free(s->data);
+	free(s);
+}
+
+/*
+ * Checks the Thumb::MTime comment of a freedesktop.org thumbnail against
+ * mtime and stores the original image size it records (0 if missing).
+ */
+static int feh_png_thumb_current(png_structp png_ptr, png_infop info_ptr,
+		time_t mtime, int *orig_w, int *orig_h)
+{
+	int current = 0;
+#ifdef PNG_TEXT_SUPPORTED
+	png_textp text_ptr;
+	int i, comments = 0;
+
+	png_get_text(png_ptr, info_ptr, &text_ptr, &comments);
+	for (i = 0; i < comments; i++) {
+		if (!strcmp(text_ptr[i].key, "Thumb::MTime"))
+			current = ((time_t) strtol(text_ptr[i].text, NULL, 10) == mtime);
+		else if (!strcmp(text_ptr[i].key, "Thumb::Image::Width"))
+			*orig_w = atoi(text_ptr[i].text);
+		else if (!strcmp(text_ptr[i].key, "Thumb::Image::Height"))
+			*orig_h = atoi(text_ptr[i].text);
+	}
+#endif				/* PNG_TEXT_SUPPORTED */
+	return current;
+}
+
+/*
+ * Decodes file into a newly allocated ARGB buffer of *w x *h pixels, reading
+ * it one row at a time. If the image is at least twice as large as
+ * min_w x min_h, it is scaled down while reading so that it still covers
+ * that size, averaging every source pixel into its output pixel (box
+ * filter). Memory use then depends on the output size and the image width
+ * only. min_w = min_h = 0 always decodes at full size.
+ *
+ * Does not use Imlib2, so it may be called from any thread. Returns NULL if
+ * file is not a non-interlaced PNG or cannot be decoded.
+ */
+static DATA32 *feh_png_decode_file(char *file, int min_w, int min_h,
+		time_t *mtime, int *valid, int *w, int *h, int *orig_w, int *orig_h,
+		int *has_alpha)
+{
+	FILE *fp;
+	png_structp png_ptr;
+	png_infop info_ptr;
+	png_uint_32 iw, ih, x, y;
+	int depth, color_type, interlace, sig_bytes, alpha;
+	int ow, oh, ox, oy, rows, i;
+	double scale, n;
+	struct feh_png_scale *s;
+	unsigned char *p;
+	double *sp;
+	DATA32 *ret;
+
+	if (!(fp = fopen(file, "rb")))
+		return NULL;
+
+	if (!(sig_bytes = feh_png_file_is_png(fp))) {
+		fclose(fp);
+		return NULL;
+	}
+
+	png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	if (!png_ptr) {
+		fclose(fp);
+		return NULL;
+	}
+
+	info_ptr = png_create_info_struct(png_ptr);
+	if (!info_ptr) {
+		png_destroy_read_struct(&png_ptr, (png_infopp) NULL, (png_infopp) NULL);
+		fclose(fp);
+		return NULL;
+	}
+
+	s = emalloc(sizeof(struct feh_png_scale));
+	memset(s, 0, sizeof(struct feh_png_scale));
+
+	if (setjmp(png_jmpbuf(png_ptr))) {
+		png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+		fclose(fp);
+		feh_png_scale_free(s);
+		return NULL;
+	}
+
+	png_init_io(png_ptr, fp);
+	png_set_sig_bytes(png_ptr, sig_bytes);
+	png_read_info(png_ptr, info_ptr);
+
+	/* tEXt chunks before the image data have been read, pixels have not */
+	if (mtime) {
+		*orig_w = *orig_h = 0;
+		if (!feh_png_thumb_current(png_ptr, info_ptr, *mtime, orig_w, orig_h)) {
+			png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+			fclose(fp);
+			feh_png_scale_free(s);
+			return NULL;
+		}
+		*valid = 1;
+	}
+
+	png_get_IHDR(png_ptr, info_ptr, &iw, &ih, &depth, &color_type, &interlace,
+			NULL, NULL);
+
+	if (interlace != PNG_INTERLACE_NONE)
+		png_error(png_ptr, "interlaced");
+
+	scale = (double) min_w / iw;
+	if ((double) min_h / ih > scale)
+		scale = (double) min_h / ih;
+	if ((scale > 0.5) || (min_w < 1) || (min_h < 1))
+		scale = 1.0;
+
+	ow = ceil(iw * scale);
+	oh = ceil(ih * scale);
+	if (ow < 1)
+		ow = 1;
+	if (oh < 1)
+		oh = 1;
+
+	alpha = (color_type & PNG_COLOR_MASK_ALPHA)
+		|| png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS);
+
+	if (depth == 16)
+		png_set_strip_16(png_ptr);
+	png_set_expand(png_ptr);
+	if (!(color_type & PNG_COLOR_MASK_COLOR))
+		png_set_gray_to_rgb(png_ptr);
+	if (!alpha)
+		png_set_filler(png_ptr, 0xff, PNG_FILLER_AFTER);
+	png_read_update_info(png_ptr, info_ptr);
+
+	if (png_get_rowbytes(png_ptr, info_ptr) != iw * 4)
+		png_error(png_ptr, "unexpected row format");
+
+	/*
+	 * This runs in decoder threads, where emalloc exiting would take all of
+	 * feh down. Fail the decode instead, the caller falls back to Imlib2.
+	 */
+	if ((size_t) ow * oh > INT_MAX / sizeof(DATA32))
+		png_error(png_ptr, "image too large");
+	if (!(s->data = malloc((size_t) ow * oh * sizeof(DATA32))))
+		png_error(png_ptr, "out of memory");
+	s->row = emalloc(iw * 4);
+
+	if (scale == 1.0) {
+		for (y = 0; y < ih; y++) {
+			png_read_row(png_ptr, s->row, NULL);
+			for (x = 0, p = s->row; x < iw; x++, p += 4)
+				s->data[y * ow + x] = ((DATA32) p[3] << 24) | (p[0] << 16)
+					| (p[1] << 8) | p[2];
+		}
+	} else {
+		s->sum = emalloc(ow * 4 * sizeof(double));
+		s->xmap = emalloc(iw * sizeof(int));
+		s->xcount = emalloc(ow * sizeof(int));
+
+		memset(s->xcount, 0, ow * sizeof(int));
+		for (x = 0; x < iw; x++) {
+			s->xmap[x] = (double) x * ow / iw;
+			s->xcount[s->xmap[x]]++;
+		}
+		memset(s->sum, 0, ow * 4 * sizeof(double));
+
+		for (y = 0, oy = 0, rows = 0; y < ih; y++) {
+			png_read_row(png_ptr, s->row, NULL);
+			for (x = 0, p = s->row; x < iw; x++, p += 4) {
+				sp = s->sum + s->xmap[x] * 4;
+				sp[0] += p[0];
+				sp[1] += p[1];
+				sp[2] += p[2];
+				sp[3] += p[3];
+			}
+			rows++;
+
+			/* last source row of this output row */
+			if ((y + 1 == ih) || ((int) ((double) (y + 1) * oh / ih) != oy)) {
+				for (ox = 0, sp = s->sum; ox < ow; ox++, sp += 4) {
+					n = (double) s->xcount[ox] * rows;
+					s->data[oy * ow + ox] =
+						((DATA32) (sp[3] / n + 0.5) << 24)
+						| ((DATA32) (sp[0] / n + 0.5) << 16)
+						| ((DATA32) (sp[1] / n + 0.5) << 8)
+						| (DATA32) (sp[2] / n + 0.5);
+				}
+				for (i = 0; i < ow * 4; i++)
+					s->sum[i] = 0;
+				rows = 0;
+				oy++;
+			}
+		}
+	}
+
+	png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
 	fclose(fp);
 
-	return 0;
+	*w = ow;
+	*h = oh;
+	if (!mtime) {
+		*orig_w = iw;
+		*orig_h = ih;
+	}
+	*has_alpha = alpha;
+	ret = s->data;
+	s->data = NULL;
+	feh_png_scale_free(s);
+	return ret;
+}
+
+DATA32 *feh_png_decode(char *file, int min_w, int min_h, int *w, int *h,
+		int *orig_w, int *orig_h, int *has_alpha)
+{
+	return feh_png_decode_file(file, min_w, min_h, NULL, NULL, w, h,
+			orig_w, orig_h, has_alpha);
+}
+
+/*
+ * Decodes the freedesktop.org thumbnail file at full size in a single pass,
+ * provided its Thumb::MTime matches mtime. A stale thumbnail is rejected
+ * after reading only the chunks before the image data. *orig_w / *orig_h
+ * are set from Thumb::Image::Width / Height (0 if missing), *valid tells
+ * whether the thumbnail is current, so callers can still try another
+ * loader if it is but could not be decoded here (e.g. interlaced).
+ */
+DATA32 *feh_png_decode_thumbnail(char *file, time_t mtime, int *w, int *h,
+		int *orig_w, int *orig_h, int *has_alpha, int *valid)
+{
+	*valid = 0;
+	return feh_png_decode_file(file, 0, 0, &mtime, valid, w, h,
+			orig_w, orig_h, has_alpha);
+}
+
+/*
+ * Loads file scaled down to cover min_w x min_h, see feh_png_decode.
+ * Returns NULL if file is not a non-interlaced PNG at least twice as large
+ * as needed -- the normal loader is fine for those.
+ */
+Imlib_Image feh_png_load_scaled(char *file, int min_w, int min_h,
+		int *orig_w, int *orig_h)
+{
+	FILE *fp;
+	unsigned char ihdr[24];
+	DATA32 *data;
+	int w, h, has_alpha;
+	Imlib_Image im;
+
+	/* check the size first, there is no point in decoding small images twice */
+	if (!(fp = fopen(file, "rb")))
+		return NULL;
+	if ((fread(ihdr, 1, sizeof(ihdr), fp) != sizeof(ihdr))
+			|| png_sig_cmp(ihdr, 0, 8)) {
+		fclose(fp);
+		return NULL;
+	}
+	fclose(fp);
+	w = (ihdr[16] << 24) | (ihdr[17] << 16) | (ihdr[18] << 8) | ihdr[19];
+	h = (ihdr[20] << 24) | (ihdr[21] << 16) | (ihdr[22] << 8) | ihdr[23];
+	if ((w < 2 * min_w) || (h < 2 * min_h))
+		return NULL;
+
+	if (!(data = feh_png_decode(file, min_w, min_h, &w, &h, orig_w, orig_h,
+					&has_alpha)))
+		return NULL;
+
+	im = imlib_create_image_using_copied_data(w, h, data);
+	free(data);
+	if (im) {
+		imlib_context_set_image(im);
+		imlib_image_set_has_alpha(has_alpha);
+	}
+	return im;
 }
 
 /* check PNG signature */
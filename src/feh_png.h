@@ -33,6 +33,14 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 gib_hash *feh_png_read_comments(char *file);
 int feh_png_write_png(Imlib_Image image, char *file, ...);
+int feh_png_write_data(char *file, DATA32 * data, int w, int h,
+		char **comments);
+DATA32 *feh_png_decode(char *file, int min_w, int min_h, int *w, int *h,
+		int *orig_w, int *orig_h, int *has_alpha);
+DATA32 *feh_png_decode_thumbnail(char *file, time_t mtime, int *w, int *h,
+		int *orig_w, int *orig_h, int *has_alpha, int *valid);
+Imlib_Image feh_png_load_scaled(char *file, int min_w, int min_h,
+		int *orig_w, int *orig_h);
 
 int feh_png_file_is_png(FILE * fp);
 
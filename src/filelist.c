@@ -27,6 +27,9 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include "feh.h"
 #include "filelist.h"
 #include "options.h"
+#include "http.h"
+#include "tiles.h"
+#include "readahead.h"
 
 gib_list *filelist = NULL;
 int filelist_len = 0;
@@ -49,6 +52,8 @@ feh_file *feh_file_new(char *filename)
 	else
 		newfile->name = estrdup(filename);
 	newfile->info = NULL;
+	newfile->tiled = 0;
+	newfile->prescaled = 0;
 	return(newfile);
 }
 
@@ -242,6 +247,8 @@ gib_list *feh_file_info_preload(gib_list * list)
 	for (l = list; l; l = l->next) {
 		file = FEH_FILE(l->data);
 		D(("file %p, file->next %p, file->name %s\n", l, l->next, file->name));
+		feh_http_prefetch_list(l);
+		feh_readahead_list(l);
 		if (feh_file_info_load(file, NULL)) {
 			D(("Failed to load file %p\n", file));
 			remove_list = gib_list_add_front(remove_list, l);
@@ -250,8 +257,10 @@ gib_list *feh_file_info_preload(gib_list * list)
 		} else if (opt.verbose)
 			feh_display_status('.');
 	}
-	if (opt.verbose)
+	if (opt.verbose) {
 		fprintf(stdout, "\n");
+		feh_readahead_report();
+	}
 
 	if (remove_list) {
 		for (l = remove_list; l; l = l->next)
@@ -267,6 +276,7 @@ int feh_file_info_load(feh_file * file, Imlib_Image im)
 {
 	struct stat st;
 	int need_free = 1;
+	int tiled_w, tiled_h;
 	Imlib_Image im1;
 
 	D(("im is %p\n", im));
@@ -299,6 +309,18 @@ int feh_file_info_load(feh_file * file, Imlib_Image im)
 		return(1);
 	}
 
+	/* the loaded image of a tiled file is only its overview */
+	if (feh_tiles_wanted(file->filename, &tiled_w, &tiled_h)) {
+		file->info = feh_file_info_new();
+		file->info->width = tiled_w;
+		file->info->height = tiled_h;
+		file->info->has_alpha = im ? gib_imlib_image_has_alpha(im) : 0;
+		file->info->pixels = tiled_w * tiled_h;
+		file->info->format = estrdup("png");
+		file->info->size = st.st_size;
+		return(0);
+	}
+
 	if (im)
 		im1 = im;
 	else if (!feh_load_image(&im1, file))
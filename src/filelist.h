@@ -33,6 +33,11 @@ struct __feh_file {
 
 	/* info stuff */
 	feh_file_info *info;	/* only set when needed */
+
+	/* loaded as the overview of a tile pyramid */
+	unsigned char tiled;
+	/* loaded from the display cache, scaled down to the screen size */
+	unsigned char prescaled;
 };
 
 struct __feh_file_info {
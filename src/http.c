@@ -0,0 +1,646 @@
+/* http.c
+
+Copyright (C) 2011 by Daniel Friesel
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to
+deal in the Software without restriction, including without limitation the
+rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies of the Software and its documentation and acknowledgment shall be
+given in the documentation and software packages that this Software was
+used.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+#include "feh.h"
+#include "filelist.h"
+#include "options.h"
+#include "http.h"
+#include "mjpeg.h"
+#include "md5.h"
+
+/*
+ * Background downloads for URLs in the filelist. Every download runs
+ * feh_http_fetch in a child process, so both the builtin client and wget
+ * work unchanged. feh_http_load_image claims the result when it needs the
+ * image; until then, the children run while feh decodes and renders.
+ */
+
+#define DL_QUEUED  0
+#define DL_RUNNING 1
+#define DL_DONE    2
+#define DL_FAILED  3
+#define DL_STREAM  4
+
+typedef struct __feh_download feh_download;
+
+struct __feh_download {
+	char *url;
+	char *host;
+	char *tmpname;
+	pid_t pid;
+	unsigned char state;
+};
+
+static gib_list *downloads = NULL;
+
+static int feh_http_is_url(char *name)
+{
+	return (!strncmp(name, "http://", 7) || !strncmp(name, "https://", 8)
+			|| !strncmp(name, "ftp://", 6));
+}
+
+static gib_list *feh_http_prefetch_find(char *url)
+{
+	gib_list *l;
+
+	for (l = downloads; l; l = l->next)
+		if (!strcmp(((feh_download *) l->data)->url, url))
+			return(l);
+	return(NULL);
+}
+
+static void feh_http_prefetch_remove(gib_list * l)
+{
+	feh_download *dl = l->data;
+
+	free(dl->url);
+	free(dl->host);
+	if (dl->tmpname)
+		free(dl->tmpname);
+	free(dl);
+	downloads = gib_list_remove(downloads, l);
+}
+
+static int feh_http_prefetch_running(char *host)
+{
+	gib_list *l;
+	feh_download *dl;
+	int count = 0;
+
+	for (l = downloads; l; l = l->next) {
+		dl = l->data;
+		if ((dl->state == DL_RUNNING) && (!host || !strcmp(dl->host, host)))
+			count++;
+	}
+	return(count);
+}
+
+static void feh_http_prefetch_reap(feh_download * dl, int status)
+{
+	if (WIFEXITED(status) && (WEXITSTATUS(status) == 0))
+		dl->state = DL_DONE;
+	else if (WIFEXITED(status) && (WEXITSTATUS(status) == 2)) {
+		/* an MJPEG stream, which only the main process can keep open */
+		dl->state = DL_STREAM;
+		unlink(dl->tmpname);
+	} else {
+		/* feh_http_fetch already complained in the child */
+		D(("prefetch of %s failed\n", dl->url));
+		dl->state = DL_FAILED;
+		unlink(dl->tmpname);
+	}
+}
+
+/* Returns 0 if fork() failed and the download stays queued */
+static int feh_http_prefetch_start(feh_download * dl)
+{
+	/*
+	 * Not added to rm_filelist here: feh_load_image does that once the
+	 * file is claimed, and feh_http_prefetch_cleanup removes unclaimed ones.
+	 */
+	if (!dl->tmpname)
+		dl->tmpname = feh_http_tmpname(dl->url);
+
+	fflush(stdout);
+	fflush(stderr);
+
+	if ((dl->pid = fork()) < 0) {
+		D(("fork failed, leaving %s queued\n", dl->url));
+		return(0);
+	} else if (dl->pid == 0) {
+		feh_mjpeg_set_adopt(0);
+		if (!feh_http_fetch(dl->url, dl->tmpname))
+			_exit(1);
+		_exit(feh_mjpeg_seen() ? 2 : 0);
+	}
+
+	D(("prefetching %s as %s (pid %d)\n", dl->url, dl->tmpname, dl->pid));
+	dl->state = DL_RUNNING;
+	return(1);
+}
+
+static void feh_http_prefetch_add(char *url)
+{
+	feh_download *dl;
+
+	if (feh_http_prefetch_find(url))
+		return;
+
+	dl = emalloc(sizeof(feh_download));
+	dl->url = estrdup(url);
+	if (!(dl->host = feh_strip_hostname(url)))
+		dl->host = estrdup(url);
+	dl->tmpname = NULL;
+	dl->pid = 0;
+	dl->state = DL_QUEUED;
+	downloads = gib_list_add_end(downloads, dl);
+}
+
+/* Drop queued downloads which have not been started yet */
+static void feh_http_prefetch_unqueue(void)
+{
+	gib_list *l, *next;
+
+	for (l = downloads; l; l = next) {
+		next = l->next;
+		if (((feh_download *) l->data)->state == DL_QUEUED)
+			feh_http_prefetch_remove(l);
+	}
+}
+
+/*
+ * Reap finished downloads and start queued ones, in queue order, as long as
+ * the global and per-host limits allow it. Called on every main loop
+ * iteration, so finished children do not linger as zombies.
+ */
+void feh_http_prefetch_poll(void)
+{
+	gib_list *l;
+	feh_download *dl;
+	int status;
+	int running;
+
+	for (l = downloads; l; l = l->next) {
+		dl = l->data;
+		if ((dl->state == DL_RUNNING)
+				&& (waitpid(dl->pid, &status, WNOHANG) == dl->pid))
+			feh_http_prefetch_reap(dl, status);
+	}
+
+	running = feh_http_prefetch_running(NULL);
+	for (l = downloads; l && (running < opt.http_jobs); l = l->next) {
+		dl = l->data;
+		if ((dl->state == DL_QUEUED)
+				&& (feh_http_prefetch_running(dl->host) < opt.http_host_jobs)) {
+			if (!feh_http_prefetch_start(dl))
+				break;
+			running++;
+		}
+	}
+	return;
+}
+
+/*
+ * Called by feh_http_load_image. If url was prefetched, wait for its
+ * download to finish and hand over the temporary file. Returns
+ * PREFETCH_NONE if the caller has to fetch url itself.
+ */
+int feh_http_prefetch_claim(char *url, char **tmpname)
+{
+	gib_list *l;
+	feh_download *dl;
+	int status;
+	int ret = PREFETCH_NONE;
+
+	if (!(l = feh_http_prefetch_find(url)))
+		return(PREFETCH_NONE);
+
+	dl = l->data;
+	if (dl->state == DL_RUNNING) {
+		D(("waiting for prefetch of %s\n", url));
+		if (waitpid(dl->pid, &status, 0) == dl->pid)
+			feh_http_prefetch_reap(dl, status);
+		else {
+			dl->state = DL_FAILED;
+			unlink(dl->tmpname);
+		}
+	}
+
+	if (dl->state == DL_DONE) {
+		*tmpname = dl->tmpname;
+		dl->tmpname = NULL;
+		ret = PREFETCH_DONE;
+	} else if (dl->state == DL_FAILED)
+		ret = PREFETCH_FAILED;
+
+	feh_http_prefetch_remove(l);
+	feh_http_prefetch_poll();
+	return(ret);
+}
+
+/*
+ * Queue the filelist entries starting at l. Looking twice as far ahead as
+ * there are download slots keeps all of them busy.
+ */
+void feh_http_prefetch_list(gib_list * l)
+{
+	int count = opt.http_jobs * 2;
+
+	if (opt.http_jobs <= 0)
+		return;
+
+	for (; l && (count > 0); l = l->next, count--)
+		if (feh_http_is_url(FEH_FILE(l->data)->filename))
+			feh_http_prefetch_add(FEH_FILE(l->data)->filename);
+
+	feh_http_prefetch_poll();
+	return;
+}
+
+/*
+ * Queue the count images before and after l. Downloads for images the user
+ * navigated away from are dropped unless they have already been started.
+ */
+void feh_http_prefetch_neighbours(gib_list * root, gib_list * l, int count)
+{
+	gib_list *next = l, *prev = l;
+
+	if ((opt.http_jobs <= 0) || !l)
+		return;
+
+	feh_http_prefetch_unqueue();
+
+	for (; count > 0; count--) {
+		next = next->next ? next->next : root;
+		prev = prev->prev ? prev->prev : gib_list_last(root);
+
+		if ((next != l) && feh_http_is_url(FEH_FILE(next->data)->filename))
+			feh_http_prefetch_add(FEH_FILE(next->data)->filename);
+		if ((prev != l) && feh_http_is_url(FEH_FILE(prev->data)->filename))
+			feh_http_prefetch_add(FEH_FILE(prev->data)->filename);
+	}
+
+	feh_http_prefetch_poll();
+	return;
+}
+
+/*
+ * Stop running downloads so they don't recreate already removed files, and
+ * remove finished ones nobody claimed
+ */
+void feh_http_prefetch_cleanup(void)
+{
+	gib_list *l;
+	feh_download *dl;
+
+	for (l = downloads; l; l = l->next) {
+		dl = l->data;
+		if (dl->state == DL_RUNNING) {
+			kill(dl->pid, SIGTERM);
+			waitpid(dl->pid, NULL, 0);
+			unlink(dl->tmpname);
+		} else if ((dl->state == DL_DONE) && !opt.keep_http)
+			unlink(dl->tmpname);
+	}
+	return;
+}
+
+/*
+ * On-disk HTTP cache for the builtin client. For every URL, the response body
+ * and its validators (ETag, Last-Modified) are stored under
+ * $XDG_CACHE_HOME/feh/http, named after the md5 sum of the URL. Later
+ * requests are conditional, so an unchanged image costs a 304 response
+ * instead of a full download.
+ */
+
+#define HTTP_HEADER_SIZE 8192
+#define HTTP_MAX_REDIRECTS 5
+#define EOL "\015\012"
+
+static char *cache_dir = NULL;
+static int cache_ok = -1;
+
+/* result of the last feh_http_cache_revalidate, used up by the next fetch */
+static char *validated_url = NULL;
+static int validated_state;
+
+int feh_http_cache_usable(char *url)
+{
+	if (!opt.http_cache || strncmp(url, "http://", 7))
+		return(0);
+	if (cache_ok == -1)
+		cache_ok = ((cache_dir = feh_cache_dir("http")) != NULL);
+	return(cache_ok);
+}
+
+static char *feh_http_cache_name(char *url, char *suffix)
+{
+	int i;
+	char hex[33];
+	md5_state_t pms;
+	md5_byte_t digest[16];
+
+	md5_init(&pms);
+	md5_append(&pms, (unsigned char *)url, strlen(url));
+	md5_finish(&pms, digest);
+
+	for (i = 0; i < 16; i++)
+		sprintf(hex + 2 * i, "%02x", digest[i]);
+
+	return(estrjoin("", cache_dir, "/", hex, suffix, NULL));
+}
+
+/* Returns the value of the header field name, or NULL */
+static char *feh_http_header_value(char *headers, char *name)
+{
+	char *line, *end, *value;
+	int len = strlen(name);
+
+	for (line = headers; line && *line; line = strchr(line, '\n')) {
+		if (*line == '\n')
+			line++;
+		if (!strncasecmp(line, name, len) && (line[len] == ':')) {
+			line += len + 1;
+			while ((*line == ' ') || (*line == '\t'))
+				line++;
+			for (end = line; *end && (*end != '\r') && (*end != '\n'); end++);
+			value = emalloc(end - line + 1);
+			memcpy(value, line, end - line);
+			value[end - line] = '\0';
+			return(value);
+		}
+	}
+	return(NULL);
+}
+
+/* Absolute URL a 3xx response for url points to, or NULL */
+static char *feh_http_redirect_target(char *url, char *headers)
+{
+	char *loc, *target, *host, *path, *query, *end, *p;
+
+	if (!(loc = feh_http_header_value(headers, "Location")))
+		return(NULL);
+
+	if (strstr(loc, "://"))
+		return(loc);
+
+	if (!(host = strstr(url, "://"))) {
+		free(loc);
+		return(NULL);
+	}
+	host += 3;
+	if (!(path = strpbrk(host, "/?#")))
+		path = url + strlen(url);
+
+	if (!strncmp(loc, "//", 2)) {
+		/* same scheme, other host */
+		end = host - 2;
+	} else if (loc[0] == '/') {
+		/* absolute path on the same host */
+		end = path;
+	} else {
+		/* relative to the directory of url, ignoring its query */
+		if (!(query = strpbrk(path, "?#")))
+			query = path + strlen(path);
+		for (end = NULL, p = path; p < query; p++)
+			if (*p == '/')
+				end = p + 1;
+		if (!end)
+			end = path;
+	}
+
+	target = emalloc((end - url) + strlen(loc) + 2);
+	memcpy(target, url, end - url);
+	target[end - url] = '\0';
+	if ((loc[0] != '/') && (end[-1] != '/'))
+		strcat(target, "/");
+	strcat(target, loc);
+	free(loc);
+	return(target);
+}
+
+static int feh_http_cache_copy(char *from, char *to);
+
+static void feh_http_cache_read_meta(char *meta_file, char **etag, char **lastmod)
+{
+	FILE *fp;
+	char line[1024];
+	char *nl;
+
+	*etag = *lastmod = NULL;
+
+	if (!(fp = fopen(meta_file, "r")))
+		return;
+
+	while (fgets(line, sizeof(line), fp)) {
+		if ((nl = strchr(line, '\n')))
+			*nl = '\0';
+		if (!strncmp(line, "ETag: ", 6) && !*etag)
+			*etag = estrdup(line + 6);
+		else if (!strncmp(line, "Last-Modified: ", 15) && !*lastmod)
+			*lastmod = estrdup(line + 15);
+	}
+	fclose(fp);
+	return;
+}
+
+static void feh_http_cache_write_meta(char *meta_file, char *etag, char *lastmod)
+{
+	FILE *fp;
+	char *tmp_file;
+	char pid[16];
+
+	snprintf(pid, sizeof(pid), ".%d", (int) getpid());
+	tmp_file = estrjoin("", meta_file, pid, NULL);
+
+	if (!(fp = fopen(tmp_file, "w"))) {
+		free(tmp_file);
+		return;
+	}
+	if (etag)
+		fprintf(fp, "ETag: %s\n", etag);
+	if (lastmod)
+		fprintf(fp, "Last-Modified: %s\n", lastmod);
+	if ((fclose(fp) != 0) || (rename(tmp_file, meta_file) != 0))
+		unlink(tmp_file);
+	free(tmp_file);
+	return;
+}
+
+/*
+ * Send a conditional GET for url and update the cache entry. Returns
+ * HTTP_CACHE_NOT_MODIFIED if the cached body is still current. Redirects
+ * are followed like wget does; the result is cached under url.
+ *
+ * Other responses are not cached. If pass_file is set, their body is
+ * stored there like the uncached builtin client does (HTTP_CACHE_PASSED).
+ * Without it, client and server errors (4xx, 5xx) fail the fetch, and
+ * HTTP_CACHE_UNCACHEABLE means the caller has to fetch url without the
+ * cache, e.g. because it redirects to https://.
+ */
+static int feh_http_cache_update(char *url, char *pass_file)
+{
+	char *body_file, *meta_file, *tmp_file, *fetch_url, *target;
+	char *etag = NULL, *lastmod = NULL;
+	char *cond = NULL, *cond_etag = NULL, *cond_lastmod = NULL;
+	char headers[HTTP_HEADER_SIZE];
+	char pid[16];
+	int status = 0, redirects = 0;
+	int ret = HTTP_CACHE_ERROR;
+	struct stat sb;
+
+	body_file = feh_http_cache_name(url, "");
+	meta_file = feh_http_cache_name(url, ".meta");
+	snprintf(pid, sizeof(pid), ".%d", (int) getpid());
+	tmp_file = estrjoin("", body_file, pid, NULL);
+
+	if (!stat(body_file, &sb))
+		feh_http_cache_read_meta(meta_file, &etag, &lastmod);
+
+	if (etag)
+		cond_etag = estrjoin(" ", "If-None-Match:", etag, NULL);
+	if (lastmod)
+		cond_lastmod = estrjoin(" ", "If-Modified-Since:", lastmod, NULL);
+	if (cond_etag && cond_lastmod)
+		cond = estrjoin(EOL, cond_etag, cond_lastmod, NULL);
+	else if (cond_etag || cond_lastmod)
+		cond = estrdup(cond_etag ? cond_etag : cond_lastmod);
+
+	D(("revalidating %s (%s)\n", url, cond ? cond : "unconditional"));
+
+	fetch_url = estrdup(url);
+	while (feh_http_builtin_get(fetch_url, tmp_file, cond, headers,
+				sizeof(headers))) {
+		status = 0;
+		sscanf(headers, "HTTP/%*d.%*d %d", &status);
+
+		if (((status == 301) || (status == 302) || (status == 303)
+					|| (status == 307) || (status == 308))
+				&& (redirects++ < HTTP_MAX_REDIRECTS)
+				&& (target = feh_http_redirect_target(fetch_url, headers))) {
+			D(("%s redirects to %s\n", fetch_url, target));
+			unlink(tmp_file);
+			free(fetch_url);
+			fetch_url = target;
+			if (strncmp(fetch_url, "http://", 7)) {
+				ret = HTTP_CACHE_UNCACHEABLE;
+				break;
+			}
+			continue;
+		}
+
+		if (status == 304 && cond) {
+			unlink(tmp_file);
+			ret = HTTP_CACHE_NOT_MODIFIED;
+		} else if (status == 200) {
+			free(etag);
+			free(lastmod);
+			etag = feh_http_header_value(headers, "ETag");
+			lastmod = feh_http_header_value(headers, "Last-Modified");
+
+			/* never leave validators next to a body they don't belong to */
+			unlink(meta_file);
+			if (rename(tmp_file, body_file) == 0) {
+				if (etag || lastmod)
+					feh_http_cache_write_meta(meta_file, etag, lastmod);
+				ret = HTTP_CACHE_MODIFIED;
+			} else {
+				weprintf("couldn't update %s:", body_file);
+				unlink(tmp_file);
+			}
+		} else if (pass_file) {
+			D(("not caching %s, HTTP status %d\n", url, status));
+			if (feh_http_cache_copy(tmp_file, pass_file))
+				ret = HTTP_CACHE_PASSED;
+			unlink(tmp_file);
+		} else {
+			D(("not caching %s, HTTP status %d\n", url, status));
+			unlink(tmp_file);
+			if (status < 400)
+				ret = HTTP_CACHE_UNCACHEABLE;
+		}
+		break;
+	}
+
+	free(fetch_url);
+	free(body_file);
+	free(meta_file);
+	free(tmp_file);
+	free(etag);
+	free(lastmod);
+	free(cond_etag);
+	free(cond_lastmod);
+	free(cond);
+	return(ret);
+}
+
+/*
+ * Revalidate url ahead of a reload. If this returns HTTP_CACHE_MODIFIED,
+ * the next feh_http_cache_fetch for url uses the new body without asking
+ * the server again.
+ */
+int feh_http_cache_revalidate(char *url)
+{
+	if (validated_url)
+		free(validated_url);
+	validated_url = estrdup(url);
+	validated_state = feh_http_cache_update(url, NULL);
+	return(validated_state);
+}
+
+static int feh_http_cache_copy(char *from, char *to)
+{
+	FILE *in, *out;
+	char buf[8192];
+	size_t len;
+	int ret = 1;
+
+	/* the cache replaces bodies by rename, so a hard link is a snapshot */
+	if (link(from, to) == 0)
+		return(1);
+
+	if (!(in = fopen(from, "r")))
+		return(0);
+	if (!(out = fopen(to, "w"))) {
+		weprintf("couldn't write to file %s:", to);
+		fclose(in);
+		return(0);
+	}
+	while ((len = fread(buf, 1, sizeof(buf), in)) > 0)
+		if (fwrite(buf, 1, len, out) != len)
+			ret = 0;
+	fclose(in);
+	if ((fclose(out) != 0) || !ret) {
+		unlink(to);
+		return(0);
+	}
+	return(1);
+}
+
+/* feh_http_fetch replacement for cacheable URLs */
+int feh_http_cache_fetch(char *url, char *tmpname)
+{
+	char *body_file;
+	int state, ret;
+
+	/* the server has just been asked, whatever it said still holds */
+	if (validated_url && !strcmp(validated_url, url)) {
+		state = validated_state;
+		free(validated_url);
+		validated_url = NULL;
+	} else
+		state = feh_http_cache_update(url, tmpname);
+
+	if (state == HTTP_CACHE_ERROR)
+		return(0);
+	else if (state == HTTP_CACHE_PASSED)
+		return(1);
+	else if (state == HTTP_CACHE_UNCACHEABLE)
+		return(feh_http_fetch_uncached(url, tmpname));
+
+	body_file = feh_http_cache_name(url, "");
+	ret = feh_http_cache_copy(body_file, tmpname);
+	free(body_file);
+	return(ret);
+}
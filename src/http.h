@@ -0,0 +1,43 @@
+/* http.h
+
+Copyright (C) 2011 by Daniel Friesel
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to
+deal in the Software without restriction, including without limitation the
+rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies of the Software and its documentation and acknowledgment shall be
+given in the documentation and software packages that this Software was
+used.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+#ifndef HTTP_H
+#define HTTP_H
+
+enum prefetch_state { PREFETCH_NONE = 0, PREFETCH_DONE, PREFETCH_FAILED };
+
+int feh_http_prefetch_claim(char *url, char **tmpname);
+void feh_http_prefetch_poll(void);
+void feh_http_prefetch_list(gib_list * l);
+void feh_http_prefetch_neighbours(gib_list * root, gib_list * l, int count);
+void feh_http_prefetch_cleanup(void);
+
+enum http_cache_state { HTTP_CACHE_ERROR = 0, HTTP_CACHE_MODIFIED,
+	HTTP_CACHE_NOT_MODIFIED, HTTP_CACHE_PASSED, HTTP_CACHE_UNCACHEABLE };
+
+int feh_http_cache_usable(char *url);
+int feh_http_cache_revalidate(char *url);
+int feh_http_cache_fetch(char *url, char *tmpname);
+
+#endif
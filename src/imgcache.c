@@ -0,0 +1,1592 @@
+/* imgcache.c
+
+Copyright (C) 2011 by Daniel Friesel
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to
+deal in the Software without restriction, including without limitation the
+rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies of the Software and its documentation and acknowledgment shall be
+given in the documentation and software packages that this Software was
+used.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+#include "feh.h"
+#include "options.h"
+#include "imgcache.h"
+#include "timers.h"
+#include "winwidget.h"
+#include "thumbnail.h"
+#include "md5.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+
+/*
+ * Compressed tier for decoded images. When the slideshow moves on, the
+ * decoded image is not simply thrown away: it is kept here, compressed,
+ * within a budget of --cache-compressed MiB. Going back to it decompresses
+ * the pixels instead of decoding the file again.
+ *
+ * Images are split into bands of IMGCACHE_BAND_ROWS rows. Each band is
+ * stored as separate, delta-coded color planes (photos without an alpha
+ * channel lose a quarter of their size right away) and then compressed
+ * with a small LZ4-style byte codec. Bands are independent, so they are
+ * packed and unpacked by --decode-jobs threads in parallel.
+ */
+
+#define IMGCACHE_BAND_ROWS 64
+
+#define LZ_HASH_BITS 14
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5
+#define LZ_MAX_OFFSET 65535
+
+struct imgcache_entry {
+	char *filename;
+	struct stat st;
+	char *format;
+	int w;
+	int h;
+	int has_alpha;
+	int bands;
+	int *band_len;
+	unsigned char **band_data;
+	size_t bytes;
+};
+
+struct imgcache_job {
+	struct imgcache_entry *entry;
+	DATA32 *data;
+	int pack;
+	int first;
+	int step;
+	int failed;
+};
+
+/* most recently used first */
+static gib_list *imgcache = NULL;
+static size_t imgcache_bytes = 0;
+
+static int stat_hits = 0;
+static int stat_misses = 0;
+static int stat_stores = 0;
+static double stat_unpack_time = 0.0;
+static double stat_pack_time = 0.0;
+static double stat_raw_bytes = 0.0;
+static double stat_packed_bytes = 0.0;
+
+static inline unsigned int lz_read32(const unsigned char *p)
+{
+	unsigned int v;
+
+	memcpy(&v, p, 4);
+	return(v);
+}
+
+static inline unsigned int lz_hash(unsigned int v)
+{
+	return((v * 2654435761U) >> (32 - LZ_HASH_BITS));
+}
+
+static int lz_bound(int len)
+{
+	return(len + len / 255 + 16);
+}
+
+static unsigned char *lz_put_length(unsigned char *op, int len)
+{
+	while (len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = len;
+	return(op);
+}
+
+static unsigned char *lz_put_sequence(unsigned char *op,
+		const unsigned char *literals, int lit, int offset, int mlen)
+{
+	unsigned char *token = op++;
+
+	*token = (lit < 15 ? lit : 15) << 4;
+	if (lit >= 15)
+		op = lz_put_length(op, lit - 15);
+	memcpy(op, literals, lit);
+	op += lit;
+
+	/* the last sequence only carries literals */
+	if (!offset)
+		return(op);
+
+	mlen -= LZ_MIN_MATCH;
+	*token |= mlen < 15 ? mlen : 15;
+	*op++ = offset & 0xff;
+	*op++ = offset >> 8;
+	if (mlen >= 15)
+		op = lz_put_length(op, mlen - 15);
+	return(op);
+}
+
+/*
+ * Compresses len bytes from src to dst, which must hold lz_bound(len)
+ * bytes. Returns the compressed length.
+ */
+static int lz_compress(const unsigned char *src, int len, unsigned char *dst)
+{
+	int table[1 << LZ_HASH_BITS];
+	int limit = len - LZ_LAST_LITERALS - LZ_MIN_MATCH;
+	int ip = 0, anchor = 0, ref, mlen;
+	unsigned char *op = dst;
+	unsigned int seq, h;
+
+	memset(table, 0xff, sizeof(table));
+
+	while (ip <= limit) {
+		seq = lz_read32(src + ip);
+		h = lz_hash(seq);
+		ref = table[h];
+		table[h] = ip;
+
+		if ((ref < 0) || (ip - ref > LZ_MAX_OFFSET)
+				|| (lz_read32(src + ref) != seq)) {
+			/* step faster through data which does not compress */
+			ip += 1 + ((ip - anchor) >> 6);
+			continue;
+		}
+
+		mlen = LZ_MIN_MATCH;
+		while ((ip + mlen < len - LZ_LAST_LITERALS)
+				&& (src[ref + mlen] == src[ip + mlen]))
+			mlen++;
+
+		op = lz_put_sequence(op, src + anchor, ip - anchor, ip - ref, mlen);
+		ip += mlen;
+		anchor = ip;
+	}
+
+	op = lz_put_sequence(op, src + anchor, len - anchor, 0, 0);
+	return(op - dst);
+}
+
+static int lz_get_length(const unsigned char **ip, const unsigned char *end,
+		int *len)
+{
+	int n;
+
+	do {
+		if (*ip >= end)
+			return(0);
+		n = *(*ip)++;
+		*len += n;
+	} while (n == 255);
+	return(1);
+}
+
+/*
+ * Decompresses exactly out_len bytes from src to dst. Returns 0 if the
+ * data is damaged.
+ */
+static int lz_decompress(const unsigned char *src, int len,
+		unsigned char *dst, int out_len)
+{
+	const unsigned char *ip = src, *end = src + len;
+	unsigned char *op = dst, *oend = dst + out_len, *ref;
+	int token, lit, mlen, offset;
+
+	while (ip < end) {
+		token = *ip++;
+
+		lit = token >> 4;
+		if ((lit == 15) && !lz_get_length(&ip, end, &lit))
+			return(0);
+		if ((lit > end - ip) || (lit > oend - op))
+			return(0);
+		memcpy(op, ip, lit);
+		op += lit;
+		ip += lit;
+
+		if (ip == end)
+			break;
+
+		if (end - ip < 2)
+			return(0);
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if ((offset == 0) || (offset > op - dst))
+			return(0);
+
+		mlen = token & 15;
+		if ((mlen == 15) && !lz_get_length(&ip, end, &mlen))
+			return(0);
+		mlen += LZ_MIN_MATCH;
+		if (mlen > oend - op)
+			return(0);
+
+		/* matches may overlap the bytes they produce */
+		ref = op - offset;
+		if (offset >= mlen) {
+			memcpy(op, ref, mlen);
+			op += mlen;
+		} else {
+			while (mlen--)
+				*op++ = *ref++;
+		}
+	}
+	return(op == oend);
+}
+
+static void imgcache_pack_band(struct imgcache_entry *e, DATA32 *data, int band)
+{
+	int y0 = band * IMGCACHE_BAND_ROWS;
+	int rows = e->h - y0 < IMGCACHE_BAND_ROWS ? e->h - y0 : IMGCACHE_BAND_ROWS;
+	int planes = e->has_alpha ? 4 : 3;
+	int raw_len = e->w * rows * planes;
+	unsigned char *raw, *packed, *p, v, prev;
+	DATA32 *row;
+	int c, x, y;
+
+	p = raw = emalloc(raw_len);
+	packed = emalloc(lz_bound(raw_len));
+
+	for (c = 0; c < planes; c++) {
+		for (y = 0; y < rows; y++) {
+			row = data + (y0 + y) * e->w;
+			prev = 0;
+			for (x = 0; x < e->w; x++) {
+				v = (row[x] >> (c * 8)) & 0xff;
+				*p++ = v - prev;
+				prev = v;
+			}
+		}
+	}
+
+	e->band_len[band] = lz_compress(raw, raw_len, packed);
+	e->band_data[band] = erealloc(packed, e->band_len[band]);
+	free(raw);
+}
+
+static int imgcache_unpack_band(struct imgcache_entry *e, DATA32 *data, int band)
+{
+	int y0 = band * IMGCACHE_BAND_ROWS;
+	int rows = e->h - y0 < IMGCACHE_BAND_ROWS ? e->h - y0 : IMGCACHE_BAND_ROWS;
+	int planes = e->has_alpha ? 4 : 3;
+	int raw_len = e->w * rows * planes;
+	unsigned char *raw, *p, prev;
+	DATA32 *row;
+	int c, x, y;
+
+	p = raw = emalloc(raw_len);
+	if (!lz_decompress(e->band_data[band], e->band_len[band], raw, raw_len)) {
+		free(raw);
+		return(0);
+	}
+
+	for (y = 0; y < rows; y++) {
+		row = data + (y0 + y) * e->w;
+		prev = 0;
+		for (x = 0; x < e->w; x++) {
+			prev += *p++;
+			row[x] = (e->has_alpha ? 0 : 0xff000000) | prev;
+		}
+	}
+	for (c = 1; c < planes; c++) {
+		for (y = 0; y < rows; y++) {
+			row = data + (y0 + y) * e->w;
+			prev = 0;
+			for (x = 0; x < e->w; x++) {
+				prev += *p++;
+				row[x] |= (DATA32) prev << (c * 8);
+			}
+		}
+	}
+
+	free(raw);
+	return(1);
+}
+
+static void *imgcache_worker(void *arg)
+{
+	struct imgcache_job *job = arg;
+	int band;
+
+	for (band = job->first; band < job->entry->bands; band += job->step) {
+		if (job->pack)
+			imgcache_pack_band(job->entry, job->data, band);
+		else if (!imgcache_unpack_band(job->entry, job->data, band))
+			job->failed = 1;
+	}
+	return(NULL);
+}
+
+/*
+ * Packs data into e (or unpacks e into data) with up to --decode-jobs
+ * threads. Returns 0 if any band failed to unpack.
+ */
+static int imgcache_run(struct imgcache_entry *e, DATA32 *data, int pack)
+{
+	struct imgcache_job *jobs;
+	pthread_t *threads;
+	char *started;
+	int i, num, ret = 1;
+
+	num = opt.decode_jobs < e->bands ? opt.decode_jobs : e->bands;
+	if (num < 1)
+		num = 1;
+	jobs = emalloc(num * sizeof(struct imgcache_job));
+	threads = emalloc(num * sizeof(pthread_t));
+	started = emalloc(num);
+
+	for (i = 0; i < num; i++) {
+		jobs[i].entry = e;
+		jobs[i].data = data;
+		jobs[i].pack = pack;
+		jobs[i].first = i;
+		jobs[i].step = num;
+		jobs[i].failed = 0;
+		started[i] = (i > 0)
+			&& !pthread_create(&threads[i], NULL, imgcache_worker, &jobs[i]);
+	}
+
+	/* the calling thread takes the first share, and any thread that failed to start */
+	for (i = 0; i < num; i++)
+		if (!started[i])
+			imgcache_worker(&jobs[i]);
+
+	for (i = 0; i < num; i++) {
+		if (started[i])
+			pthread_join(threads[i], NULL);
+		if (jobs[i].failed)
+			ret = 0;
+	}
+
+	free(jobs);
+	free(threads);
+	free(started);
+	return(ret);
+}
+
+static void imgcache_entry_free(struct imgcache_entry *e)
+{
+	int i;
+
+	for (i = 0; i < e->bands; i++)
+		free(e->band_data[i]);
+	free(e->band_data);
+	free(e->band_len);
+	free(e->filename);
+	free(e->format);
+	free(e);
+}
+
+/*
+ * Compresses im into a new entry (without filename and stat data).
+ */
+static struct imgcache_entry *imgcache_pack(Imlib_Image im)
+{
+	struct imgcache_entry *e;
+	double start;
+	int i;
+
+	e = emalloc(sizeof(struct imgcache_entry));
+	memset(e, 0, sizeof(struct imgcache_entry));
+	e->w = gib_imlib_image_get_width(im);
+	e->h = gib_imlib_image_get_height(im);
+	e->has_alpha = gib_imlib_image_has_alpha(im);
+	e->format = gib_imlib_image_format(im) ? estrdup(gib_imlib_image_format(im)) : NULL;
+	e->bands = (e->h + IMGCACHE_BAND_ROWS - 1) / IMGCACHE_BAND_ROWS;
+	e->band_len = emalloc(e->bands * sizeof(int));
+	e->band_data = emalloc(e->bands * sizeof(unsigned char *));
+
+	start = feh_get_time();
+	imlib_context_set_image(im);
+	imgcache_run(e, imlib_image_get_data_for_reading_only(), 1);
+	stat_pack_time += feh_get_time() - start;
+
+	e->bytes = sizeof(struct imgcache_entry) + e->bands * (sizeof(int) + sizeof(char *));
+	for (i = 0; i < e->bands; i++)
+		e->bytes += e->band_len[i];
+
+	D(("packed %d KiB -> %d KiB in %.3fs\n", e->w * e->h * 4 / 1024,
+			(int) (e->bytes / 1024), feh_get_time() - start));
+	return(e);
+}
+
+/*
+ * Creates a new image from the compressed data in e. Returns NULL if the
+ * data is damaged.
+ */
+static Imlib_Image imgcache_unpack(struct imgcache_entry *e)
+{
+	Imlib_Image im;
+	DATA32 *data;
+	double start;
+	int ok;
+
+	if (!(im = imlib_create_image(e->w, e->h)))
+		return(NULL);
+
+	start = feh_get_time();
+	imlib_context_set_image(im);
+	data = imlib_image_get_data();
+	ok = imgcache_run(e, data, 0);
+	imlib_context_set_image(im);
+	imlib_image_put_back_data(data);
+	imlib_image_set_has_alpha(e->has_alpha);
+	if (e->format)
+		imlib_image_set_format(e->format);
+
+	if (!ok) {
+		imlib_free_image_and_decache();
+		return(NULL);
+	}
+
+	stat_unpack_time += feh_get_time() - start;
+	D(("unpacked %dx%d in %.3fs\n", e->w, e->h, feh_get_time() - start));
+	return(im);
+}
+
+static int imgcache_same_file(struct stat *a, struct stat *b)
+{
+	return((a->st_dev == b->st_dev) && (a->st_ino == b->st_ino)
+			&& (a->st_size == b->st_size)
+			&& (a->st_mtim.tv_sec == b->st_mtim.tv_sec)
+			&& (a->st_mtim.tv_nsec == b->st_mtim.tv_nsec));
+}
+
+static void imgcache_drop(gib_list * l)
+{
+	struct imgcache_entry *e = l->data;
+
+	imgcache_bytes -= e->bytes;
+	imgcache = gib_list_remove(imgcache, l);
+	imgcache_entry_free(e);
+}
+
+/*
+ * Looks up an up-to-date entry for filename and makes it the most recently
+ * used one. Outdated entries are dropped.
+ */
+static struct imgcache_entry *imgcache_find(char *filename, struct stat *st)
+{
+	struct imgcache_entry *e;
+	gib_list *l;
+
+	for (l = imgcache; l; l = l->next) {
+		e = l->data;
+		if (strcmp(e->filename, filename))
+			continue;
+		if (!imgcache_same_file(&e->st, st)) {
+			D(("dropping outdated entry for %s\n", filename));
+			imgcache_drop(l);
+			return(NULL);
+		}
+		if (l != imgcache) {
+			imgcache = gib_list_remove(imgcache, l);
+			imgcache = gib_list_add_front(imgcache, e);
+		}
+		return(e);
+	}
+	return(NULL);
+}
+
+void feh_imgcache_store(char *filename, Imlib_Image im)
+{
+	size_t budget = (size_t) opt.cache_compressed * 1024 * 1024;
+	struct imgcache_entry *e;
+	struct stat st;
+	gib_list *l;
+
+	if (!opt.cache_compressed || !im || stat(filename, &st)
+			|| imgcache_find(filename, &st))
+		return;
+
+	e = imgcache_pack(im);
+	if (e->bytes > budget) {
+		imgcache_entry_free(e);
+		return;
+	}
+	e->filename = estrdup(filename);
+	e->st = st;
+
+	stat_stores++;
+	stat_raw_bytes += (double) e->w * e->h * 4;
+	stat_packed_bytes += e->bytes;
+
+	imgcache = gib_list_add_front(imgcache, e);
+	imgcache_bytes += e->bytes;
+	while (imgcache_bytes > budget) {
+		l = gib_list_last(imgcache);
+		D(("evicting %s\n", ((struct imgcache_entry *) l->data)->filename));
+		imgcache_drop(l);
+	}
+}
+
+Imlib_Image feh_imgcache_fetch(char *filename)
+{
+	struct imgcache_entry *e;
+	struct stat st;
+	Imlib_Image im;
+
+	if (!opt.cache_compressed)
+		return(NULL);
+
+	if (stat(filename, &st) || !(e = imgcache_find(filename, &st))) {
+		stat_misses++;
+		D(("miss for %s\n", filename));
+		return(NULL);
+	}
+
+	if (!(im = imgcache_unpack(e))) {
+		weprintf("%s: cached image is damaged, decoding it again", filename);
+		imgcache_drop(imgcache);
+		stat_misses++;
+		return(NULL);
+	}
+
+	stat_hits++;
+	D(("hit for %s\n", filename));
+	return(im);
+}
+
+/*
+ * Disk tier. Entries live in $XDG_CACHE_HOME/feh/decoded, one file per
+ * image, named after the md5 of its path, mtime and size. The header
+ * repeats the stat data, so a stale or mismatched entry is never used.
+ *
+ * Several feh processes may share the directory: entries are written to a
+ * temporary file and renamed into place, so readers only ever see complete
+ * files, and a file removed while mapped stays readable. Hits update the
+ * mtime of the entry, and the oldest entries are pruned once the directory
+ * exceeds --cache-decoded MiB. Only one process prunes at a time.
+ *
+ * Pruning scans the whole directory, so it is not done on every save: the
+ * size found by the last scan is kept up to date with our own saves, and the
+ * directory is only scanned again once that exceeds the budget, or after
+ * IMGCACHE_PRUNE_SAVES saves to catch what other processes wrote.
+ */
+
+#define IMGCACHE_DISK_MAGIC "FEHPIX1"
+
+/* only images which took longer than this (in seconds) to decode are saved */
+#define IMGCACHE_SLOW_DECODE 0.1
+
+/* leftovers of processes which died while writing an entry */
+#define IMGCACHE_STALE_TMP 3600
+
+#define IMGCACHE_PRUNE_SAVES 64
+
+struct imgcache_disk_header {
+	char magic[8];
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint32_t w;
+	uint32_t h;
+	uint32_t has_alpha;
+	uint32_t bands;
+	char format[16];
+};
+
+struct imgcache_disk_file {
+	char *name;
+	off_t size;
+	time_t mtime;
+};
+
+static int disk_hits = 0;
+static int disk_misses = 0;
+static int disk_saves = 0;
+
+/* estimated size of the disk tier, -1 if unknown */
+static off_t disk_total = -1;
+static int disk_saves_since_prune = 0;
+
+static char *imgcache_disk_dir(void)
+{
+	static char *dir = NULL;
+	static int dir_ok = -1;
+
+	if (dir_ok == -1)
+		dir_ok = ((dir = feh_cache_dir("decoded")) != NULL);
+	return(dir_ok ? dir : NULL);
+}
+
+static void imgcache_md5_hex(char *s, char *hex)
+{
+	md5_state_t pms;
+	md5_byte_t digest[16];
+	int i;
+
+	md5_init(&pms);
+	md5_append(&pms, (unsigned char *) s, strlen(s));
+	md5_finish(&pms, digest);
+
+	for (i = 0; i < 16; i++)
+		sprintf(hex + 2 * i, "%02x", digest[i]);
+}
+
+static char *imgcache_disk_name(char *filename, struct stat *st)
+{
+	char *dir, *path, *key, *ret;
+	char stamp[64], hex[33];
+
+	if (!(dir = imgcache_disk_dir()) || stat(filename, st))
+		return(NULL);
+
+	if (!(path = realpath(filename, NULL)))
+		path = estrdup(filename);
+	snprintf(stamp, sizeof(stamp), ":%ld:%ld", (long) st->st_mtime,
+			(long) st->st_size);
+	key = estrjoin("", path, stamp, NULL);
+	free(path);
+	imgcache_md5_hex(key, hex);
+	free(key);
+
+	ret = estrjoin("", dir, "/", hex, NULL);
+	return(ret);
+}
+
+static void imgcache_disk_header_init(struct imgcache_disk_header *hdr,
+		struct stat *st)
+{
+	memset(hdr, 0, sizeof(struct imgcache_disk_header));
+	memcpy(hdr->magic, IMGCACHE_DISK_MAGIC, 8);
+	hdr->dev = st->st_dev;
+	hdr->ino = st->st_ino;
+	hdr->size = st->st_size;
+	hdr->mtime_sec = st->st_mtim.tv_sec;
+	hdr->mtime_nsec = st->st_mtim.tv_nsec;
+}
+
+/*
+ * Maps the entry cachefile and unpacks it, if it was made from filename as
+ * described by st. Damaged entries are removed.
+ */
+static Imlib_Image imgcache_disk_read(char *filename, char *cachefile,
+		struct stat *st)
+{
+	struct imgcache_disk_header hdr, *map_hdr;
+	struct imgcache_entry e;
+	struct stat cst;
+	Imlib_Image im = NULL;
+	unsigned char *map = NULL, *p;
+	uint32_t *lens;
+	size_t offset;
+	int fd, i;
+
+	if ((fd = open(cachefile, O_RDONLY)) == -1) {
+		disk_misses++;
+		D(("disk miss for %s\n", filename));
+		return(NULL);
+	}
+
+	memset(&e, 0, sizeof(struct imgcache_entry));
+	imgcache_disk_header_init(&hdr, st);
+
+	if (fstat(fd, &cst) || (cst.st_size < (off_t) sizeof(hdr))
+			|| ((map = mmap(NULL, cst.st_size, PROT_READ, MAP_SHARED, fd, 0))
+				== MAP_FAILED)) {
+		map = NULL;
+		goto out;
+	}
+
+	map_hdr = (struct imgcache_disk_header *) map;
+	if (memcmp(map_hdr, &hdr, offsetof(struct imgcache_disk_header, w))
+			|| !map_hdr->w || !map_hdr->h || (map_hdr->w > 65535)
+			|| (map_hdr->h > 65535) || map_hdr->format[15]
+			|| (map_hdr->bands != (map_hdr->h + IMGCACHE_BAND_ROWS - 1)
+				/ IMGCACHE_BAND_ROWS)
+			|| ((size_t) cst.st_size < sizeof(hdr) + map_hdr->bands * sizeof(uint32_t)))
+		goto out;
+
+	e.w = map_hdr->w;
+	e.h = map_hdr->h;
+	e.has_alpha = map_hdr->has_alpha;
+	e.format = *map_hdr->format ? map_hdr->format : NULL;
+	e.bands = map_hdr->bands;
+	e.band_len = emalloc(e.bands * sizeof(int));
+	e.band_data = emalloc(e.bands * sizeof(unsigned char *));
+
+	lens = (uint32_t *) (map + sizeof(hdr));
+	offset = sizeof(hdr) + e.bands * sizeof(uint32_t);
+	for (i = 0; i < e.bands; i++) {
+		if (lens[i] > (size_t) cst.st_size - offset)
+			goto out;
+		p = map + offset;
+		e.band_len[i] = lens[i];
+		e.band_data[i] = p;
+		offset += lens[i];
+	}
+
+	if ((im = imgcache_unpack(&e))) {
+		disk_hits++;
+		D(("disk hit for %s\n", filename));
+		/* keep it from being pruned */
+		futimens(fd, NULL);
+	}
+
+out:
+	if (!im) {
+		disk_misses++;
+		D(("damaged disk entry for %s\n", filename));
+		unlink(cachefile);
+	}
+	if (map)
+		munmap(map, cst.st_size);
+	close(fd);
+	free(e.band_len);
+	free(e.band_data);
+	return(im);
+}
+
+Imlib_Image feh_imgcache_disk_load(char *filename)
+{
+	Imlib_Image im;
+	struct stat st;
+	char *cachefile;
+
+	if (!opt.cache_decoded || !(cachefile = imgcache_disk_name(filename, &st)))
+		return(NULL);
+
+	im = imgcache_disk_read(filename, cachefile, &st);
+	free(cachefile);
+	return(im);
+}
+
+static int imgcache_disk_write(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	ssize_t ret;
+
+	while (len > 0) {
+		if ((ret = write(fd, p, len)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return(0);
+		}
+		p += ret;
+		len -= ret;
+	}
+	return(1);
+}
+
+static int imgcache_disk_cmp(const void *a, const void *b)
+{
+	const struct imgcache_disk_file *fa = a, *fb = b;
+
+	return((fa->mtime > fb->mtime) - (fa->mtime < fb->mtime));
+}
+
+/*
+ * Removes the least recently used entries until the cache fits into
+ * budget bytes again. Returns the resulting size of the cache, or -1 if
+ * it was not scanned.
+ */
+static off_t imgcache_disk_prune(char *dir, off_t budget)
+{
+	struct imgcache_disk_file *files = NULL;
+	struct dirent *de;
+	struct stat st;
+	off_t total = 0;
+	int num = 0, size = 0, i;
+	time_t now = time(NULL);
+	char *path;
+	DIR *d;
+
+	if (!dir || !(d = opendir(dir)))
+		return(-1);
+	if (flock(dirfd(d), LOCK_EX | LOCK_NB)) {
+		/* another feh is already pruning */
+		closedir(d);
+		return(-1);
+	}
+
+	while ((de = readdir(d))) {
+		if (de->d_name[0] == '.')
+			continue;
+		path = estrjoin("/", dir, de->d_name, NULL);
+		if (stat(path, &st) || !S_ISREG(st.st_mode)) {
+			free(path);
+			continue;
+		}
+		if (strchr(de->d_name, '.')) {
+			if (now - st.st_mtime > IMGCACHE_STALE_TMP)
+				unlink(path);
+			free(path);
+			continue;
+		}
+		if (num == size) {
+			size = size ? size * 2 : 64;
+			files = erealloc(files, size * sizeof(struct imgcache_disk_file));
+		}
+		files[num].name = path;
+		files[num].size = st.st_size;
+		files[num].mtime = st.st_mtime;
+		total += st.st_size;
+		num++;
+	}
+
+	if (total > budget) {
+		qsort(files, num, sizeof(struct imgcache_disk_file), imgcache_disk_cmp);
+		for (i = 0; (i < num) && (total > budget); i++) {
+			D(("pruning %s\n", files[i].name));
+			if (!unlink(files[i].name) || (errno == ENOENT))
+				total -= files[i].size;
+		}
+	}
+
+	for (i = 0; i < num; i++)
+		free(files[i].name);
+	free(files);
+	closedir(d);
+	return(total);
+}
+
+/*
+ * Writes e as the entry cachefile for a file described by st. The entry
+ * appears atomically, or not at all.
+ */
+static int imgcache_disk_save_entry(char *cachefile, struct stat *st,
+		struct imgcache_entry *e)
+{
+	struct imgcache_disk_header hdr;
+	char *tmpname;
+	uint32_t len;
+	int fd, i, ok;
+
+	imgcache_disk_header_init(&hdr, st);
+	hdr.w = e->w;
+	hdr.h = e->h;
+	hdr.has_alpha = e->has_alpha;
+	hdr.bands = e->bands;
+	if (e->format)
+		strncpy(hdr.format, e->format, sizeof(hdr.format) - 1);
+
+	tmpname = estrjoin("", cachefile, ".XXXXXX", NULL);
+	if ((fd = mkstemp(tmpname)) == -1) {
+		free(tmpname);
+		return(0);
+	}
+
+	ok = imgcache_disk_write(fd, &hdr, sizeof(hdr));
+	for (i = 0; ok && (i < e->bands); i++) {
+		len = e->band_len[i];
+		ok = imgcache_disk_write(fd, &len, sizeof(len));
+	}
+	for (i = 0; ok && (i < e->bands); i++)
+		ok = imgcache_disk_write(fd, e->band_data[i], e->band_len[i]);
+
+	if (close(fd) || !ok || rename(tmpname, cachefile)) {
+		unlink(tmpname);
+		ok = 0;
+	} else {
+		disk_saves++;
+		D(("saved %s\n", cachefile));
+	}
+
+	free(tmpname);
+	return(ok);
+}
+
+void feh_imgcache_disk_save(char *filename, Imlib_Image im, double decode_time)
+{
+	off_t budget = (off_t) opt.cache_decoded * 1024 * 1024;
+	struct imgcache_entry *e;
+	struct stat st;
+	char *cachefile;
+
+	if (!opt.cache_decoded || (decode_time < IMGCACHE_SLOW_DECODE) || !im
+			|| !(cachefile = imgcache_disk_name(filename, &st)))
+		return;
+
+	e = imgcache_pack(im);
+	if (((off_t) e->bytes <= budget)
+			&& imgcache_disk_save_entry(cachefile, &st, e)) {
+		if (disk_total != -1)
+			disk_total += e->bytes;
+		disk_saves_since_prune++;
+	}
+
+	imgcache_entry_free(e);
+	free(cachefile);
+
+	if ((disk_total == -1) || (disk_total > budget)
+			|| (disk_saves_since_prune >= IMGCACHE_PRUNE_SAVES)) {
+		disk_total = imgcache_disk_prune(imgcache_disk_dir(), budget);
+		disk_saves_since_prune = 0;
+	}
+}
+
+/*
+ * Display cache: copies of images larger than the screen, scaled down to
+ * the size the fullscreen slideshow shows them at (fitting the screen, or
+ * covering it with --zoom max). They are stored in the format of the disk
+ * tier in $XDG_CACHE_HOME/feh/display-<w>x<h>[-max], named after the md5 of
+ * the file URI like thumbnails are.
+ */
+
+static char *imgcache_display_name(char *filename, int max_w, int max_h,
+		struct stat *st)
+{
+	static char *dir = NULL;
+	static int dir_w = -1, dir_h = -1;
+	char *uri, *md5_name, *ret;
+	char size[64];
+
+	if (stat(filename, st))
+		return(NULL);
+
+	if ((dir_w != max_w) || (dir_h != max_h)) {
+		free(dir);
+		snprintf(size, sizeof(size), "display-%dx%d%s", max_w, max_h,
+				opt.zoom_mode == ZOOM_MODE_MAX ? "-max" : "");
+		dir = feh_cache_dir(size);
+		dir_w = max_w;
+		dir_h = max_h;
+	}
+	if (!dir)
+		return(NULL);
+
+	uri = feh_thumbnail_get_name_uri(filename);
+	md5_name = feh_thumbnail_get_name_md5(uri);
+	/* no .png, these are not PNG files */
+	md5_name[32] = '\0';
+	ret = estrjoin("/", dir, md5_name, NULL);
+	free(uri);
+	free(md5_name);
+	return(ret);
+}
+
+Imlib_Image feh_imgcache_display_load(char *filename, int max_w, int max_h)
+{
+	Imlib_Image im;
+	struct stat st;
+	char *cachefile;
+
+	if (!opt.cache_display
+			|| !(cachefile = imgcache_display_name(filename, max_w, max_h, &st)))
+		return(NULL);
+
+	im = imgcache_disk_read(filename, cachefile, &st);
+	free(cachefile);
+	return(im);
+}
+
+void feh_imgcache_display_save(char *filename, Imlib_Image im, int max_w, int max_h)
+{
+	struct imgcache_entry *e;
+	struct stat st;
+	Imlib_Image scaled;
+	char *cachefile;
+	double zoom;
+	int w, h, sw, sh;
+
+	if (!opt.cache_display || !im)
+		return;
+
+	/* the same zoom winwidget_render_image ends up with */
+	w = gib_imlib_image_get_width(im);
+	h = gib_imlib_image_get_height(im);
+	feh_calc_needed_zoom(&zoom, w, h, max_w, max_h);
+	sw = w * zoom + 0.5;
+	sh = h * zoom + 0.5;
+	if ((zoom >= 1.0) || (sw < 1) || (sh < 1))
+		return;
+
+	if (!(cachefile = imgcache_display_name(filename, max_w, max_h, &st)))
+		return;
+
+	if ((scaled = gib_imlib_create_cropped_scaled_image(im, 0, 0, w, h, sw, sh, 1))) {
+		imlib_context_set_image(scaled);
+		if (gib_imlib_image_format(im))
+			imlib_image_set_format(gib_imlib_image_format(im));
+		e = imgcache_pack(scaled);
+		imgcache_disk_save_entry(cachefile, &st, e);
+		imgcache_entry_free(e);
+		gib_imlib_free_image_and_decache(scaled);
+	}
+	free(cachefile);
+}
+
+/*
+ * Thumbnail packs (--thumb-pack). feh's own thumbnail cache: all thumbnails
+ * of one directory at one size live in a single file in
+ * $XDG_CACHE_HOME/feh/thumbpacks, named after the md5 of the directory and
+ * the size, so a warm run maps one file per directory instead of opening
+ * and inflating a PNG per image.
+ *
+ * A pack starts with a header pointing to an index sorted by the md5 name
+ * of the thumbnail (as in feh_thumbnail_get_name_md5), which is searched
+ * in place. Records are compressed like the other tiers. New thumbnails
+ * are collected in memory and appended in batches together with a new
+ * index, after which the header is updated; the old index becomes
+ * garbage, and the pack is rewritten once that outweighs the records.
+ * Writers lock the pack, readers never see a half written index.
+ */
+
+#define IMGCACHE_PACK_MAGIC "FEHTPK1"
+
+/* number of new thumbnails collected before they are written */
+#define IMGCACHE_PACK_BATCH 256
+
+/* number of packs kept open at once */
+#define IMGCACHE_PACK_OPEN 8
+
+/* records and the index start at multiples of 8 bytes */
+#define IMGCACHE_PACK_ALIGN(n) (((n) + 7) & ~(uint64_t) 7)
+
+struct imgcache_pack_header {
+	char magic[8];
+	uint32_t dim;
+	uint32_t count;
+	uint64_t index_off;
+};
+
+struct imgcache_pack_index {
+	char md5[32];
+	int64_t mtime;
+	uint64_t off;            /* uint32_t band lengths, then band data */
+	uint32_t len;
+	uint32_t orig_w;
+	uint32_t orig_h;
+	uint16_t w;
+	uint16_t h;
+	uint8_t has_alpha;
+	uint8_t pad[7];
+};
+
+/* an index entry, with its record either in the mapped pack or in e */
+struct imgcache_pack_slot {
+	struct imgcache_pack_index idx;
+	struct imgcache_entry *e;
+};
+
+struct imgcache_pack {
+	char *dir;
+	char *path;
+	int dim;
+	unsigned char *map;
+	size_t map_len;
+	struct imgcache_pack_index *index;
+	uint32_t count;
+	struct imgcache_pack_slot *pending;
+	int num_pending;
+};
+
+/* most recently used first */
+static gib_list *packs = NULL;
+
+static int pack_hits = 0;
+static int pack_misses = 0;
+static int pack_saves = 0;
+
+/*
+ * Maps the current contents of the pack file (fd, or pack->path if fd is
+ * -1), if it is a valid pack.
+ */
+static void imgcache_pack_map(struct imgcache_pack *pack, int fd)
+{
+	struct imgcache_pack_header *hdr;
+	struct stat st;
+	int own_fd = (fd == -1);
+
+	if (pack->map)
+		munmap(pack->map, pack->map_len);
+	pack->map = NULL;
+	pack->index = NULL;
+	pack->count = 0;
+
+	if (own_fd && ((fd = open(pack->path, O_RDONLY)) == -1))
+		return;
+	if (!fstat(fd, &st) && (st.st_size >= (off_t) sizeof(*hdr))
+			&& ((pack->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED,
+						fd, 0)) == MAP_FAILED))
+		pack->map = NULL;
+	if (own_fd)
+		close(fd);
+	if (!pack->map)
+		return;
+
+	pack->map_len = st.st_size;
+	hdr = (struct imgcache_pack_header *) pack->map;
+	if (memcmp(hdr->magic, IMGCACHE_PACK_MAGIC, 8)
+			|| (hdr->dim != (uint32_t) pack->dim)
+			|| (hdr->index_off < sizeof(*hdr))
+			|| (hdr->index_off != IMGCACHE_PACK_ALIGN(hdr->index_off))
+			|| (hdr->index_off > pack->map_len)
+			|| (hdr->count > (pack->map_len - hdr->index_off)
+				/ sizeof(struct imgcache_pack_index))) {
+		D(("ignoring damaged pack %s\n", pack->path));
+		munmap(pack->map, pack->map_len);
+		pack->map = NULL;
+		return;
+	}
+	pack->index = (struct imgcache_pack_index *) (pack->map + hdr->index_off);
+	pack->count = hdr->count;
+}
+
+static int imgcache_pack_slot_cmp(const void *a, const void *b)
+{
+	return(memcmp(((const struct imgcache_pack_slot *) a)->idx.md5,
+			((const struct imgcache_pack_slot *) b)->idx.md5, 32));
+}
+
+/* Whether the record of idx lies within the mapped pack, at an aligned offset */
+static int imgcache_pack_in_map(struct imgcache_pack *pack,
+		struct imgcache_pack_index *idx)
+{
+	return((idx->off == IMGCACHE_PACK_ALIGN(idx->off))
+			&& (idx->off <= pack->map_len)
+			&& (idx->len <= pack->map_len - idx->off));
+}
+
+/*
+ * Writes the record of s at the current position of fd, which is off, and
+ * pads it to the next aligned offset.
+ */
+static int imgcache_pack_write_slot(int fd, struct imgcache_pack_slot *s,
+		unsigned char *map, uint64_t off)
+{
+	char pad[8] = { 0 };
+	uint32_t len;
+	int i, ok = 1;
+
+	if (!s->e)
+		ok = imgcache_disk_write(fd, map + s->idx.off, s->idx.len);
+	else {
+		for (i = 0; ok && (i < s->e->bands); i++) {
+			len = s->e->band_len[i];
+			ok = imgcache_disk_write(fd, &len, sizeof(len));
+		}
+		for (i = 0; ok && (i < s->e->bands); i++)
+			ok = imgcache_disk_write(fd, s->e->band_data[i], s->e->band_len[i]);
+	}
+	ok = ok && imgcache_disk_write(fd, pad,
+			IMGCACHE_PACK_ALIGN(s->idx.len) - s->idx.len);
+	s->idx.off = off;
+	return(ok);
+}
+
+/*
+ * Writes the pending thumbnails of pack to disk, merged with whatever the
+ * pack file contains by now (other feh processes may have added to it).
+ */
+static void imgcache_pack_flush(struct imgcache_pack *pack)
+{
+	struct imgcache_pack_header hdr;
+	struct imgcache_pack_slot *slots;
+	struct stat fd_st, path_st;
+	char *tmpname = NULL;
+	uint64_t off, live = 0, garbage;
+	int fd, wfd, i, j, n, c, ok = 1;
+
+	if (!pack->num_pending)
+		return;
+
+	/* a pack rewritten by another process while we waited is a new file */
+	for (;;) {
+		if ((fd = open(pack->path, O_RDWR | O_CREAT, 0600)) == -1) {
+			weprintf("%s: cannot open thumbnail pack:", pack->path);
+			goto out;
+		}
+		flock(fd, LOCK_EX);
+		if (fstat(fd, &fd_st) || stat(pack->path, &path_st)
+				|| (fd_st.st_ino == path_st.st_ino))
+			break;
+		close(fd);
+	}
+	imgcache_pack_map(pack, fd);
+
+	qsort(pack->pending, pack->num_pending, sizeof(struct imgcache_pack_slot),
+			imgcache_pack_slot_cmp);
+
+	/* merge, new thumbnails replace old ones of the same file */
+	slots = emalloc((pack->count + pack->num_pending)
+			* sizeof(struct imgcache_pack_slot));
+	for (i = 0, j = 0, n = 0; (i < (int) pack->count) || (j < pack->num_pending);) {
+		if (i == (int) pack->count)
+			c = 1;
+		else if (j == pack->num_pending)
+			c = -1;
+		else
+			c = memcmp(pack->index[i].md5, pack->pending[j].idx.md5, 32);
+		if (c < 0) {
+			/* records are copied from the map, drop broken index entries */
+			if (!imgcache_pack_in_map(pack, &pack->index[i])) {
+				i++;
+				continue;
+			}
+			slots[n].idx = pack->index[i++];
+			slots[n].e = NULL;
+		} else {
+			if (c == 0)
+				i++;
+			slots[n] = pack->pending[j++];
+		}
+		live += slots[n++].idx.len;
+	}
+
+	/* old indexes and replaced thumbnails */
+	garbage = 0;
+	if (pack->map) {
+		garbage = pack->map_len - sizeof(hdr);
+		for (i = 0; i < pack->num_pending; i++)
+			garbage += pack->pending[i].idx.len;
+		garbage -= live;
+	}
+
+	wfd = fd;
+	off = pack->map ? IMGCACHE_PACK_ALIGN(pack->map_len) : sizeof(hdr);
+	if (garbage > live) {
+		/* more garbage than thumbnails, start over */
+		tmpname = estrjoin("", pack->path, ".XXXXXX", NULL);
+		if ((wfd = mkstemp(tmpname)) == -1) {
+			free(tmpname);
+			tmpname = NULL;
+			wfd = fd;
+		} else
+			off = sizeof(hdr);
+	} else if (!pack->map)
+		ok = !ftruncate(fd, 0);
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, IMGCACHE_PACK_MAGIC, 8);
+	hdr.dim = pack->dim;
+
+	if (wfd != fd) {
+		ok = imgcache_disk_write(wfd, &hdr, sizeof(hdr));
+		for (i = 0; ok && (i < n); i++) {
+			ok = imgcache_pack_write_slot(wfd, &slots[i], pack->map, off);
+			off += IMGCACHE_PACK_ALIGN(slots[i].idx.len);
+		}
+	} else {
+		ok = ok && (lseek(wfd, off, SEEK_SET) != -1);
+		if (!pack->map)
+			ok = ok && (pwrite(wfd, &hdr, sizeof(hdr), 0) == sizeof(hdr));
+		for (i = 0; ok && (i < n); i++) {
+			if (!slots[i].e)
+				continue;
+			ok = imgcache_pack_write_slot(wfd, &slots[i], pack->map, off);
+			off += IMGCACHE_PACK_ALIGN(slots[i].idx.len);
+		}
+	}
+
+	hdr.count = n;
+	hdr.index_off = off;
+	for (i = 0; ok && (i < n); i++)
+		ok = imgcache_disk_write(wfd, &slots[i].idx, sizeof(slots[i].idx));
+	/* the header goes last, so readers always find a complete index */
+	ok = ok && (pwrite(wfd, &hdr, sizeof(hdr), 0) == sizeof(hdr));
+
+	if (wfd != fd) {
+		if (close(wfd) || !ok || rename(tmpname, pack->path)) {
+			unlink(tmpname);
+			ok = 0;
+		}
+		free(tmpname);
+	}
+
+	if (ok) {
+		pack_saves += pack->num_pending;
+		D(("wrote %d thumbnails to %s, %d in total\n", pack->num_pending,
+				pack->path, n));
+	} else
+		weprintf("%s: cannot write thumbnail pack:", pack->path);
+
+	free(slots);
+	close(fd);
+
+out:
+	for (i = 0; i < pack->num_pending; i++)
+		imgcache_entry_free(pack->pending[i].e);
+	free(pack->pending);
+	pack->pending = NULL;
+	pack->num_pending = 0;
+	imgcache_pack_map(pack, -1);
+}
+
+static void imgcache_pack_close(struct imgcache_pack *pack)
+{
+	imgcache_pack_flush(pack);
+	if (pack->map)
+		munmap(pack->map, pack->map_len);
+	free(pack->dir);
+	free(pack->path);
+	free(pack);
+}
+
+/*
+ * Returns the pack holding the dim x dim thumbnails of the directory
+ * filename is in, and sets md5 to the key of filename in it.
+ */
+static struct imgcache_pack *imgcache_pack_get(char *filename, int dim,
+		char *md5)
+{
+	static char *pack_dir = NULL;
+	static int pack_dir_ok = -1;
+	struct imgcache_pack *pack;
+	gib_list *l;
+	char *dir, *path, *uri, *md5_name, *slash;
+	char name[64], hex[33];
+
+	if (strstr(filename, "://"))
+		return(NULL);
+
+	if (pack_dir_ok == -1)
+		pack_dir_ok = ((pack_dir = feh_cache_dir("thumbpacks")) != NULL);
+	if (!pack_dir_ok)
+		return(NULL);
+
+	uri = feh_thumbnail_get_name_uri(filename);
+	md5_name = feh_thumbnail_get_name_md5(uri);
+	memcpy(md5, md5_name, 32);
+	free(uri);
+	free(md5_name);
+
+	if ((slash = strrchr(filename, '/'))) {
+		dir = estrdup(filename);
+		dir[(slash == filename) ? 1 : slash - filename] = '\0';
+	} else
+		dir = estrdup(".");
+
+	for (l = packs; l; l = l->next) {
+		pack = l->data;
+		if ((pack->dim == dim) && !strcmp(pack->dir, dir)) {
+			free(dir);
+			if (l != packs) {
+				packs = gib_list_remove(packs, l);
+				packs = gib_list_add_front(packs, pack);
+			}
+			return(pack);
+		}
+	}
+
+	if (!(path = realpath(dir, NULL)))
+		path = estrdup(dir);
+	imgcache_md5_hex(path, hex);
+	free(path);
+	snprintf(name, sizeof(name), "%s-%d.pack", hex, dim);
+
+	pack = emalloc(sizeof(struct imgcache_pack));
+	memset(pack, 0, sizeof(struct imgcache_pack));
+	pack->dir = dir;
+	pack->path = estrjoin("/", pack_dir, name, NULL);
+	pack->dim = dim;
+	imgcache_pack_map(pack, -1);
+
+	packs = gib_list_add_front(packs, pack);
+	if (gib_list_length(packs) > IMGCACHE_PACK_OPEN) {
+		l = gib_list_last(packs);
+		imgcache_pack_close(l->data);
+		packs = gib_list_remove(packs, l);
+	}
+	return(pack);
+}
+
+/* Finds md5 among the new and the stored thumbnails of pack */
+static struct imgcache_pack_slot *imgcache_pack_find(struct imgcache_pack *pack,
+		char *md5, struct imgcache_pack_slot *found)
+{
+	int lo = 0, hi = pack->count - 1, mid, c, i;
+
+	for (i = 0; i < pack->num_pending; i++)
+		if (!memcmp(pack->pending[i].idx.md5, md5, 32))
+			return(&pack->pending[i]);
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		c = memcmp(pack->index[mid].md5, md5, 32);
+		if (!c) {
+			found->idx = pack->index[mid];
+			found->e = NULL;
+			return(found);
+		} else if (c < 0)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+	return(NULL);
+}
+
+int feh_imgcache_pack_has(char *filename, int dim)
+{
+	struct imgcache_pack *pack;
+	struct imgcache_pack_slot found, *s;
+	struct stat st;
+	char md5[32];
+
+	if (!opt.thumb_pack || stat(filename, &st)
+			|| !(pack = imgcache_pack_get(filename, dim, md5))
+			|| !(s = imgcache_pack_find(pack, md5, &found)))
+		return(0);
+	return(s->idx.mtime == (int64_t) st.st_mtime);
+}
+
+Imlib_Image feh_imgcache_pack_load(char *filename, int dim, int *orig_w,
+		int *orig_h)
+{
+	struct imgcache_pack *pack;
+	struct imgcache_pack_slot found, *s;
+	struct imgcache_entry e;
+	struct stat st;
+	Imlib_Image im = NULL;
+	uint32_t *lens;
+	size_t offset;
+	char md5[32];
+	int i;
+
+	if (!opt.thumb_pack || stat(filename, &st)
+			|| !(pack = imgcache_pack_get(filename, dim, md5)))
+		return(NULL);
+
+	if (!(s = imgcache_pack_find(pack, md5, &found))
+			|| (s->idx.mtime != (int64_t) st.st_mtime)) {
+		pack_misses++;
+		return(NULL);
+	}
+
+	if (s->e)
+		im = imgcache_unpack(s->e);
+	else {
+		memset(&e, 0, sizeof(struct imgcache_entry));
+		e.w = s->idx.w;
+		e.h = s->idx.h;
+		e.has_alpha = s->idx.has_alpha;
+		e.bands = (e.h + IMGCACHE_BAND_ROWS - 1) / IMGCACHE_BAND_ROWS;
+
+		if (e.w && e.h && imgcache_pack_in_map(pack, &s->idx)
+				&& (s->idx.len >= e.bands * sizeof(uint32_t))) {
+			e.band_len = emalloc(e.bands * sizeof(int));
+			e.band_data = emalloc(e.bands * sizeof(unsigned char *));
+			lens = (uint32_t *) (pack->map + s->idx.off);
+			offset = e.bands * sizeof(uint32_t);
+			for (i = 0; i < e.bands; i++) {
+				if (lens[i] > s->idx.len - offset)
+					break;
+				e.band_len[i] = lens[i];
+				e.band_data[i] = pack->map + s->idx.off + offset;
+				offset += lens[i];
+			}
+			if (i == e.bands)
+				im = imgcache_unpack(&e);
+			free(e.band_len);
+			free(e.band_data);
+		}
+	}
+
+	if (!im) {
+		pack_misses++;
+		D(("damaged pack entry for %s\n", filename));
+		return(NULL);
+	}
+
+	pack_hits++;
+	*orig_w = s->idx.orig_w;
+	*orig_h = s->idx.orig_h;
+	return(im);
+}
+
+void feh_imgcache_pack_save(char *filename, Imlib_Image im, int dim,
+		int orig_w, int orig_h)
+{
+	struct imgcache_pack *pack;
+	struct imgcache_pack_slot found, *s;
+	struct imgcache_entry *e;
+	struct stat st;
+	Imlib_Image scaled = NULL;
+	char md5[32];
+	int w, h, i;
+
+	if (!opt.thumb_pack || !im || stat(filename, &st)
+			|| !(pack = imgcache_pack_get(filename, dim, md5)))
+		return;
+
+	/* loaders may return more than needed, the pack only keeps dim x dim */
+	w = gib_imlib_image_get_width(im);
+	h = gib_imlib_image_get_height(im);
+	if ((w > dim) || (h > dim)) {
+		if (w > h) {
+			h = (double) h * dim / w + 0.5;
+			w = dim;
+		} else {
+			w = (double) w * dim / h + 0.5;
+			h = dim;
+		}
+		if (w < 1)
+			w = 1;
+		if (h < 1)
+			h = 1;
+		if (!(scaled = gib_imlib_create_cropped_scaled_image(im, 0, 0,
+						gib_imlib_image_get_width(im),
+						gib_imlib_image_get_height(im), w, h, 1)))
+			return;
+		imlib_context_set_image(scaled);
+		imlib_image_set_has_alpha(gib_imlib_image_has_alpha(im));
+	}
+
+	e = imgcache_pack(scaled ? scaled : im);
+	if (scaled)
+		gib_imlib_free_image_and_decache(scaled);
+
+	if ((s = imgcache_pack_find(pack, md5, &found)) && s->e)
+		imgcache_entry_free(s->e);
+	else {
+		pack->pending = erealloc(pack->pending, (pack->num_pending + 1)
+				* sizeof(struct imgcache_pack_slot));
+		s = &pack->pending[pack->num_pending++];
+	}
+
+	memset(&s->idx, 0, sizeof(s->idx));
+	memcpy(s->idx.md5, md5, 32);
+	s->idx.mtime = st.st_mtime;
+	s->idx.orig_w = orig_w;
+	s->idx.orig_h = orig_h;
+	s->idx.w = e->w;
+	s->idx.h = e->h;
+	s->idx.has_alpha = e->has_alpha;
+	s->idx.len = e->bands * sizeof(uint32_t);
+	for (i = 0; i < e->bands; i++)
+		s->idx.len += e->band_len[i];
+	s->e = e;
+
+	if (pack->num_pending >= IMGCACHE_PACK_BATCH)
+		imgcache_pack_flush(pack);
+}
+
+void feh_imgcache_cleanup(void)
+{
+	while (packs) {
+		imgcache_pack_close(packs->data);
+		packs = gib_list_remove(packs, packs);
+	}
+
+	D(("%d hits, %d misses, %d stores, %d disk hits, %d disk misses,"
+			" %d disk saves, %d pack hits, %d pack misses, %d pack saves,"
+			" %.3fs unpacking, %.3fs packing, ratio %.2f, %d KiB in use\n",
+			stat_hits, stat_misses, stat_stores, disk_hits, disk_misses,
+			disk_saves, pack_hits, pack_misses, pack_saves,
+			stat_unpack_time, stat_pack_time,
+			stat_packed_bytes ? stat_raw_bytes / stat_packed_bytes : 0.0,
+			(int) (imgcache_bytes / 1024)));
+
+	while (imgcache)
+		imgcache_drop(imgcache);
+}
@@ -0,0 +1,39 @@
+/* imgcache.h
+
+Copyright (C) 2011 by Daniel Friesel
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to
+deal in the Software without restriction, including without limitation the
+rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies of the Software and its documentation and acknowledgment shall be
+given in the documentation and software packages that this Software was
+used.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+#ifndef IMGCACHE_H
+#define IMGCACHE_H
+
+void feh_imgcache_store(char *filename, Imlib_Image im);
+Imlib_Image feh_imgcache_fetch(char *filename);
+Imlib_Image feh_imgcache_disk_load(char *filename);
+void feh_imgcache_disk_save(char *filename, Imlib_Image im, double decode_time);
+Imlib_Image feh_imgcache_display_load(char *filename, int max_w, int max_h);
+void feh_imgcache_display_save(char *filename, Imlib_Image im, int max_w, int max_h);
+int feh_imgcache_pack_has(char *filename, int dim);
+Imlib_Image feh_imgcache_pack_load(char *filename, int dim, int *orig_w, int *orig_h);
+void feh_imgcache_pack_save(char *filename, Imlib_Image im, int dim, int orig_w, int orig_h);
+void feh_imgcache_cleanup(void);
+
+#endif
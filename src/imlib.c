@@ -28,6 +28,13 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include "filelist.h"
 #include "winwidget.h"
 #include "options.h"
+#include "timers.h"
+#include "http.h"
+#include "decode.h"
+#include "imgcache.h"
+#include "mjpeg.h"
+#include "tiles.h"
+#include "feh_png.h"
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -105,6 +112,121 @@ void init_x_and_imlib(void)
 	return;
 }
 
+/*
+ * Slideshow loads are interruptible: while one is running, Imlib2 calls
+ * feh_load_progress every few percent, and the load is aborted as soon as
+ * navigation input arrives. The input stays queued, so the main loop goes
+ * straight on to the newest target. Switching interruption off again tells
+ * the caller whether the load was cancelled and clears the flag, so later
+ * loads are not affected.
+ *
+ * If a progress window is set, loads which take longer than
+ * FEH_PROGRESS_INTERVAL are also shown while they are being decoded: the
+ * areas reported by Imlib2 are collected and drawn into the window at most
+ * once per interval.
+ */
+#define FEH_PROGRESS_GRANULARITY 2
+#define FEH_PROGRESS_INTERVAL 0.05
+
+static unsigned char load_cancelled = 0;
+
+static winwidget progress_win = NULL;
+static Imlib_Image progress_im = NULL;
+static double progress_last;
+static int dirty_x0, dirty_y0, dirty_x1, dirty_y1;
+
+static void feh_load_progress_draw(Imlib_Image im, int x, int y, int w, int h)
+{
+	gib_list *file;
+
+	if ((w <= 0) || (h <= 0))
+		return;
+
+	if (dirty_x1 <= dirty_x0) {
+		dirty_x0 = x;
+		dirty_y0 = y;
+		dirty_x1 = x + w;
+		dirty_y1 = y + h;
+	} else {
+		if (x < dirty_x0)
+			dirty_x0 = x;
+		if (y < dirty_y0)
+			dirty_y0 = y;
+		if (x + w > dirty_x1)
+			dirty_x1 = x + w;
+		if (y + h > dirty_y1)
+			dirty_y1 = y + h;
+	}
+
+	if (feh_get_time() - progress_last < FEH_PROGRESS_INTERVAL)
+		return;
+
+	/* the window's old image is gone already, lend it the new one */
+	progress_win->im = im;
+	if (progress_im != im) {
+		progress_im = im;
+		progress_win->im_w = gib_imlib_image_get_width(im);
+		progress_win->im_h = gib_imlib_image_get_height(im);
+		winwidget_reset_image(progress_win);
+		/* captions etc. should belong to the image being loaded */
+		file = progress_win->file;
+		progress_win->file = current_file;
+		winwidget_render_image_loading(progress_win);
+		progress_win->file = file;
+	}
+	winwidget_render_image_part(progress_win, dirty_x0, dirty_y0,
+			dirty_x1 - dirty_x0, dirty_y1 - dirty_y0);
+	progress_win->im = NULL;
+	XFlush(disp);
+
+	dirty_x1 = dirty_x0;
+	progress_last = feh_get_time();
+	return;
+}
+
+static int feh_load_progress(Imlib_Image im, char percent,
+		int update_x, int update_y, int update_w, int update_h)
+{
+	XEvent ev;
+
+	if (!load_cancelled && XCheckIfEvent(disp, &ev, feh_event_is_navigation, NULL)) {
+		D(("navigation input, cancelling load at %d%%\n", percent));
+		XPutBackEvent(disp, &ev);
+		load_cancelled = 1;
+	}
+	/* once it's done, the regular rendering takes over */
+	if (!load_cancelled && progress_win && (percent < 100))
+		feh_load_progress_draw(im, update_x, update_y, update_w, update_h);
+
+	return(!load_cancelled);
+}
+
+void feh_load_set_progress_window(winwidget w)
+{
+	progress_win = w;
+	progress_im = NULL;
+	progress_last = feh_get_time();
+	dirty_x0 = dirty_x1 = 0;
+	return;
+}
+
+/*
+ * Returns 1 when switching interruption off after a load which was
+ * cancelled, 0 otherwise.
+ */
+int feh_load_set_interruptible(int interruptible)
+{
+	int cancelled = load_cancelled;
+
+	load_cancelled = 0;
+	if (interruptible) {
+		imlib_context_set_progress_function(feh_load_progress);
+		imlib_context_set_progress_granularity(FEH_PROGRESS_GRANULARITY);
+	} else
+		imlib_context_set_progress_function(NULL);
+	return(cancelled);
+}
+
 int feh_load_image_char(Imlib_Image * im, char *filename)
 {
 	feh_file *file;
@@ -119,12 +241,15 @@ int feh_load_image_char(Imlib_Image * im, char *filename)
 int feh_load_image(Imlib_Image * im, feh_file * file)
 {
 	Imlib_Load_Error err;
+	double start, decode_time = 0.0;
 
 	D(("filename is %s, image is %p\n", file->filename, im));
 
 	if (!file || !file->filename)
 		return(0);
 
+	file->tiled = 0;
+
 	/* Handle URLs */
 	if ((!strncmp(file->filename, "http://", 7)) || (!strncmp(file->filename, "https://", 8))
 			|| (!strncmp(file->filename, "ftp://", 6))) {
@@ -143,7 +268,8 @@ int feh_load_image(Imlib_Image * im, feh_file * file)
 			feh_file_info_load(file, *im);
 			file->filename = tempcpy;
 		}
-		if ((opt.slideshow) && (opt.reload == 0)) {
+		if ((opt.slideshow) && (opt.reload == 0)
+				&& !feh_mjpeg_active(file->filename)) {
 			/* Http, no reload, slideshow. Let's keep this image on hand... */
 			free(file->filename);
 			file->filename = estrdup(tmpname);
@@ -155,8 +281,32 @@ int feh_load_image(Imlib_Image * im, feh_file * file)
 		if (!opt.keep_http)
 			add_file_to_rm_filelist(tmpname);
 		free(tmpname);
+	} else if ((*im = feh_imgcache_fetch(file->filename))
+			|| (*im = feh_imgcache_disk_load(file->filename))) {
+		/* decoded before, unpack it instead of decoding the file again */
+		return(1);
+	} else if (feh_tiles_wanted(file->filename, NULL, NULL)
+			&& (*im = feh_tiles_overview(file->filename))) {
+		/* too large to decode at once, show the tile pyramid instead */
+		file->tiled = 1;
+		return(1);
 	} else {
+		start = feh_get_time();
 		*im = imlib_load_image_with_error_return(file->filename, &err);
+		if (*im && opt.cache_decoded) {
+			/* Imlib2 may defer decoding until the pixels are needed */
+			imlib_context_set_image(*im);
+			imlib_image_get_data_for_reading_only();
+		}
+		decode_time = feh_get_time() - start;
+	}
+
+	if (load_cancelled) {
+		/* Imlib2 returns (and caches) what it decoded so far, drop it */
+		if (*im)
+			gib_imlib_free_image_and_decache(*im);
+		*im = NULL;
+		return(0);
 	}
 
 	if ((err) || (!im)) {
@@ -228,13 +378,71 @@ int feh_load_image(Imlib_Image * im, feh_file * file)
 		return(0);
 	}
 
+	if (decode_time > 0.0)
+		feh_imgcache_disk_save(file->filename, *im, decode_time);
+
 	D(("Loaded ok\n"));
 	return(1);
 }
 
+/*
+ * Like feh_load_image, but the image only needs to cover w x h pixels (for
+ * thumbnails). Large PNG files are scaled down while they are decoded,
+ * without ever holding them in memory at full size. The dimensions of the
+ * original image are stored in orig_w / orig_h.
+ */
+int feh_load_image_scaled(Imlib_Image * im, feh_file * file, int w, int h,
+		int *orig_w, int *orig_h)
+{
+	if (file && file->filename && strncmp(file->filename, "http://", 7)
+			&& strncmp(file->filename, "https://", 8)
+			&& strncmp(file->filename, "ftp://", 6)) {
+		switch (feh_decode_claim(file->filename, w, h, im, orig_w, orig_h)) {
+		case 1:
+			D(("%s decoded in the background\n", file->filename));
+			return(1);
+		case -1:
+			/* crashed a decoder process, don't risk the main one */
+			return(0);
+		}
+		if ((*im = feh_png_load_scaled(file->filename, w, h, orig_w, orig_h))) {
+			D(("%s scaled while loading\n", file->filename));
+			return(1);
+		}
+	}
+
+	if (!feh_load_image(im, file))
+		return(0);
+
+	*orig_w = gib_imlib_image_get_width(*im);
+	*orig_h = gib_imlib_image_get_height(*im);
+	return(1);
+}
+
 char *feh_http_load_image(char *url)
 {
 	char *tmpname;
+
+	/* The prefetch scheduler may already have fetched (or be fetching) it */
+	switch (feh_http_prefetch_claim(url, &tmpname)) {
+	case PREFETCH_DONE:
+		return(tmpname);
+	case PREFETCH_FAILED:
+		return(NULL);
+	default:
+		break;
+	}
+
+	tmpname = feh_http_tmpname(url);
+	if (!feh_http_fetch(url, tmpname)) {
+		free(tmpname);
+		return(NULL);
+	}
+	return(tmpname);
+}
+
+char *feh_http_tmpname(char *url)
+{
 	char *basename;
 	char *path = NULL;
 
@@ -247,10 +455,63 @@ char *feh_http_load_image(char *url)
 		path = "/tmp/";
 
 	basename = strrchr(url, '/') + 1;
-	tmpname = feh_unique_filename(path, basename);
+	return(feh_unique_filename(path, basename));
+}
+
+/* Fetch url into tmpname. Returns 1 on success, 0 on failure. Does not free
+ * tmpname, and is safe to call from a prefetch child process. */
+int feh_http_fetch(char *url, char *tmpname)
+{
+	/* --http-cache always uses the builtin client for http:// URLs */
+	if (feh_http_cache_usable(url))
+		return(feh_http_cache_fetch(url, tmpname));
+	return(feh_http_fetch_uncached(url, tmpname));
+}
+
+/* feh_http_fetch without --http-cache: wget, or the builtin client with -Q */
+int feh_http_fetch_uncached(char *url, char *tmpname)
+{
+	if (opt.builtin_http)
+		return(feh_http_builtin_get(url, tmpname, NULL, NULL, 0));
+	else {
+		int pid;
+		int status;
+
+		if ((pid = fork()) < 0) {
+			weprintf("open url: fork failed:");
+			return(0);
+		} else if (pid == 0) {
+			char *quiet = NULL;
+
+			if (!opt.verbose)
+				quiet = estrdup("-q");
+
+			execlp("wget", "wget", "--no-clobber", "--cache=off",
+					"-O", tmpname, url, quiet, NULL);
+			eprintf("url: Is 'wget' installed? Failed to exec wget:");
+		} else {
+			waitpid(pid, &status, 0);
+
+			if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+				weprintf("url: wget failed to load URL %s\n", url);
+				unlink(tmpname);
+				return(0);
+			}
+		}
+	}
 
-	if (opt.builtin_http) {
-		/* state for HTTP header parser */
+	return(1);
+}
+
+/*
+ * The builtin HTTP/1.0 client. extra_headers, if set, is sent along with the
+ * request (without trailing EOL). If resp_headers is set, up to resp_size - 1
+ * bytes of the response status line and headers are stored there.
+ */
+int feh_http_builtin_get(char *url, char *tmpname, char *extra_headers,
+		char *resp_headers, int resp_size)
+{
+	/* state for HTTP header parser */
 #define SAW_NONE    1
 #define SAW_ONE_CM  2
 #define SAW_ONE_CJ  3
@@ -258,217 +519,221 @@ char *feh_http_load_image(char *url)
 #define IN_BODY     5
 
 #define OUR_BUF_SIZE 1024
+#define OUR_HEADER_SIZE 8192
 #define EOL "\015\012"
 
-		int sockno = 0;
-		int size;
-		int body = SAW_NONE;
-		struct addrinfo hints;
-		struct addrinfo *result, *rp;
-		char *hostname;
-		char *get_string;
-		char *host_string;
-		char *query_string;
-		char *get_url;
-		static char buf[OUR_BUF_SIZE];
-		char ua_string[] = "User-Agent: feh image viewer";
-		char accept_string[] = "Accept: image/*";
-		FILE *fp;
-
-		D(("using builtin http collection\n"));
-		fp = fopen(tmpname, "w");
-		if (!fp) {
-			weprintf("couldn't write to file %s:", tmpname);
-			free(tmpname);
-			return(NULL);
-		}
+	int sockno = 0;
+	int size;
+	int body = SAW_NONE;
+	int prev_body;
+	int hdr_len = 0;
+	int ret;
+	struct addrinfo hints;
+	struct addrinfo *result, *rp;
+	char *hostname;
+	char *get_string;
+	char *host_string;
+	char *query_string;
+	char *get_url;
+	static char buf[OUR_BUF_SIZE];
+	static char headers[OUR_HEADER_SIZE];
+	char ua_string[] = "User-Agent: feh image viewer";
+	char accept_string[] = "Accept: image/*";
+	FILE *fp;
+
+	D(("using builtin http collection\n"));
+	fp = fopen(tmpname, "w");
+	if (!fp) {
+		weprintf("couldn't write to file %s:", tmpname);
+		return(0);
+	}
 
-		hostname = feh_strip_hostname(url);
-		if (!hostname) {
-			weprintf("couldn't work out hostname from %s:", url);
-			fclose(fp);
-			unlink(tmpname);
-			free(tmpname);
-			return(NULL);
-		}
+	hostname = feh_strip_hostname(url);
+	if (!hostname) {
+		weprintf("couldn't work out hostname from %s:", url);
+		fclose(fp);
+		unlink(tmpname);
+		return(0);
+	}
 
-		D(("trying hostname %s\n", hostname));
-
-		memset(&hints, 0, sizeof(struct addrinfo));
-		hints.ai_family = AF_UNSPEC;
-		hints.ai_socktype = SOCK_STREAM;
-		hints.ai_flags = AI_NUMERICSERV;
-		hints.ai_protocol = 0;
-		if (getaddrinfo(hostname, "80", &hints, &result) != 0) {
-			weprintf("error resolving host %s:", hostname);
-			fclose(fp);
-			unlink(tmpname);
-			free(hostname);
-			free(tmpname);
-			return(NULL);
-		}
-		for (rp = result; rp != NULL; rp = rp->ai_next) {
-			sockno = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-			if (sockno == -1) {
-				continue;
-			}
-			if (connect(sockno, rp->ai_addr, rp->ai_addrlen) != -1) {
-				break;
-			}
-			close(sockno);
+	D(("trying hostname %s\n", hostname));
+
+	memset(&hints, 0, sizeof(struct addrinfo));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICSERV;
+	hints.ai_protocol = 0;
+	if (getaddrinfo(hostname, "80", &hints, &result) != 0) {
+		weprintf("error resolving host %s:", hostname);
+		fclose(fp);
+		unlink(tmpname);
+		free(hostname);
+		return(0);
+	}
+	for (rp = result; rp != NULL; rp = rp->ai_next) {
+		sockno = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+		if (sockno == -1) {
+			continue;
 		}
-		if (rp == NULL) {
-			weprintf("error connecting socket:");
-			freeaddrinfo(result);
-			fclose(fp);
-			unlink(tmpname);
-			free(tmpname);
-			free(hostname);
-			return(NULL);
+		if (connect(sockno, rp->ai_addr, rp->ai_addrlen) != -1) {
+			break;
 		}
+		close(sockno);
+	}
+	if (rp == NULL) {
+		weprintf("error connecting socket:");
 		freeaddrinfo(result);
-
-		get_url = strchr(url, '/') + 2;
-		get_url = strchr(get_url, '/');
-
-		get_string = estrjoin(" ", "GET", get_url, "HTTP/1.0", NULL);
-		host_string = estrjoin(" ", "Host:", hostname, NULL);
-		query_string = estrjoin(EOL, get_string, host_string, accept_string, ua_string, "", "", NULL);
-		/* At this point query_string looks something like
-		 **
-		 **    GET /dir/foo.jpg?123456 HTTP/1.0^M^J
-		 **    Host: www.example.com^M^J
-		 **    Accept: image/ *^M^J
-		 **    User-Agent: feh image viewer^M^J
-		 **    ^M^J
-		 **
-		 ** Host: is required by HTTP/1.1 and very important for some sites,
-		 ** even with HTTP/1.0
-		 **
-		 ** -- BEG
-		 */
-		if ((send(sockno, query_string, strlen(query_string), 0)) == -1) {
-			free(get_string);
-			free(host_string);
-			free(query_string);
-			free(tmpname);
-			free(hostname);
-			weprintf("error sending over socket:");
-			return(NULL);
-		}
+		fclose(fp);
+		unlink(tmpname);
+		free(hostname);
+		return(0);
+	}
+	freeaddrinfo(result);
+
+	get_url = strchr(url, '/') + 2;
+	get_url = strchr(get_url, '/');
+
+	get_string = estrjoin(" ", "GET", get_url, "HTTP/1.0", NULL);
+	host_string = estrjoin(" ", "Host:", hostname, NULL);
+	if (extra_headers)
+		query_string = estrjoin(EOL, get_string, host_string, accept_string,
+				ua_string, extra_headers, "", "", NULL);
+	else
+		query_string = estrjoin(EOL, get_string, host_string, accept_string,
+				ua_string, "", "", NULL);
+	/* At this point query_string looks something like
+	 **
+	 **    GET /dir/foo.jpg?123456 HTTP/1.0^M^J
+	 **    Host: www.example.com^M^J
+	 **    Accept: image/ *^M^J
+	 **    User-Agent: feh image viewer^M^J
+	 **    ^M^J
+	 **
+	 ** Host: is required by HTTP/1.1 and very important for some sites,
+	 ** even with HTTP/1.0
+	 **
+	 ** -- BEG
+	 */
+	if ((send(sockno, query_string, strlen(query_string), 0)) == -1) {
 		free(get_string);
 		free(host_string);
 		free(query_string);
 		free(hostname);
+		close(sockno);
+		fclose(fp);
+		unlink(tmpname);
+		weprintf("error sending over socket:");
+		return(0);
+	}
+	free(get_string);
+	free(host_string);
+	free(query_string);
+	free(hostname);
+
+	while ((size = read(sockno, &buf, OUR_BUF_SIZE))) {
+		if (body == IN_BODY) {
+			fwrite(buf, 1, size, fp);
+		} else {
+			int i;
+
+			for (i = 0; i < size; i++) {
+				/* We are looking for ^M^J^M^J, but will accept
+				 ** ^J^J from broken servers. Stray ^Ms will be
+				 ** ignored.
+				 **
+				 ** TODO:
+				 ** Checking the headers for a
+				 **    Content-Type: image/ *
+				 ** header would help detect problems with results.
+				 ** Maybe look at the response code too? But there is
+				 ** no fundamental reason why a 4xx or 5xx response
+				 ** could not return an image, it is just the 3xx
+				 ** series we need to worry about.
+				 **
+				 ** Also, grabbing the size from the Content-Length
+				 ** header and killing the connection after that
+				 ** many bytes where read would speed up closing the
+				 ** socket.
+				 ** -- BEG
+				 */
+
+				if ((body != IN_BODY) && (hdr_len < OUR_HEADER_SIZE - 1))
+					headers[hdr_len++] = buf[i];
+				headers[hdr_len] = '\0';
+				prev_body = body;
+
+				switch (body) {
+
+				case IN_BODY:
+					fwrite(buf + i, 1, size - i, fp);
+					i = size;
+					break;
+
+				case SAW_ONE_CM:
+					if (buf[i] == '\012') {
+						body = SAW_ONE_CJ;
+					} else {
+						body = SAW_NONE;
+					}
+					break;
 
-		while ((size = read(sockno, &buf, OUR_BUF_SIZE))) {
-			if (body == IN_BODY) {
-				fwrite(buf, 1, size, fp);
-			} else {
-				int i;
-
-				for (i = 0; i < size; i++) {
-					/* We are looking for ^M^J^M^J, but will accept
-					 ** ^J^J from broken servers. Stray ^Ms will be
-					 ** ignored.
-					 **
-					 ** TODO:
-					 ** Checking the headers for a
-					 **    Content-Type: image/ *
-					 ** header would help detect problems with results.
-					 ** Maybe look at the response code too? But there is
-					 ** no fundamental reason why a 4xx or 5xx response
-					 ** could not return an image, it is just the 3xx
-					 ** series we need to worry about.
-					 **
-					 ** Also, grabbing the size from the Content-Length
-					 ** header and killing the connection after that
-					 ** many bytes where read would speed up closing the
-					 ** socket.
-					 ** -- BEG
-					 */
-
-					switch (body) {
-
-					case IN_BODY:
-						fwrite(buf + i, 1, size - i, fp);
-						i = size;
-						break;
-
-					case SAW_ONE_CM:
+				case SAW_ONE_CJ:
+					if (buf[i] == '\015') {
+						body = SAW_TWO_CM;
+					} else {
 						if (buf[i] == '\012') {
-							body = SAW_ONE_CJ;
+							body = IN_BODY;
 						} else {
 							body = SAW_NONE;
 						}
-						break;
+					}
+					break;
 
-					case SAW_ONE_CJ:
-						if (buf[i] == '\015') {
-							body = SAW_TWO_CM;
-						} else {
-							if (buf[i] == '\012') {
-								body = IN_BODY;
-							} else {
-								body = SAW_NONE;
-							}
-						}
-						break;
+				case SAW_TWO_CM:
+					if (buf[i] == '\012') {
+						body = IN_BODY;
+					} else {
+						body = SAW_NONE;
+					}
+					break;
 
-					case SAW_TWO_CM:
+				case SAW_NONE:
+					if (buf[i] == '\015') {
+						body = SAW_ONE_CM;
+					} else {
 						if (buf[i] == '\012') {
-							body = IN_BODY;
-						} else {
-							body = SAW_NONE;
-						}
-						break;
-
-					case SAW_NONE:
-						if (buf[i] == '\015') {
-							body = SAW_ONE_CM;
-						} else {
-							if (buf[i] == '\012') {
-								body = SAW_ONE_CJ;
-							}
+							body = SAW_ONE_CJ;
 						}
-						break;
-
-					}	/* switch */
-				}	/* for i */
-			}
-		}		/* while read */
-		close(sockno);
-		fclose(fp);
-	} else {
-		int pid;
-		int status;
-
-		if ((pid = fork()) < 0) {
-			weprintf("open url: fork failed:");
-			free(tmpname);
-			return(NULL);
-		} else if (pid == 0) {
-			char *quiet = NULL;
-
-			if (!opt.verbose)
-				quiet = estrdup("-q");
-
-			execlp("wget", "wget", "--no-clobber", "--cache=off",
-					"-O", tmpname, url, quiet, NULL);
-			eprintf("url: Is 'wget' installed? Failed to exec wget:");
-		} else {
-			waitpid(pid, &status, 0);
-
-			if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
-				weprintf("url: wget failed to load URL %s\n", url);
-				unlink(tmpname);
-				free(tmpname);
-				return(NULL);
-			}
+					}
+					break;
+
+				}	/* switch */
+
+				/* MJPEG streams never end, hand them over after the headers */
+				if ((prev_body != IN_BODY) && (body == IN_BODY)
+						&& feh_mjpeg_is_stream(headers)) {
+					ret = feh_mjpeg_start(url, sockno, fp, headers,
+							buf + i + 1, size - i - 1);
+					if ((fclose(fp) != 0) || !ret) {
+						unlink(tmpname);
+						ret = 0;
+					}
+					if (resp_headers) {
+						strncpy(resp_headers, headers, resp_size - 1);
+						resp_headers[resp_size - 1] = '\0';
+					}
+					return(ret);
+				}
+			}	/* for i */
 		}
+	}		/* while read */
+	close(sockno);
+	fclose(fp);
+	if (resp_headers) {
+		strncpy(resp_headers, headers, resp_size - 1);
+		resp_headers[resp_size - 1] = '\0';
 	}
-
-	return(tmpname);
+	return(1);
 }
 
 char *feh_strip_hostname(char *url)
@@ -28,6 +28,9 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include "filelist.h"
 #include "winwidget.h"
 #include "options.h"
+#include "http.h"
+#include "decode.h"
+#include "readahead.h"
 
 static char *create_index_dimension_string(int w, int h);
 static char *create_index_size_string(char *file);
@@ -311,15 +314,17 @@ void init_index_mode(void)
 			filelist = feh_file_remove_from_list(filelist, last);
 			last = NULL;
 		}
+		feh_http_prefetch_list(l);
+		feh_decode_prefetch_list(l, opt.thumb_w, opt.thumb_h, NULL);
+		feh_readahead_list(l);
 		D(("About to load image %s\n", file->filename));
-		if (feh_load_image(&im_temp, file) != 0) {
+		if (feh_load_image_scaled(&im_temp, file, opt.thumb_w, opt.thumb_h,
+					&ww, &hh) != 0) {
 			if (opt.verbose)
 				feh_display_status('.');
 			D(("Successfully loaded %s\n", file->filename));
 			www = opt.thumb_w;
 			hhh = opt.thumb_h;
-			ww = gib_imlib_image_get_width(im_temp);
-			hh = gib_imlib_image_get_height(im_temp);
 			thumbnailcount++;
 
 			if (opt.aspect) {
@@ -340,7 +345,9 @@ void init_index_mode(void)
 				hhh = hh;
 			}
 
-			im_thumb = gib_imlib_create_cropped_scaled_image(im_temp, 0, 0, ww, hh, www, hhh, 1);
+			im_thumb = gib_imlib_create_cropped_scaled_image(im_temp, 0, 0,
+					gib_imlib_image_get_width(im_temp),
+					gib_imlib_image_get_height(im_temp), www, hhh, 1);
 			gib_imlib_free_image_and_decache(im_temp);
 
 			if (opt.alpha) {
@@ -457,8 +464,10 @@ void init_index_mode(void)
 				exit(0);
 		}
 	}
-	if (opt.verbose)
+	if (opt.verbose) {
 		fprintf(stdout, "\n");
+		feh_readahead_report();
+	}
 
 	if (opt.title_font) {
 		int fw, fh, fx, fy;
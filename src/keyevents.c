@@ -297,6 +297,35 @@ static short feh_is_kp(fehkey *key, int sym, int state) {
 	return 0;
 }
 
+/*
+ * XCheckIfEvent predicate matching input which leaves the current slideshow
+ * image. Used to abort loads which would be obsolete by the time they finish.
+ */
+Bool feh_event_is_navigation(__attribute__ ((unused)) Display * d,
+		XEvent * ev, __attribute__ ((unused)) XPointer arg)
+{
+	KeySym keysym;
+	int state;
+
+	if (ev->type == KeyPress) {
+		XLookupString(&ev->xkey, NULL, 0, &keysym, NULL);
+		state = ev->xkey.state & (ControlMask | Mod1Mask | Mod4Mask);
+		return(feh_is_kp(&keys.next_img, keysym, state)
+				|| feh_is_kp(&keys.prev_img, keysym, state)
+				|| feh_is_kp(&keys.jump_back, keysym, state)
+				|| feh_is_kp(&keys.jump_fwd, keysym, state)
+				|| feh_is_kp(&keys.jump_first, keysym, state)
+				|| feh_is_kp(&keys.jump_last, keysym, state)
+				|| feh_is_kp(&keys.jump_random, keysym, state)
+				|| feh_is_kp(&keys.quit, keysym, state));
+	} else if (ev->type == ButtonPress)
+		return((ev->xbutton.button == opt.prev_button)
+				|| (ev->xbutton.button == opt.next_button));
+	else if (ev->type == ButtonRelease)
+		return(ev->xbutton.button == opt.pan_button);
+	return(False);
+}
+
 void feh_event_invoke_action(winwidget winwid, unsigned char action)
 {
 	if (opt.actions[action]) {
@@ -431,20 +460,32 @@ void feh_event_handle_keypress(XEvent * ev)
 		winwidget_render_image(winwid, 0, 0);
 	}
 	else if (feh_is_kp(&keys.scroll_down, keysym, state)) {
-		winwid->im_y -= 20;
-		winwidget_render_image(winwid, 0, 0);
+		if (opt.thumb_scroll && (winwid->type == WIN_TYPE_THUMBNAIL))
+			feh_thumbnail_scroll(winwid, 1, 0);
+		else {
+			winwid->im_y -= 20;
+			winwidget_render_image(winwid, 0, 0);
+		}
 	}
 	else if (feh_is_kp(&keys.scroll_up, keysym, state)) {
-		winwid->im_y += 20;
-		winwidget_render_image(winwid, 0, 0);
+		if (opt.thumb_scroll && (winwid->type == WIN_TYPE_THUMBNAIL))
+			feh_thumbnail_scroll(winwid, -1, 0);
+		else {
+			winwid->im_y += 20;
+			winwidget_render_image(winwid, 0, 0);
+		}
 	}
 	else if (feh_is_kp(&keys.jump_back, keysym, state)) {
 		if (opt.slideshow)
 			slideshow_change_image(winwid, SLIDE_JUMP_BACK);
+		else if (winwid->type == WIN_TYPE_THUMBNAIL)
+			feh_thumbnail_scroll(winwid, -1, 1);
 	}
 	else if (feh_is_kp(&keys.jump_fwd, keysym, state)) {
 		if (opt.slideshow)
 			slideshow_change_image(winwid, SLIDE_JUMP_FWD);
+		else if (winwid->type == WIN_TYPE_THUMBNAIL)
+			feh_thumbnail_scroll(winwid, 1, 1);
 	}
 	else if (feh_is_kp(&keys.quit, keysym, state)) {
 		winwidget_destroy_all();
@@ -29,6 +29,13 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include "winwidget.h"
 #include "timers.h"
 #include "options.h"
+#include "http.h"
+#include "decode.h"
+#include "imgcache.h"
+#include "readahead.h"
+#include "mjpeg.h"
+#include "thumbnail.h"
+#include "thumbwrite.h"
 #include "events.h"
 #include "support.h"
 
@@ -36,8 +43,12 @@ char **cmdargv = NULL;
 int cmdargc = 0;
 char *mode = NULL;
 
+/* forked helpers inherit the atexit handler, see feh_clean_exit */
+static pid_t main_pid;
+
 int main(int argc, char **argv)
 {
+	main_pid = getpid();
 	atexit(feh_clean_exit);
 
 	init_parse_options(argc, argv);
@@ -51,7 +62,13 @@ int main(int argc, char **argv)
 
 	feh_event_init();
 
-	if (opt.index)
+	if (opt.thumb_cache_gc) {
+		feh_thumbnail_cache_gc();
+		exit(0);
+	} else if (opt.generate_thumbs) {
+		feh_thumbnail_generate_all();
+		exit(0);
+	} else if (opt.index)
 		init_index_mode();
 	else if (opt.collage)
 		init_collage_mode();
@@ -91,6 +108,7 @@ int feh_main_iteration(int block)
 	XEvent ev;
 	struct timeval tval;
 	fd_set fdset;
+	int fdmax;
 	int count = 0;
 	double t1 = 0.0, t2 = 0.0;
 	fehtimer ft;
@@ -106,6 +124,9 @@ int feh_main_iteration(int block)
 		first = 0;
 	}
 
+	/* reap finished downloads, start queued ones */
+	feh_http_prefetch_poll();
+
 	/* Timers */
 	t1 = feh_get_time();
 	t2 = t1 - pt;
@@ -124,6 +145,7 @@ int feh_main_iteration(int block)
 
 	FD_ZERO(&fdset);
 	FD_SET(xfd, &fdset);
+	fdmax = feh_mjpeg_fdset(&fdset, fdsize);
 
 	/* Timers */
 	ft = first_timer;
@@ -156,11 +178,13 @@ int feh_main_iteration(int block)
 				tval.tv_usec = 1000;
 			errno = 0;
 			D(("Performing blocking select - waiting for timer or event\n"));
-			count = select(fdsize, &fdset, NULL, NULL, &tval);
+			count = select(fdmax, &fdset, NULL, NULL, &tval);
 			if ((count < 0)
 					&& ((errno == ENOMEM) || (errno == EINVAL)
 						|| (errno == EBADF)))
 				eprintf("Connection to X display lost");
+			if (count > 0)
+				feh_mjpeg_handle(&fdset);
 			if ((ft) && (count == 0)) {
 				/* This means the timer is due to be executed. If count was > 0,
 				   that would mean an X event had woken us, we're not interested
@@ -173,11 +197,13 @@ int feh_main_iteration(int block)
 		if (block && !XPending(disp)) {
 			errno = 0;
 			D(("Performing blocking select - no timers, or zooming\n"));
-			count = select(fdsize, &fdset, NULL, NULL, NULL);
+			count = select(fdmax, &fdset, NULL, NULL, NULL);
 			if ((count < 0)
 					&& ((errno == ENOMEM) || (errno == EINVAL)
 						|| (errno == EBADF)))
 				eprintf("Connection to X display lost");
+			if (count > 0)
+				feh_mjpeg_handle(&fdset);
 		}
 	}
 	if (window_num == 0)
@@ -188,6 +214,20 @@ int feh_main_iteration(int block)
 
 void feh_clean_exit(void)
 {
+	/*
+	 * Prefetch children, decoder processes and the like share our state
+	 * but not our threads or child processes. Cleaning up is the main
+	 * process' job, they must leave its files alone.
+	 */
+	if (getpid() != main_pid)
+		return;
+
+	feh_http_prefetch_cleanup();
+	feh_decode_cleanup();
+	feh_readahead_cleanup();
+	feh_imgcache_cleanup();
+	feh_thumbwrite_cleanup();
+	feh_thumbnail_cleanup();
 	delete_rm_files();
 
 	if (opt.filelistfile)
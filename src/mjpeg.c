@@ -0,0 +1,428 @@
+/* mjpeg.c
+
+Copyright (C) 2011 by Daniel Friesel
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to
+deal in the Software without restriction, including without limitation the
+rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies of the Software and its documentation and acknowledgment shall be
+given in the documentation and software packages that this Software was
+used.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+#include "feh.h"
+#include "filelist.h"
+#include "winwidget.h"
+#include "options.h"
+#include "mjpeg.h"
+
+#include <fcntl.h>
+
+/*
+ * multipart/x-mixed-replace ("MJPEG") streams, as served by most network
+ * cameras. The builtin HTTP client hands the connection over to us once it
+ * sees such a response. If the first frame came along with the headers, it
+ * is returned like a normal download, otherwise a placeholder is. After
+ * that the socket is watched by feh_main_iteration. Whenever data
+ * arrives, everything available is read, and only the newest complete frame
+ * is decoded and shown in the windows displaying the stream URL. A stream
+ * is closed once no window shows it anymore.
+ */
+
+/* give up on streams which don't deliver a complete frame within this */
+#define MJPEG_MAX_BUFFER (16 * 1024 * 1024)
+#define MJPEG_READ_SIZE 65536
+
+typedef struct __feh_mjpeg feh_mjpeg;
+
+struct __feh_mjpeg {
+	char *url;
+	char *boundary;
+	int fd;
+	char *buf;
+	int len;
+	int size;
+	char *tmpname;
+	unsigned int frames;
+	unsigned int dropped;
+};
+
+/* 1x1 black PNG, shown until the first frame of a stream arrives */
+static const unsigned char mjpeg_placeholder[] =
+	"\x89\x50\x4e\x47\x0d\x0a\x1a\x0a\x00\x00\x00\x0d\x49\x48\x44\x52"
+	"\x00\x00\x00\x01\x00\x00\x00\x01\x08\x00\x00\x00\x00\x3a\x7e\x9b"
+	"\x55\x00\x00\x00\x0a\x49\x44\x41\x54\x78\xda\x63\x60\x00\x00\x00"
+	"\x02\x00\x01\xe5\x27\xde\xfc\x00\x00\x00\x00\x49\x45\x4e\x44\xae"
+	"\x42\x60\x82";
+
+static gib_list *streams = NULL;
+static int adopt_streams = 1;
+static int streams_seen = 0;
+
+static char *feh_mjpeg_memmem(char *hay, int haylen, char *needle, int len)
+{
+	char *end = hay + haylen - len;
+
+	for (; hay <= end; hay++)
+		if ((*hay == *needle) && !memcmp(hay, needle, len))
+			return(hay);
+	return(NULL);
+}
+
+/* Returns the boundary parameter of a multipart/x-mixed-replace response */
+static char *feh_mjpeg_get_boundary(char *headers)
+{
+	char *line, *pos, *end, *ret;
+
+	for (line = headers; line && *line; line = strchr(line, '\n')) {
+		if (*line == '\n')
+			line++;
+		if (strncasecmp(line, "Content-Type:", 13))
+			continue;
+		for (line += 13; (*line == ' ') || (*line == '\t'); line++);
+		if (strncasecmp(line, "multipart/x-mixed-replace", 25))
+			return(NULL);
+		if (!(pos = strstr(line, "boundary=")))
+			return(NULL);
+		pos += 9;
+		if (*pos == '"')
+			pos++;
+		/*
+		 * Many cameras put the leading -- into the parameter as well, so
+		 * the delimiter is searched without it.
+		 */
+		while (*pos == '-')
+			pos++;
+		for (end = pos; *end && !strchr("\"; \t\r\n", *end); end++);
+		if (end == pos)
+			return(NULL);
+		ret = emalloc(end - pos + 1);
+		memcpy(ret, pos, end - pos);
+		ret[end - pos] = '\0';
+		return(ret);
+	}
+	return(NULL);
+}
+
+int feh_mjpeg_is_stream(char *headers)
+{
+	char *boundary = feh_mjpeg_get_boundary(headers);
+
+	if (!boundary)
+		return(0);
+	free(boundary);
+	return(1);
+}
+
+/*
+ * Look for the first complete part in the stream buffer. On success, *frame
+ * and *frame_len describe its body and the return value is the number of
+ * bytes which may be discarded from the buffer afterwards. Otherwise, they
+ * are left alone, so they still describe the previous complete part.
+ */
+static int feh_mjpeg_next_part(feh_mjpeg * s, int start, char **frame, int *frame_len)
+{
+	char *delim, *body, *end, *cl;
+	int blen = strlen(s->boundary);
+	int left, len;
+
+	if (!(delim = feh_mjpeg_memmem(s->buf + start, s->len - start, s->boundary, blen)))
+		return(0);
+
+	/* part headers end with an empty line */
+	left = s->len - (delim - s->buf);
+	if ((body = feh_mjpeg_memmem(delim, left, "\r\n\r\n", 4)))
+		body += 4;
+	else if ((body = feh_mjpeg_memmem(delim, left, "\n\n", 2)))
+		body += 2;
+	else
+		return(0);
+
+	left = s->len - (body - s->buf);
+
+	/* use Content-Length if the camera sends it, the next delimiter if not */
+	cl = feh_mjpeg_memmem(delim, body - delim, "\nContent-Length:", 16);
+	if (!cl)
+		cl = feh_mjpeg_memmem(delim, body - delim, "\ncontent-length:", 16);
+	if (cl) {
+		len = atoi(cl + 16);
+		if ((len < 0) || (len > left))
+			return(0);
+		end = body + len;
+	} else {
+		if (!(end = feh_mjpeg_memmem(body, left, s->boundary, blen)))
+			return(0);
+		/* the delimiter is --boundary on a line of its own */
+		while ((end > body) && (end[-1] == '-'))
+			end--;
+		if ((end > body) && (end[-1] == '\n'))
+			end--;
+		if ((end > body) && (end[-1] == '\r'))
+			end--;
+		len = end - body;
+	}
+	*frame = body;
+	*frame_len = len;
+	return(end - s->buf);
+}
+
+/*
+ * Find the newest complete frame. Older ones are dropped, so a slow
+ * display never falls behind the camera. Returns the number of bytes to
+ * discard once the frame has been shown.
+ */
+static int feh_mjpeg_newest_frame(feh_mjpeg * s, char **frame, int *frame_len)
+{
+	int pos = 0, next;
+
+	while ((next = feh_mjpeg_next_part(s, pos, frame, frame_len)) > 0) {
+		if (pos)
+			s->dropped++;
+		pos = next;
+	}
+	if (pos)
+		s->frames++;
+	return(pos);
+}
+
+static void feh_mjpeg_consume(feh_mjpeg * s, int len)
+{
+	memmove(s->buf, s->buf + len, s->len - len);
+	s->len -= len;
+	return;
+}
+
+/*
+ * Read whatever is available. Returns 0 on EOF or error.
+ */
+static int feh_mjpeg_read(feh_mjpeg * s)
+{
+	int size;
+
+	for (;;) {
+		if (s->size - s->len < MJPEG_READ_SIZE) {
+			if (s->size >= MJPEG_MAX_BUFFER) {
+				weprintf("%s: no complete frame in %d bytes, giving up",
+						s->url, s->len);
+				return(0);
+			}
+			s->size = s->size ? s->size * 2 : MJPEG_READ_SIZE * 2;
+			s->buf = erealloc(s->buf, s->size);
+		}
+		size = read(s->fd, s->buf + s->len, s->size - s->len);
+		if (size > 0)
+			s->len += size;
+		else if (size == 0)
+			return(0);
+		else if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+			return(1);
+		else if (errno != EINTR) {
+			weprintf("%s: read failed:", s->url);
+			return(0);
+		}
+	}
+}
+
+static void feh_mjpeg_free(feh_mjpeg * s)
+{
+	D(("closing stream %s after %d frames (%d dropped)\n", s->url,
+				s->frames, s->dropped));
+	close(s->fd);
+	if (s->tmpname) {
+		unlink(s->tmpname);
+		free(s->tmpname);
+	}
+	free(s->url);
+	free(s->boundary);
+	free(s->buf);
+	free(s);
+	return;
+}
+
+/*
+ * Called by the builtin HTTP client after the headers of a multipart
+ * response. data contains whatever it already read past them. Writes the
+ * first frame to fp if it is complete already, or a placeholder image, and
+ * takes ownership of fd. Nothing waits for the camera here; frames are
+ * read by feh_mjpeg_handle once the socket becomes readable.
+ */
+int feh_mjpeg_start(char *url, int fd, FILE * fp, char *headers, char *data,
+		int len)
+{
+	feh_mjpeg *s;
+	char *frame;
+	int frame_len, used;
+	int ret = 0;
+
+	streams_seen = 1;
+
+	s = emalloc(sizeof(feh_mjpeg));
+	memset(s, 0, sizeof(feh_mjpeg));
+	s->url = estrdup(url);
+	s->fd = fd;
+	if (!(s->boundary = feh_mjpeg_get_boundary(headers))) {
+		close(fd);
+		free(s->url);
+		free(s);
+		return(0);
+	}
+	s->size = MJPEG_READ_SIZE * 2;
+	s->buf = emalloc(s->size);
+	if (len > s->size) {
+		s->size = len;
+		s->buf = erealloc(s->buf, s->size);
+	}
+	memcpy(s->buf, data, len);
+	s->len = len;
+
+	D(("%s is a multipart stream, boundary %s\n", url, s->boundary));
+
+	if ((used = feh_mjpeg_next_part(s, 0, &frame, &frame_len))) {
+		s->frames++;
+		if (fwrite(frame, 1, frame_len, fp) == (size_t) frame_len)
+			ret = 1;
+		feh_mjpeg_consume(s, used);
+	} else if (adopt_streams) {
+		if (fwrite(mjpeg_placeholder, 1, sizeof(mjpeg_placeholder) - 1, fp)
+				== sizeof(mjpeg_placeholder) - 1)
+			ret = 1;
+	} else {
+		/* prefetch processes only report the stream */
+		ret = 1;
+	}
+
+	if (ret && adopt_streams && !feh_mjpeg_active(url)) {
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		s->tmpname = feh_unique_filename("/tmp/", "feh_mjpeg");
+		streams = gib_list_add_end(streams, s);
+	} else
+		feh_mjpeg_free(s);
+
+	return(ret);
+}
+
+int feh_mjpeg_active(char *url)
+{
+	gib_list *l;
+
+	for (l = streams; l; l = l->next)
+		if (!strcmp(((feh_mjpeg *) l->data)->url, url))
+			return(1);
+	return(0);
+}
+
+/* Prefetch processes must not keep streams around, only report them */
+void feh_mjpeg_set_adopt(int adopt)
+{
+	adopt_streams = adopt;
+	return;
+}
+
+int feh_mjpeg_seen(void)
+{
+	return(streams_seen);
+}
+
+int feh_mjpeg_fdset(fd_set * fds, int fdsize)
+{
+	gib_list *l;
+	int fd;
+
+	for (l = streams; l; l = l->next) {
+		fd = ((feh_mjpeg *) l->data)->fd;
+		FD_SET(fd, fds);
+		if (fd >= fdsize)
+			fdsize = fd + 1;
+	}
+	return(fdsize);
+}
+
+/* Show a frame in every window displaying the stream. 0 if there are none */
+static int feh_mjpeg_show(feh_mjpeg * s, char *frame, int frame_len)
+{
+	FILE *fp;
+	Imlib_Image im = NULL;
+	winwidget w;
+	int i, resize;
+	int shown = 0;
+
+	for (i = 0; i < window_num; i++) {
+		w = windows[i];
+		if (!w->file || strcmp(FEH_FILE(w->file->data)->filename, s->url))
+			continue;
+
+		if (!shown) {
+			if (!(fp = fopen(s->tmpname, "w"))) {
+				weprintf("couldn't write to file %s:", s->tmpname);
+				return(1);
+			}
+			fwrite(frame, 1, frame_len, fp);
+			fclose(fp);
+			/* every frame uses the same file, so bypass Imlib's cache */
+			im = imlib_load_image_immediately_without_cache(s->tmpname);
+			if (!im) {
+				D(("undecodable frame in %s\n", s->url));
+				return(1);
+			}
+		} else
+			im = gib_imlib_clone_image(im);
+		shown++;
+
+		/* no image yet (placeholder load failed) counts as a new size */
+		resize = 0;
+		if (!w->im
+				|| (gib_imlib_image_get_width(w->im) != gib_imlib_image_get_width(im))
+				|| (gib_imlib_image_get_height(w->im) != gib_imlib_image_get_height(im))) {
+			resize = 1;
+			winwidget_reset_image(w);
+		}
+		winwidget_free_image(w);
+		w->im = im;
+		w->im_w = gib_imlib_image_get_width(w->im);
+		w->im_h = gib_imlib_image_get_height(w->im);
+		winwidget_render_image(w, resize, 1);
+	}
+	return(shown);
+}
+
+void feh_mjpeg_handle(fd_set * fds)
+{
+	gib_list *l, *next;
+	feh_mjpeg *s;
+	char *frame;
+	int frame_len, used;
+	int alive;
+
+	for (l = streams; l; l = next) {
+		next = l->next;
+		s = l->data;
+		if (!FD_ISSET(s->fd, fds))
+			continue;
+
+		alive = feh_mjpeg_read(s);
+
+		if ((used = feh_mjpeg_newest_frame(s, &frame, &frame_len))) {
+			if (frame_len && !feh_mjpeg_show(s, frame, frame_len))
+				alive = 0;
+			feh_mjpeg_consume(s, used);
+		}
+
+		if (!alive) {
+			streams = gib_list_remove(streams, l);
+			feh_mjpeg_free(s);
+		}
+	}
+	return;
+}
@@ -28,6 +28,7 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include "timers.h"
 #include "filelist.h"
 #include "options.h"
+#include "http.h"
 
 void init_multiwindow_mode(void)
 {
@@ -42,6 +43,7 @@ void init_multiwindow_mode(void)
 		int len = 0;
 		file = FEH_FILE(l->data);
 		current_file = l;
+		feh_http_prefetch_list(l);
 
 		if (!opt.title) {
 			len = strlen(PACKAGE " - ") + strlen(file->filename) + 1;
@@ -57,6 +57,11 @@ void init_parse_options(int argc, char **argv)
 	opt.thumb_w = 60;
 	opt.thumb_h = 60;
 	opt.thumb_redraw = 10;
+	opt.http_jobs = 0;
+	opt.http_host_jobs = 2;
+	opt.tile_limit = 0;
+	opt.decode_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	opt.io_depth = 4;
 	opt.menu_font = estrdup(DEFAULT_MENU_FONT);
 	opt.font = NULL;
 	opt.image_bg = estrdup("default");
@@ -110,7 +115,7 @@ void init_parse_options(int argc, char **argv)
 
 	D(("Options parsed\n"));
 
-	if (opt.bgmode)
+	if (opt.bgmode || opt.thumb_cache_gc)
 		return;
 
 	filelist_len = gib_list_length(filelist);
@@ -425,6 +430,21 @@ static void feh_parse_option_array(int argc, char **argv)
 		{"index-dim"     , 1, 0, 232},
 		{"thumb-redraw"  , 1, 0, 'J'},
 		{"info"          , 1, 0, 234},
+		{"http-jobs"     , 1, 0, 235},
+		{"http-host-jobs", 1, 0, 236},
+		{"http-cache"    , 0, 0, 237},
+		{"tile-limit"    , 1, 0, 238},
+		{"decode-jobs"   , 1, 0, 239},
+		{"decode-processes", 0, 0, 240},
+		{"io-depth"      , 1, 0, 241},
+		{"io-order"      , 0, 0, 242},
+		{"cache-compressed", 1, 0, 243},
+		{"cache-decoded" , 1, 0, 244},
+		{"cache-display" , 0, 0, 245},
+		{"thumb-scroll"  , 0, 0, 246},
+		{"thumb-pack"    , 0, 0, 247},
+		{"thumb-cache-gc", 1, 0, 248},
+		{"generate-thumbnails", 0, 0, 249},
 
 		{0, 0, 0, 0}
 	};
@@ -777,6 +797,54 @@ static void feh_parse_option_array(int argc, char **argv)
 		case 234:
 			opt.info_cmd = estrdup(optarg);
 			break;
+		case 235:
+			opt.http_jobs = atoi(optarg);
+			break;
+		case 236:
+			opt.http_host_jobs = atoi(optarg);
+			break;
+		case 237:
+			opt.http_cache = 1;
+			break;
+		case 238:
+			opt.tile_limit = atoi(optarg);
+			break;
+		case 239:
+			opt.decode_jobs = atoi(optarg);
+			break;
+		case 240:
+			opt.decode_processes = 1;
+			break;
+		case 241:
+			opt.io_depth = atoi(optarg);
+			break;
+		case 242:
+			opt.io_order = 1;
+			break;
+		case 243:
+			opt.cache_compressed = atoi(optarg);
+			break;
+		case 244:
+			opt.cache_decoded = atoi(optarg);
+			break;
+		case 245:
+			opt.cache_display = 1;
+			break;
+		case 246:
+			opt.thumb_scroll = 1;
+			break;
+		case 247:
+			opt.thumb_pack = 1;
+			break;
+		case 248:
+			opt.thumb_cache_gc = 1;
+			opt.thumb_cache_budget = atoi(optarg);
+			opt.display = 0;
+			break;
+		case 249:
+			opt.generate_thumbs = 1;
+			opt.display = 0;
+			break;
 		default:
 			break;
 		}
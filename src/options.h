@@ -50,6 +50,14 @@ struct __fehoptions {
 	unsigned char aspect;
 	unsigned char stretch;
 	unsigned char keep_http;
+	unsigned char http_cache;
+	unsigned char decode_processes;
+	unsigned char io_order;
+	unsigned char cache_display;
+	unsigned char thumb_scroll;
+	unsigned char thumb_pack;
+	unsigned char thumb_cache_gc;
+	unsigned char generate_thumbs;
 	unsigned char borderless;
 	unsigned char randomize;
 	unsigned char jump_on_resort;
@@ -113,6 +121,14 @@ struct __fehoptions {
 	int limit_w;
 	int limit_h;
 	unsigned int thumb_redraw;
+	int http_jobs;
+	int http_host_jobs;
+	int tile_limit;
+	int decode_jobs;
+	int io_depth;
+	int cache_compressed;
+	int cache_decoded;
+	int thumb_cache_budget;
 	int reload;
 	int sort;
 	int debug;
@@ -0,0 +1,318 @@
+/* readahead.c
+
+Copyright (C) 2011 by Daniel Friesel
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to
+deal in the Software without restriction, including without limitation the
+rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies of the Software and its documentation and acknowledgment shall be
+given in the documentation and software packages that this Software was
+used.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+#include "feh.h"
+#include "filelist.h"
+#include "options.h"
+#include "readahead.h"
+#include "timers.h"
+
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
+
+/*
+ * Read-ahead stage for bulk passes (index, collage, thumbnails, preload).
+ * Image loaders read one file at a time, so the disk only ever sees one
+ * request. Here, --io-depth reader threads read the next files of the list
+ * in the background, keeping that many requests in flight. The data ends up
+ * in the page cache, where the loader finds it shortly afterwards.
+ *
+ * On spinning disks, reading in filelist order means seeking back and forth.
+ * --io-order sorts each batch by physical location (or inode number, which
+ * roughly follows it) before reading it.
+ */
+
+#define READAHEAD_BUFSIZE 262144
+
+static pthread_mutex_t ra_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ra_queued = PTHREAD_COND_INITIALIZER;
+
+/* filenames not yet read. Protected by ra_lock */
+static gib_list *ra_queue = NULL;
+static int ra_queue_len = 0;
+static int ra_shutdown = 0;
+
+/* the most recently queued filenames, so no file is queued twice */
+static char **ra_recent = NULL;
+static int ra_recent_size = 0;
+static int ra_recent_pos = 0;
+
+static pthread_t *readers = NULL;
+static int num_readers = 0;
+
+/* statistics, protected by ra_lock */
+static double ra_bytes = 0.0;
+static int ra_files = 0;
+static double ra_start = 0.0;
+static double ra_end = 0.0;
+
+static void *feh_readahead_reader(void *arg __attribute__ ((unused)))
+{
+	char *name, *buf;
+	double bytes;
+	ssize_t ret;
+	int fd;
+
+	buf = emalloc(READAHEAD_BUFSIZE);
+
+	pthread_mutex_lock(&ra_lock);
+	while (!ra_shutdown) {
+		if (!ra_queue) {
+			pthread_cond_wait(&ra_queued, &ra_lock);
+			continue;
+		}
+		name = ra_queue->data;
+		ra_queue = gib_list_remove(ra_queue, ra_queue);
+		ra_queue_len--;
+		pthread_mutex_unlock(&ra_lock);
+
+		bytes = 0.0;
+		if ((fd = open(name, O_RDONLY)) != -1) {
+#ifdef POSIX_FADV_SEQUENTIAL
+			posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+			while (((ret = read(fd, buf, READAHEAD_BUFSIZE)) > 0)
+					|| ((ret < 0) && (errno == EINTR)))
+				if (ret > 0)
+					bytes += ret;
+			close(fd);
+		}
+		free(name);
+
+		pthread_mutex_lock(&ra_lock);
+		ra_bytes += bytes;
+		ra_files++;
+		ra_end = feh_get_time();
+	}
+	pthread_mutex_unlock(&ra_lock);
+
+	free(buf);
+	return(NULL);
+}
+
+static int feh_readahead_start(void)
+{
+	int i;
+
+	if (readers)
+		return(num_readers);
+	if (opt.io_depth <= 0)
+		return(0);
+
+	ra_recent_size = 64 * opt.io_depth;
+	ra_recent = emalloc(ra_recent_size * sizeof(char *));
+	memset(ra_recent, 0, ra_recent_size * sizeof(char *));
+
+	readers = emalloc(opt.io_depth * sizeof(pthread_t));
+	for (i = 0; i < opt.io_depth; i++)
+		if (pthread_create(&readers[i], NULL, feh_readahead_reader, NULL))
+			break;
+	num_readers = i;
+	if (!num_readers)
+		weprintf("cannot start read-ahead threads:");
+	return(num_readers);
+}
+
+/* files read ahead per call, and the batch size for --io-order */
+static int feh_readahead_window(void)
+{
+	return((opt.io_order ? 32 : 4) * num_readers);
+}
+
+struct ra_entry {
+	char *name;
+	unsigned long long physical;	/* 0 if unknown */
+	unsigned long long inode;
+};
+
+/*
+ * Finds out where name is stored: the physical offset of its first extent if
+ * the file system reports it (FIEMAP), and its inode number. Nothing is read
+ * here: that is left to the readers, which get the batch in sorted order.
+ */
+static void feh_readahead_locate(struct ra_entry *e)
+{
+	struct stat st;
+	int fd;
+#ifdef FS_IOC_FIEMAP
+	struct {
+		struct fiemap map;
+		struct fiemap_extent extent;
+	} fm;
+#endif
+
+	e->physical = 0;
+	e->inode = 0;
+	if ((fd = open(e->name, O_RDONLY)) == -1)
+		return;
+	if (!fstat(fd, &st))
+		e->inode = st.st_ino;
+#ifdef FS_IOC_FIEMAP
+	memset(&fm, 0, sizeof(fm));
+	fm.map.fm_length = ~0ULL;
+	fm.map.fm_extent_count = 1;
+	if (!ioctl(fd, FS_IOC_FIEMAP, &fm) && fm.map.fm_mapped_extents)
+		e->physical = fm.extent.fe_physical;
+#endif
+	close(fd);
+	return;
+}
+
+static int feh_readahead_cmp_physical(const void *a, const void *b)
+{
+	const struct ra_entry *x = a, *y = b;
+
+	return((x->physical > y->physical) - (x->physical < y->physical));
+}
+
+static int feh_readahead_cmp_inode(const void *a, const void *b)
+{
+	const struct ra_entry *x = a, *y = b;
+
+	return((x->inode > y->inode) - (x->inode < y->inode));
+}
+
+/*
+ * Queues the local files after l in the filelist for reading. Files stay
+ * queued until a reader gets to them, each file is read at most once.
+ *
+ * With --io-order, files are queued in batches, sorted by their location on
+ * disk, once the readers are running out of work. The loaders still process
+ * them in filelist order.
+ */
+void feh_readahead_list(gib_list * l)
+{
+	struct ra_entry *batch;
+	char *name;
+	int i, j, n = 0, window, have_physical = 1;
+
+	if (!l || !feh_readahead_start())
+		return;
+
+	window = feh_readahead_window();
+
+	pthread_mutex_lock(&ra_lock);
+	if (opt.io_order && (ra_queue_len >= num_readers)) {
+		pthread_mutex_unlock(&ra_lock);
+		return;
+	}
+	pthread_mutex_unlock(&ra_lock);
+
+	batch = emalloc(window * sizeof(struct ra_entry));
+	for (i = 0, l = l->next; l && (i < window); i++, l = l->next) {
+		name = FEH_FILE(l->data)->filename;
+		if (!strncmp(name, "http://", 7) || !strncmp(name, "https://", 8)
+				|| !strncmp(name, "ftp://", 6))
+			continue;
+
+		for (j = 0; j < ra_recent_size; j++)
+			if (ra_recent[j] && !strcmp(ra_recent[j], name))
+				break;
+		if (j < ra_recent_size)
+			continue;
+
+		free(ra_recent[ra_recent_pos]);
+		ra_recent[ra_recent_pos] = estrdup(name);
+		ra_recent_pos = (ra_recent_pos + 1) % ra_recent_size;
+		batch[n++].name = estrdup(name);
+	}
+
+	if (opt.io_order && (n > 1)) {
+		for (i = 0; i < n; i++) {
+			feh_readahead_locate(&batch[i]);
+			if (!batch[i].physical)
+				have_physical = 0;
+		}
+		qsort(batch, n, sizeof(struct ra_entry), have_physical
+				? feh_readahead_cmp_physical : feh_readahead_cmp_inode);
+	}
+
+	pthread_mutex_lock(&ra_lock);
+	for (i = 0; i < n; i++) {
+		ra_queue = gib_list_add_end(ra_queue, batch[i].name);
+		ra_queue_len++;
+	}
+	if (n && (ra_start == 0.0))
+		ra_start = feh_get_time();
+	pthread_cond_broadcast(&ra_queued);
+	pthread_mutex_unlock(&ra_lock);
+
+	free(batch);
+	return;
+}
+
+/* In verbose mode, prints how much data the readers fetched, and how fast */
+void feh_readahead_report(void)
+{
+	double secs;
+
+	if (!opt.verbose || !readers)
+		return;
+
+	pthread_mutex_lock(&ra_lock);
+	secs = ra_end - ra_start;
+	if (ra_files && (secs > 0.0))
+		fprintf(stdout, PACKAGE " - read ahead %d files, %.1f MiB in %.2fs "
+				"(%.1f MiB/s, io depth %d)\n", ra_files,
+				ra_bytes / 1048576.0, secs, ra_bytes / 1048576.0 / secs,
+				num_readers);
+	pthread_mutex_unlock(&ra_lock);
+	return;
+}
+
+void feh_readahead_cleanup(void)
+{
+	int i;
+	gib_list *l;
+
+	if (!readers)
+		return;
+
+	pthread_mutex_lock(&ra_lock);
+	ra_shutdown = 1;
+	pthread_cond_broadcast(&ra_queued);
+	pthread_mutex_unlock(&ra_lock);
+
+	for (i = 0; i < num_readers; i++)
+		pthread_join(readers[i], NULL);
+	free(readers);
+	readers = NULL;
+	num_readers = 0;
+
+	for (l = ra_queue; l; l = l->next)
+		free(l->data);
+	gib_list_free(ra_queue);
+	ra_queue = NULL;
+	ra_queue_len = 0;
+	for (i = 0; i < ra_recent_size; i++)
+		free(ra_recent[i]);
+	free(ra_recent);
+	ra_recent = NULL;
+	return;
+}
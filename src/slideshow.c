@@ -29,6 +29,9 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include "timers.h"
 #include "winwidget.h"
 #include "options.h"
+#include "http.h"
+#include "mjpeg.h"
+#include "imgcache.h"
 #include "signals.h"
 
 void init_slideshow_mode(void)
@@ -63,6 +66,8 @@ void init_slideshow_mode(void)
 			free(s);
 			success = 1;
 			winwidget_show(w);
+			if (!opt.reload)
+				feh_http_prefetch_neighbours(filelist, l, 2);
 			if (opt.slideshow_delay > 0.0)
 				feh_add_timer(cb_slide_timer, w, opt.slideshow_delay, "SLIDE_CHANGE");
 			else if (opt.reload > 0)
@@ -87,11 +92,22 @@ void cb_slide_timer(void *data)
 	return;
 }
 
+void cb_slide_resume(void *data)
+{
+	winwidget w = (winwidget) data;
+
+	if (!w->im)
+		slideshow_change_image(w, SLIDE_CURRENT);
+	return;
+}
+
 void cb_reload_timer(void *data)
 {
 	winwidget w = (winwidget) data;
 
-	feh_reload_image(w, 0, 0);
+	/* streams update the window by themselves */
+	if (!w->file || !feh_mjpeg_active(FEH_FILE(w->file->data)->filename))
+		feh_reload_image(w, 0, 0);
 	feh_add_unique_timer(cb_reload_timer, w, opt.reload);
 	return;
 }
@@ -116,6 +132,18 @@ void feh_reload_image(winwidget w, int resize, int force_new)
 	title = estrdup(w->name);
 	winwidget_rename(w, new_title);
 
+	/* Nothing to decode or redraw if the server says it didn't change */
+	if (!force_new && !resize
+			&& feh_http_cache_usable(FEH_FILE(w->file->data)->filename)
+			&& (feh_http_cache_revalidate(FEH_FILE(w->file->data)->filename)
+				== HTTP_CACHE_NOT_MODIFIED)) {
+		D(("%s not modified\n", FEH_FILE(w->file->data)->filename));
+		winwidget_rename(w, title);
+		free(title);
+		free(new_title);
+		return;
+	}
+
 	/* force imlib2 not to cache */
 	if (force_new) {
 		winwidget_free_image(w);
@@ -178,6 +206,7 @@ void slideshow_change_image(winwidget winwid, int change)
 	gib_list *last = NULL;
 	int i = 0;
 	int jmp = 1;
+	int loaded, cancelled;
 	/* We can't use filelist_len in the for loop, since that changes when we
 	 * encounter invalid images.
 	 */
@@ -186,7 +215,7 @@ void slideshow_change_image(winwidget winwid, int change)
 
 	/* Without this, clicking a one-image slideshow reloads it. Not very *
 	   intelligent behaviour :-) */
-	if (filelist_len < 2 && opt.cycle_once == 0)
+	if (filelist_len < 2 && opt.cycle_once == 0 && change != SLIDE_CURRENT)
 		return;
 
 	/* Ok. I do this in such an odd way to ensure that if the last or first *
@@ -203,6 +232,9 @@ void slideshow_change_image(winwidget winwid, int change)
 
 	/* The for loop prevents us looping infinitely */
 	for (i = 0; i < our_filelist_len; i++) {
+		if (winwid->im && winwid->file && !FEH_FILE(winwid->file->data)->tiled
+				&& !FEH_FILE(winwid->file->data)->prescaled)
+			feh_imgcache_store(FEH_FILE(winwid->file->data)->filename, winwid->im);
 		winwidget_free_image(winwid);
 		switch (change) {
 		case SLIDE_NEXT:
@@ -243,6 +275,10 @@ void slideshow_change_image(winwidget winwid, int change)
 			   try the previous file, not another jmp */
 			change = SLIDE_NEXT;
 			break;
+		case SLIDE_CURRENT:
+			/* if current_file fails to load, move on to the next one */
+			change = SLIDE_NEXT;
+			break;
 		default:
 			eprintf("BUG!\n");
 			break;
@@ -257,8 +293,13 @@ void slideshow_change_image(winwidget winwid, int change)
 		winwidget_rename(winwid, s);
 		free(s);
 
-		if ((winwidget_loadimage(winwid, FEH_FILE(current_file->data)))
-		    != 0) {
+		feh_load_set_interruptible(1);
+		feh_load_set_progress_window(winwid);
+		loaded = winwidget_loadimage(winwid, FEH_FILE(current_file->data));
+		feh_load_set_progress_window(NULL);
+		cancelled = feh_load_set_interruptible(0);
+
+		if (loaded) {
 			success = 1;
 			winwid->mode = MODE_NORMAL;
 			winwid->file = current_file;
@@ -269,7 +310,18 @@ void slideshow_change_image(winwidget winwid, int change)
 			winwid->im_w = gib_imlib_image_get_width(winwid->im);
 			winwid->im_h = gib_imlib_image_get_height(winwid->im);
 			winwidget_render_image(winwid, 1, 1);
+			if (!opt.reload)
+				feh_http_prefetch_neighbours(filelist, current_file, 2);
 			break;
+		} else if (cancelled) {
+			/*
+			 * The input which cancelled the load is still queued and
+			 * will take us elsewhere. Should it not, this timer
+			 * makes sure the window doesn't stay empty. The file
+			 * itself was not broken, so it stays in the filelist.
+			 */
+			feh_add_timer(cb_slide_resume, winwid, 0.0, "SLIDE_RESUME");
+			return;
 		} else
 			last = current_file;
 	}
@@ -36,5 +36,6 @@ typedef _winwidget *winwidget;
 typedef struct __fehoptions fehoptions;
 typedef struct __fehkey fehkey;
 typedef struct __fehkb fehkb;
+typedef struct __feh_tiles feh_tiles;
 
 #endif
@@ -28,17 +28,104 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include "filelist.h"
 #include "winwidget.h"
 #include "options.h"
+#include "http.h"
+#include "decode.h"
+#include "readahead.h"
 #include "thumbnail.h"
+#include "thumbwrite.h"
 #include "md5.h"
 #include "feh_png.h"
+#include "exif.h"
+#include "imgcache.h"
+#include "timers.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 
 static char *create_index_dimension_string(int w, int h);
 static char *create_index_size_string(char *file);
 static char *create_index_title_string(int num, int w, int h);
+static int feh_thumbnail_load(Imlib_Image * image, feh_file * file, int w,
+		int h, int *orig_w, int *orig_h);
+static void feh_thumbnail_prefetch(gib_list * l);
+static int feh_thumbnail_cache_setup(void);
+static int feh_thumbnail_failed(char *filename, char *fail_file);
+static Imlib_Image feh_thumbnail_cache_image(Imlib_Image im_temp,
+		feh_file * file, char *thumb_file, char *uri, int orig_w, int orig_h);
+static int feh_thumbnail_get_from_larger(Imlib_Image * image,
+		feh_file * file, char *uri, char *thumb_file, int *orig_w,
+		int *orig_h);
+static void feh_thumbnail_record_failure(char *filename, char *uri,
+		char *fail_file);
+static Imlib_Image feh_thumbnail_scale(Imlib_Image im_temp, int *w, int *h);
+static void feh_thumbnail_scroll_geometry(void);
+static void feh_thumbnail_scroll_start(winwidget winwid);
+static void feh_thumbnail_scroll_render(winwidget winwid);
+static void cb_thumbnail_scroll_poll(void *data);
+static void feh_thumbnail_add(feh_thumbnail * thumb);
+static void feh_thumbnail_clear(void);
 static gib_list *thumbnails = NULL;
 
+/*
+ * Hash tables over the thumbnails list, so that clicks and
+ * feh_thumbnail_mark_removed do not have to walk all of it. by_cell has the
+ * thumbnails overlapping each cell of a grid of thumbnail slots (cell_w x
+ * cell_h pixels, so a thumbnail is in at most four of them), by_file the
+ * thumbnails of each file. Both have num_buckets entries, a power of two
+ * at least twice the number of thumbnails.
+ */
+static struct {
+	gib_list **by_cell;
+	gib_list **by_file;
+	int num_buckets;
+	int num_thumbs;
+	int cell_w, cell_h;
+} thumb_index;
+
 static thumbmode_data td;
 
+/*
+ * Thumbnail cache sizes and their directories in ~/.thumbnails. The
+ * freedesktop specification only has normal and large, its newer versions
+ * add x-large and xx-large.
+ */
+static struct {
+	int dim;
+	char *dir;
+} cache_tiers[] = {
+	{ 128, "normal" },
+	{ 256, "large" },
+	{ 512, "x-large" },
+	{ 1024, "xx-large" },
+	{ 0, NULL }
+};
+
+/*
+ * --thumb-scroll: the files of the grid, indexed by cell number (NULL once
+ * removed), and the scaled thumbnails of the cells near the viewport.
+ * scroll_slots finds the cell of a file: it is an open addressing hash table
+ * over the files (hashed like thumb_index.by_file) holding cell number + 1,
+ * or 0 for unused slots. Visible cells whose file is still being decoded in
+ * the background are left empty until cb_thumbnail_scroll_poll finds it done.
+ */
+struct thumb_cell {
+	int index;
+	Imlib_Image im;          /* NULL if the file could not be loaded */
+	int w, h;
+	int orig_w, orig_h;
+};
+
+#define FEH_THUMB_SCROLL_POLL 0.05
+
+static feh_file **scroll_files = NULL;
+static int scroll_count = 0;
+static int *scroll_slots = NULL;
+static unsigned int scroll_num_slots = 0;
+static gib_list *scroll_cells = NULL;
+static int scroll_vis_first = 0, scroll_vis_end = 0;
+
 /* TODO Break this up a bit ;) */
 /* TODO s/bit/lot */
 void init_thumbnail_mode(void)
@@ -92,6 +179,9 @@ void init_thumbnail_mode(void)
 	td.vertical = 0;
 	td.max_column_w = 0;
 
+	td.scroll = opt.thumb_scroll && opt.display && !opt.output;
+	td.scroll_y = 0;
+
 	mode = "thumbnail";
 
 	if (opt.font)
@@ -138,7 +228,10 @@ void init_thumbnail_mode(void)
 	}
 
 	/* figure out geometry for the main window and entries */
-	feh_thumbnail_calculate_geometry();
+	if (td.scroll)
+		feh_thumbnail_scroll_geometry();
+	else
+		feh_thumbnail_calculate_geometry();
 
 	index_image_width = td.w;
 	index_image_height = td.h + title_area_h;
@@ -175,27 +268,19 @@ void init_thumbnail_mode(void)
 		winwidget_show(winwid);
 	}
 
-	/* make sure we have an ~/.thumbnails/normal directory for storing
-	   permanent thumbnails */
 	td.cache_thumbnails = opt.cache_thumbnails;
-
-	if (td.cache_thumbnails) {
-		if (opt.thumb_w > opt.thumb_h)
-			td.cache_dim = opt.thumb_w;
-		else
-			td.cache_dim = opt.thumb_h;
-
-		if (td.cache_dim > 256) {
-			/* No caching as specified by standard. Sort of. */
-			td.cache_thumbnails = 0;
-		} else if (td.cache_dim > 128) {
-			td.cache_dim = 256;
-			td.cache_dir = estrdup("large");
-		} else {
-			td.cache_dim = 128;
-			td.cache_dir = estrdup("normal");
-		}
-		feh_thumbnail_setup_thumbnail_dir();
+	if (td.cache_thumbnails)
+		feh_thumbnail_cache_setup();
+
+	td.pack = opt.thumb_pack;
+	td.pack_dim = (opt.thumb_w > opt.thumb_h) ? opt.thumb_w : opt.thumb_h;
+
+	if (td.scroll) {
+		td.title_area_h = title_area_h;
+		td.trans_bg = trans_bg;
+		feh_thumbnail_scroll_start(winwid);
+		free(s);
+		return;
 	}
 
 	for (l = filelist; l; l = l->next) {
@@ -204,6 +289,7 @@ void init_thumbnail_mode(void)
 			filelist = feh_file_remove_from_list(filelist, last);
 			last = NULL;
 		}
+		feh_thumbnail_prefetch(l);
 		D(("About to load image %s\n", file->filename));
 		/*      if (feh_load_image(&im_temp, file) != 0) */
 		if (feh_thumbnail_get_thumbnail(&im_temp, file, &orig_w, &orig_h)
@@ -211,8 +297,6 @@ void init_thumbnail_mode(void)
 			if (opt.verbose)
 				feh_display_status('.');
 			D(("Successfully loaded %s\n", file->filename));
-			www = opt.thumb_w;
-			hhh = opt.thumb_h;
 			ww = gib_imlib_image_get_width(im_temp);
 			hh = gib_imlib_image_get_height(im_temp);
 
@@ -222,42 +306,7 @@ void init_thumbnail_mode(void)
 			}
 
 			thumbnailcount++;
-			if (gib_imlib_image_has_alpha(im_temp))
-				imlib_context_set_blend(1);
-			else
-				imlib_context_set_blend(0);
-
-			if (opt.aspect) {
-				double ratio = 0.0;
-
-				/* Keep the aspect ratio for the thumbnail */
-				ratio = ((double) ww / hh) / ((double) www / hhh);
-
-				if (ratio > 1.0)
-					hhh = opt.thumb_h / ratio;
-				else if (ratio != 1.0)
-					www = opt.thumb_w * ratio;
-			}
-
-			if ((!opt.stretch) && ((www > ww) || (hhh > hh))) {
-				/* Don't make the image larger unless stretch is specified */
-				www = ww;
-				hhh = hh;
-			}
-
-			im_thumb = gib_imlib_create_cropped_scaled_image(im_temp, 0, 0,
-					ww, hh, www, hhh, 1);
-			gib_imlib_free_image_and_decache(im_temp);
-
-			if (opt.alpha) {
-				DATA8 atab[256];
-
-				D(("Applying alpha options\n"));
-				gib_imlib_image_set_has_alpha(im_thumb, 1);
-				memset(atab, opt.alpha_level, sizeof(atab));
-				gib_imlib_apply_color_modifier_to_rectangle
-				    (im_thumb, 0, 0, www, hhh, NULL, NULL, NULL, atab);
-			}
+			im_thumb = feh_thumbnail_scale(im_temp, &www, &hhh);
 
 			td.text_area_w = opt.thumb_w;
 			/* Now draw on the info text */
@@ -324,8 +373,7 @@ void init_thumbnail_mode(void)
 							 yyy, www, hhh, 1,
 							 gib_imlib_image_has_alpha(im_thumb), 0);
 
-			thumbnails = gib_list_add_front(thumbnails,
-					feh_thumbnail_new(file, xxx, yyy, www, hhh));
+			feh_thumbnail_add(feh_thumbnail_new(file, xxx, yyy, www, hhh));
 
 			gib_imlib_free_image_and_decache(im_thumb);
 
@@ -375,8 +423,10 @@ void init_thumbnail_mode(void)
 	if (thumb_counter != 0)
 		winwidget_render_image(winwid, 0, 0);
 
-	if (opt.verbose)
+	if (opt.verbose) {
 		fprintf(stdout, "\n");
+		feh_readahead_report();
+	}
 
 	if (opt.title_font) {
 		int fw, fh, fx, fy;
@@ -467,20 +517,108 @@ feh_thumbnail *feh_thumbnail_new(feh_file * file, int x, int y, int w, int h)
 	return(thumb);
 }
 
-feh_file *feh_thumbnail_get_file_from_coords(int x, int y)
+static unsigned int feh_thumbnail_hash_cell(int cx, int cy)
 {
-	gib_list *l;
-	feh_thumbnail *thumb;
+	return(((unsigned int) cx * 73856093u) ^ ((unsigned int) cy * 19349663u));
+}
 
-	for (l = thumbnails; l; l = l->next) {
-		thumb = FEH_THUMB(l->data);
-		if (XY_IN_RECT(x, y, thumb->x, thumb->y, thumb->w, thumb->h)) {
-			if (thumb->exists) {
-				return(thumb->file);
-			}
+static unsigned int feh_thumbnail_hash_file(feh_file * file)
+{
+	return((unsigned int) ((uintptr_t) file >> 4) * 2654435761u);
+}
+
+/* Grid cell containing pixel position v, also for negative ones */
+static int feh_thumbnail_cell_of(int v, int size)
+{
+	return((v >= 0) ? (v / size) : -((size - 1 - v) / size));
+}
+
+static void feh_thumbnail_index_insert(feh_thumbnail * thumb)
+{
+	unsigned int mask = thumb_index.num_buckets - 1, b;
+	int cx, cy, cx_end, cy_end;
+
+	b = feh_thumbnail_hash_file(thumb->file) & mask;
+	thumb_index.by_file[b] = gib_list_add_front(thumb_index.by_file[b], thumb);
+
+	cx_end = feh_thumbnail_cell_of(thumb->x + thumb->w - 1, thumb_index.cell_w);
+	cy_end = feh_thumbnail_cell_of(thumb->y + thumb->h - 1, thumb_index.cell_h);
+	for (cy = feh_thumbnail_cell_of(thumb->y, thumb_index.cell_h);
+			cy <= cy_end; cy++)
+		for (cx = feh_thumbnail_cell_of(thumb->x, thumb_index.cell_w);
+				cx <= cx_end; cx++) {
+			b = feh_thumbnail_hash_cell(cx, cy) & mask;
+			thumb_index.by_cell[b] = gib_list_add_front(
+					thumb_index.by_cell[b], thumb);
 		}
+	return;
+}
+
+static void feh_thumbnail_index_free(void)
+{
+	int i;
+
+	for (i = 0; i < thumb_index.num_buckets; i++) {
+		gib_list_free(thumb_index.by_cell[i]);
+		gib_list_free(thumb_index.by_file[i]);
 	}
-	D(("No matching %d %d\n", x, y));
+	free(thumb_index.by_cell);
+	free(thumb_index.by_file);
+	thumb_index.by_cell = thumb_index.by_file = NULL;
+	thumb_index.num_buckets = 0;
+	return;
+}
+
+/* Adds thumb to the thumbnails list and its hash tables */
+static void feh_thumbnail_add(feh_thumbnail * thumb)
+{
+	gib_list *l;
+
+	thumbnails = gib_list_add_front(thumbnails, thumb);
+
+	if (!thumb_index.cell_w) {
+		thumb_index.cell_w = (opt.thumb_w > 0) ? opt.thumb_w : 1;
+		thumb_index.cell_h = (td.thumb_tot_h > 0) ? td.thumb_tot_h : 1;
+	}
+
+	if (++thumb_index.num_thumbs * 2 > thumb_index.num_buckets) {
+		int num_buckets = thumb_index.num_buckets
+			? 2 * thumb_index.num_buckets : 256;
+
+		feh_thumbnail_index_free();
+		thumb_index.num_buckets = num_buckets;
+		thumb_index.by_cell = emalloc(num_buckets * sizeof(gib_list *));
+		thumb_index.by_file = emalloc(num_buckets * sizeof(gib_list *));
+		memset(thumb_index.by_cell, 0, num_buckets * sizeof(gib_list *));
+		memset(thumb_index.by_file, 0, num_buckets * sizeof(gib_list *));
+		for (l = thumbnails; l; l = l->next)
+			feh_thumbnail_index_insert(FEH_THUMB(l->data));
+	} else
+		feh_thumbnail_index_insert(thumb);
+	return;
+}
+
+/* Frees all thumbnails */
+static void feh_thumbnail_clear(void)
+{
+	gib_list *l;
+
+	for (l = thumbnails; l; l = l->next)
+		free(l->data);
+	gib_list_free(thumbnails);
+	thumbnails = NULL;
+
+	feh_thumbnail_index_free();
+	thumb_index.num_thumbs = 0;
+	return;
+}
+
+feh_file *feh_thumbnail_get_file_from_coords(int x, int y)
+{
+	feh_thumbnail *thumb;
+
+	if ((thumb = feh_thumbnail_get_thumbnail_from_coords(x, y)))
+		return(thumb->file);
 	return(NULL);
 }
 
@@ -488,8 +626,15 @@ feh_thumbnail *feh_thumbnail_get_thumbnail_from_coords(int x, int y)
 {
 	gib_list *l;
 	feh_thumbnail *thumb;
+	unsigned int b;
+
+	if (!thumb_index.num_buckets)
+		return(NULL);
 
-	for (l = thumbnails; l; l = l->next) {
+	b = feh_thumbnail_hash_cell(feh_thumbnail_cell_of(x, thumb_index.cell_w),
+			feh_thumbnail_cell_of(y, thumb_index.cell_h))
+		& (thumb_index.num_buckets - 1);
+	for (l = thumb_index.by_cell[b]; l; l = l->next) {
 		thumb = FEH_THUMB(l->data);
 		if (XY_IN_RECT(x, y, thumb->x, thumb->y, thumb->w, thumb->h)) {
 			if (thumb->exists) {
@@ -506,7 +651,12 @@ feh_thumbnail *feh_thumbnail_get_from_file(feh_file * file)
 	gib_list *l;
 	feh_thumbnail *thumb;
 
-	for (l = thumbnails; l; l = l->next) {
+	if (!thumb_index.num_buckets)
+		return(NULL);
+
+	l = thumb_index.by_file[feh_thumbnail_hash_file(file)
+		& (thumb_index.num_buckets - 1)];
+	for (; l; l = l->next) {
 		thumb = FEH_THUMB(l->data);
 		if (thumb->file == file) {
 			if (thumb->exists) {
@@ -549,6 +699,15 @@ void feh_thumbnail_mark_removed(feh_file * file, int deleted)
 		}
 		thumb->exists = 0;
 	}
+
+	if (td.scroll && scroll_num_slots) {
+		unsigned int mask = scroll_num_slots - 1, b;
+
+		for (b = feh_thumbnail_hash_file(file) & mask; scroll_slots[b];
+				b = (b + 1) & mask)
+			if (scroll_files[scroll_slots[b] - 1] == file)
+				scroll_files[scroll_slots[b] - 1] = NULL;
+	}
 	return;
 }
 
@@ -726,11 +885,514 @@ void feh_thumbnail_calculate_geometry(void)
 	}
 }
 
+/*
+ * Starts loading the files after l in the background.
+ */
+static void feh_thumbnail_prefetch(gib_list * l)
+{
+	feh_http_prefetch_list(l);
+
+	/* a warm thumbnail pack does not need the background loaders */
+	if (td.pack && l->next && feh_imgcache_pack_has(
+				FEH_FILE(l->next->data)->filename, td.pack_dim))
+		return;
+
+	if (td.cache_thumbnails) {
+		/* workers read cached thumbnails, or generate missing ones */
+		feh_decode_prefetch_list(l, td.cache_dim, td.cache_dim,
+				feh_thumbnail_cache_name);
+	} else {
+		feh_decode_prefetch_list(l, opt.thumb_w, opt.thumb_h, NULL);
+		feh_readahead_list(l);
+	}
+	return;
+}
+
+/*
+ * Scales a loaded image down to fit into thumb_w x thumb_h as requested by
+ * --ignore-aspect and --stretch and applies --alpha.  Frees im_temp.
+ */
+static Imlib_Image feh_thumbnail_scale(Imlib_Image im_temp, int *w, int *h)
+{
+	Imlib_Image im_thumb;
+	int ww, hh, www = opt.thumb_w, hhh = opt.thumb_h;
+
+	ww = gib_imlib_image_get_width(im_temp);
+	hh = gib_imlib_image_get_height(im_temp);
+
+	if (gib_imlib_image_has_alpha(im_temp))
+		imlib_context_set_blend(1);
+	else
+		imlib_context_set_blend(0);
+
+	if (opt.aspect) {
+		double ratio = 0.0;
+
+		/* Keep the aspect ratio for the thumbnail */
+		ratio = ((double) ww / hh) / ((double) www / hhh);
+
+		if (ratio > 1.0)
+			hhh = opt.thumb_h / ratio;
+		else if (ratio != 1.0)
+			www = opt.thumb_w * ratio;
+	}
+
+	if ((!opt.stretch) && ((www > ww) || (hhh > hh))) {
+		/* Don't make the image larger unless stretch is specified */
+		www = ww;
+		hhh = hh;
+	}
+
+	im_thumb = gib_imlib_create_cropped_scaled_image(im_temp, 0, 0,
+			ww, hh, www, hhh, 1);
+	gib_imlib_free_image_and_decache(im_temp);
+
+	if (opt.alpha) {
+		DATA8 atab[256];
+
+		D(("Applying alpha options\n"));
+		gib_imlib_image_set_has_alpha(im_thumb, 1);
+		memset(atab, opt.alpha_level, sizeof(atab));
+		gib_imlib_apply_color_modifier_to_rectangle
+		    (im_thumb, 0, 0, www, hhh, NULL, NULL, NULL, atab);
+	}
+
+	*w = www;
+	*h = hhh;
+	return(im_thumb);
+}
+
+/*
+ * --thumb-scroll: the window only shows a viewport of limit_w x limit_h
+ * pixels onto a grid of uniform cells, so nothing needs to be known about
+ * the files before the first rows are drawn.
+ */
+static void feh_thumbnail_scroll_geometry(void)
+{
+	if (opt.limit_w)
+		td.w = opt.limit_w;
+	else if (td.im_bg)
+		td.w = td.bg_w;
+	else
+		td.w = 640;
+
+	if (opt.limit_h)
+		td.h = opt.limit_h;
+	else if (td.im_bg)
+		td.h = td.bg_h;
+	else
+		td.h = 480;
+
+	td.cell_w = opt.thumb_w;
+	if (opt.index_show_name || opt.index_show_dim || opt.index_show_size)
+		td.cell_w += 5;
+
+	td.cols = td.w / td.cell_w;
+	if (td.cols < 1)
+		td.cols = 1;
+	return;
+}
+
+static void feh_thumbnail_scroll_start(winwidget winwid)
+{
+	gib_list *l;
+	unsigned int mask, b;
+	int i;
+
+	scroll_count = gib_list_length(filelist);
+	scroll_files = emalloc(sizeof(feh_file *) * (scroll_count + 1));
+	for (i = 0, l = filelist; l; l = l->next, i++)
+		scroll_files[i] = FEH_FILE(l->data);
+
+	for (scroll_num_slots = 256; scroll_num_slots < 2 * (unsigned int) scroll_count;)
+		scroll_num_slots *= 2;
+	scroll_slots = emalloc(scroll_num_slots * sizeof(int));
+	memset(scroll_slots, 0, scroll_num_slots * sizeof(int));
+	mask = scroll_num_slots - 1;
+	for (i = 0; i < scroll_count; i++) {
+		for (b = feh_thumbnail_hash_file(scroll_files[i]) & mask;
+				scroll_slots[b]; b = (b + 1) & mask);
+		scroll_slots[b] = i + 1;
+	}
+
+	if (winwid)
+		feh_thumbnail_scroll_render(winwid);
+	return;
+}
+
+/* Queues the files near the viewport for the background loaders */
+static void feh_thumbnail_scroll_queue(gib_list * window)
+{
+	feh_http_prefetch_list(window);
+
+	/* a warm thumbnail pack does not need the background loaders */
+	if (td.pack && feh_imgcache_pack_has(FEH_FILE(window->data)->filename,
+				td.pack_dim))
+		return;
+
+	if (td.cache_thumbnails)
+		feh_decode_queue_list(window, gib_list_length(window), td.cache_dim,
+				td.cache_dim, feh_thumbnail_cache_name);
+	else {
+		feh_decode_queue_list(window, gib_list_length(window), opt.thumb_w,
+				opt.thumb_h, NULL);
+		feh_readahead_list(window);
+	}
+	return;
+}
+
+/* Returns 1 if loading file's thumbnail won't wait for a background loader */
+static int feh_thumbnail_scroll_ready(feh_file * file)
+{
+	if (td.cache_thumbnails)
+		return(feh_decode_ready(file->filename, td.cache_dim, td.cache_dim));
+	return(feh_decode_ready(file->filename, opt.thumb_w, opt.thumb_h));
+}
+
+static struct thumb_cell *feh_thumbnail_scroll_find(int index)
+{
+	gib_list *l;
+
+	for (l = scroll_cells; l; l = l->next)
+		if (((struct thumb_cell *) l->data)->index == index)
+			return(l->data);
+	return(NULL);
+}
+
+/*
+ * Returns the scaled thumbnail of cell index, loading it if it is not
+ * cached yet.  Returns NULL while the file is still being decoded in the
+ * background.
+ */
+static struct thumb_cell *feh_thumbnail_scroll_cell(int index)
+{
+	struct thumb_cell *cell;
+	Imlib_Image im_temp;
+
+	if ((cell = feh_thumbnail_scroll_find(index)))
+		return(cell);
+	if (!feh_thumbnail_scroll_ready(scroll_files[index]))
+		return(NULL);
+
+	cell = emalloc(sizeof(struct thumb_cell));
+	cell->index = index;
+	cell->im = NULL;
+	cell->w = cell->h = 0;
+
+	if (feh_thumbnail_get_thumbnail(&im_temp, scroll_files[index],
+				&cell->orig_w, &cell->orig_h) != 0) {
+		if (!cell->orig_w) {
+			cell->orig_w = gib_imlib_image_get_width(im_temp);
+			cell->orig_h = gib_imlib_image_get_height(im_temp);
+		}
+		cell->im = feh_thumbnail_scale(im_temp, &cell->w, &cell->h);
+	} else if (opt.verbose)
+		feh_display_status('x');
+
+	scroll_cells = gib_list_add_front(scroll_cells, cell);
+	return(cell);
+}
+
+/* Draws text centered below a cell, cut off to the cell width */
+static void feh_thumbnail_scroll_text(int x, int y, char *text)
+{
+	char *s = estrdup(text);
+	int len = strlen(s), fw, fh;
+
+	gib_imlib_get_text_size(td.font_main, s, NULL, &fw, &fh,
+			IMLIB_TEXT_TO_RIGHT);
+	while ((fw > td.cell_w) && (len > 1)) {
+		s[--len] = '\0';
+		gib_imlib_get_text_size(td.font_main, s, NULL, &fw, &fh,
+				IMLIB_TEXT_TO_RIGHT);
+	}
+	gib_imlib_text_draw(td.im_main, td.font_main, NULL,
+			x + (td.cell_w - fw) / 2, y, s, IMLIB_TEXT_TO_RIGHT,
+			255, 255, 255, 255);
+	free(s);
+	return;
+}
+
+/*
+ * Redraws the viewport.  Only the rows in view are composited; the
+ * thumbnails of up to one screenful of rows above and below are kept and
+ * queued for the background loaders, everything further away is dropped.
+ */
+static void feh_thumbnail_scroll_render(winwidget winwid)
+{
+	gib_list *l, *next, *window = NULL;
+	struct thumb_cell *cell;
+	feh_file *file;
+	int rows, vis_rows, first, last, keep_first, keep_last, max_y;
+	int i, x, y, xxx, yyy, lines, tw, th, pending = 0;
+
+	rows = (scroll_count + td.cols - 1) / td.cols;
+	vis_rows = (td.h + td.thumb_tot_h - 1) / td.thumb_tot_h;
+
+	max_y = rows * td.thumb_tot_h - td.h;
+	if (td.scroll_y > max_y)
+		td.scroll_y = max_y;
+	if (td.scroll_y < 0)
+		td.scroll_y = 0;
+
+	first = td.scroll_y / td.thumb_tot_h;
+	last = (td.scroll_y + td.h - 1) / td.thumb_tot_h;
+	keep_first = (first > vis_rows) ? first - vis_rows : 0;
+	keep_last = last + vis_rows;
+
+	for (l = scroll_cells; l; l = next) {
+		next = l->next;
+		cell = l->data;
+		if ((cell->index / td.cols >= keep_first)
+				&& (cell->index / td.cols <= keep_last))
+			continue;
+		if (cell->im)
+			gib_imlib_free_image_and_decache(cell->im);
+		free(cell);
+		scroll_cells = gib_list_remove(scroll_cells, l);
+	}
+
+	/* visible files first, then the rows below and above the viewport */
+	for (i = first * td.cols; (i < (keep_last + 1) * td.cols)
+			&& (i < scroll_count); i++)
+		if (scroll_files[i])
+			window = gib_list_add_end(window, scroll_files[i]);
+	for (i = keep_first * td.cols; i < first * td.cols; i++)
+		if (scroll_files[i])
+			window = gib_list_add_end(window, scroll_files[i]);
+	if (window)
+		feh_thumbnail_scroll_queue(window);
+	gib_list_free(window);
+
+	feh_thumbnail_clear();
+
+	if (td.im_bg)
+		gib_imlib_blend_image_onto_image(td.im_main, td.im_bg,
+						 gib_imlib_image_has_alpha
+						 (td.im_bg), 0, 0, td.bg_w, td.bg_h, 0, 0,
+						 td.w, td.h, 1, 0, 0);
+	else
+		gib_imlib_image_fill_rectangle(td.im_main, 0, 0, td.w, td.h,
+				0, 0, 0, td.trans_bg ? 0 : 255);
+
+	gib_imlib_get_text_size(td.font_main, "W", NULL, &tw, &th,
+			IMLIB_TEXT_TO_RIGHT);
+
+	scroll_vis_first = first * td.cols;
+	scroll_vis_end = (last + 1) * td.cols;
+	if (scroll_vis_end > scroll_count)
+		scroll_vis_end = scroll_count;
+
+	for (i = scroll_vis_first; i < scroll_vis_end; i++) {
+		if (!(file = scroll_files[i]))
+			continue;
+		if (!(cell = feh_thumbnail_scroll_cell(i))) {
+			pending = 1;
+			continue;
+		}
+		if (!cell->im)
+			continue;
+
+		x = (i % td.cols) * td.cell_w;
+		y = (i / td.cols) * td.thumb_tot_h - td.scroll_y;
+
+		/* center image relative to the text below it (if any) */
+		xxx = x + ((td.cell_w - cell->w) / 2);
+		yyy = y;
+		if (opt.aspect)
+			yyy += (opt.thumb_h - cell->h) / 2;
+
+		gib_imlib_blend_image_onto_image(td.im_main, cell->im,
+						 gib_imlib_image_has_alpha
+						 (cell->im), 0, 0,
+						 cell->w, cell->h, xxx,
+						 yyy, cell->w, cell->h, 1,
+						 gib_imlib_image_has_alpha(cell->im), 0);
+
+		feh_thumbnail_add(feh_thumbnail_new(file, xxx, yyy, cell->w,
+					cell->h));
+
+		lines = 0;
+		if (opt.index_show_name)
+			feh_thumbnail_scroll_text(x,
+					y + opt.thumb_h + (lines++ * (th + 2)) + 2,
+					file->name);
+		if (opt.index_show_dim)
+			feh_thumbnail_scroll_text(x,
+					y + opt.thumb_h + (lines++ * (th + 2)) + 2,
+					create_index_dimension_string(cell->orig_w,
+						cell->orig_h));
+		if (opt.index_show_size)
+			feh_thumbnail_scroll_text(x,
+					y + opt.thumb_h + (lines++ * (th + 2)) + 2,
+					create_index_size_string(file->filename));
+	}
+
+	if (td.title_area_h) {
+		int fw, fh;
+		char *s;
+
+		/* the last row may reach into the title area */
+		gib_imlib_image_fill_rectangle(td.im_main, 0, td.h, td.w,
+				td.title_area_h, 0, 0, 0, td.trans_bg ? 0 : 255);
+		s = create_index_title_string(scroll_count, td.w, td.h);
+		gib_imlib_get_text_size(td.font_title, s, NULL, &fw, &fh,
+				IMLIB_TEXT_TO_RIGHT);
+		gib_imlib_text_draw(td.im_main, td.font_title, NULL,
+				(td.w - fw) >> 1, td.h + td.title_area_h - fh - 2,
+				s, IMLIB_TEXT_TO_RIGHT, 255, 255, 255, 255);
+	}
+
+	winwidget_render_image(winwid, 0, 0);
+
+	if (pending)
+		feh_add_timer(cb_thumbnail_scroll_poll, NULL,
+				FEH_THUMB_SCROLL_POLL, "THUMB_SCROLL");
+	return;
+}
+
+/* Redraws the viewport once a visible cell's file has been decoded */
+static void cb_thumbnail_scroll_poll(void *data __attribute__ ((unused)))
+{
+	winwidget w;
+	int i;
+
+	if (!(w = winwidget_get_first_window_of_type(WIN_TYPE_THUMBNAIL)))
+		return;
+
+	for (i = scroll_vis_first; i < scroll_vis_end; i++)
+		if (scroll_files[i] && !feh_thumbnail_scroll_find(i)
+				&& feh_thumbnail_scroll_ready(scroll_files[i])) {
+			feh_thumbnail_scroll_render(w);
+			return;
+		}
+	feh_add_timer(cb_thumbnail_scroll_poll, NULL, FEH_THUMB_SCROLL_POLL,
+			"THUMB_SCROLL");
+	return;
+}
+
+/*
+ * Scrolls the --thumb-scroll viewport by rows grid rows, or by rows
+ * screenfuls if page is set.
+ */
+void feh_thumbnail_scroll(winwidget winwid, int rows, int page)
+{
+	int step = td.thumb_tot_h;
+
+	if (!td.scroll)
+		return;
+
+	if (page && (td.h > td.thumb_tot_h))
+		step = (td.h / td.thumb_tot_h) * td.thumb_tot_h;
+
+	td.scroll_y += rows * step;
+	feh_thumbnail_scroll_render(winwid);
+	return;
+}
+
+/*
+ * Imlib2 can only load from a path, so EXIF previews are written to a file
+ * first. It lives in a directory of our own, so nobody can plant a symlink
+ * there, which is created once per process and removed by
+ * feh_thumbnail_cleanup.
+ */
+static char *exif_dir = NULL;
+static char *exif_file = NULL;
+static pid_t exif_pid = 0;
+
+static char *feh_thumbnail_exif_file(void)
+{
+	char tmpdir[32];
+
+	/* a forked worker must not share the file with its parent */
+	if (exif_file && (exif_pid == getpid()))
+		return(exif_file);
+
+	strcpy(tmpdir, "/tmp/feh_exif_XXXXXX");
+	if (!mkdtemp(tmpdir))
+		return(NULL);
+	exif_dir = estrdup(tmpdir);
+	exif_file = estrjoin("/", tmpdir, "thumb.jpg", NULL);
+	exif_pid = getpid();
+	return(exif_file);
+}
+
+void feh_thumbnail_cleanup(void)
+{
+	if (!exif_file || (exif_pid != getpid()))
+		return;
+	unlink(exif_file);
+	rmdir(exif_dir);
+	free(exif_file);
+	free(exif_dir);
+	exif_file = exif_dir = NULL;
+	return;
+}
+
+/*
+ * Loads the preview from the EXIF data of a JPEG file, provided it is large
+ * enough for a w x h thumbnail and shows the whole image (no black bars).
+ */
+static int feh_thumbnail_load_exif(Imlib_Image * image, feh_file * file,
+		int w, int h, int *orig_w, int *orig_h)
+{
+	unsigned char *data;
+	char *tmpname;
+	int len, img_w, img_h, thumb_w, thumb_h, fd, ok = 0;
+
+	if (!(data = feh_exif_thumbnail(file->filename, &len, &img_w, &img_h,
+					&thumb_w, &thumb_h)))
+		return(0);
+
+	/* size of the thumbnail that will actually be drawn */
+	if (opt.aspect) {
+		double ratio = ((double) img_w / img_h) / ((double) w / h);
+
+		if (ratio > 1.0)
+			h = h / ratio;
+		else if (ratio != 1.0)
+			w = w * ratio;
+	}
+
+	if ((thumb_w < w) || (thumb_h < h)
+			|| (fabs((double) thumb_w / thumb_h - (double) img_w / img_h)
+				> 0.02)) {
+		free(data);
+		return(0);
+	}
+
+	if ((tmpname = feh_thumbnail_exif_file())
+			&& ((fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0600)) != -1)) {
+		ok = (write(fd, data, len) == len);
+		ok = !close(fd) && ok;
+		if (ok)
+			*image = imlib_load_image_without_cache(tmpname);
+	}
+	free(data);
+
+	if (!ok || !*image)
+		return(0);
+
+	D(("using %dx%d EXIF preview of %s\n", thumb_w, thumb_h, file->filename));
+	*orig_w = img_w;
+	*orig_h = img_h;
+	return(1);
+}
+
+/* Loads file for a w x h thumbnail, as cheaply as possible */
+static int feh_thumbnail_load(Imlib_Image * image, feh_file * file, int w,
+		int h, int *orig_w, int *orig_h)
+{
+	if (feh_thumbnail_load_exif(image, file, w, h, orig_w, orig_h))
+		return(1);
+	return(feh_load_image_scaled(image, file, w, h, orig_w, orig_h));
+}
+
 int feh_thumbnail_get_thumbnail(Imlib_Image * image, feh_file * file,
 	int * orig_w, int * orig_h)
 {
 	int status = 0;
-	char *thumb_file = NULL, *uri = NULL;
+	char *thumb_file = NULL, *uri = NULL, *fail_file = NULL;
 
 	*orig_w = 0;
 	*orig_h = 0;
@@ -738,25 +1400,96 @@ int feh_thumbnail_get_thumbnail(Imlib_Image * image, feh_file * file,
 	if (!file || !file->filename)
 		return (0);
 
-	if (td.cache_thumbnails) {
-		uri = feh_thumbnail_get_name_uri(file->filename);
-		thumb_file = feh_thumbnail_get_name(uri);
-		status = feh_thumbnail_get_generated(image, file, thumb_file,
-			orig_w, orig_h);
+	if (td.pack && (*image = feh_imgcache_pack_load(file->filename,
+					td.pack_dim, orig_w, orig_h)))
+		return (1);
 
-		if (!status)
-			status = feh_thumbnail_generate(image, file, thumb_file, uri,
+	if (td.cache_thumbnails) {
+		switch (feh_decode_claim_cached(file->filename, td.cache_dim,
+					td.cache_dim, image, orig_w, orig_h)) {
+		case 1:
+			D(("cached thumbnail of %s loaded in the background\n",
+					file->filename));
+			status = 1;
+			break;
+		case -1:
+			/* crashed a decoder process */
+			uri = feh_thumbnail_get_name_uri(file->filename);
+			fail_file = feh_thumbnail_get_fail_name(uri);
+			feh_thumbnail_record_failure(file->filename, uri, fail_file);
+			free(uri);
+			free(fail_file);
+			return (0);
+		default:
+			uri = feh_thumbnail_get_name_uri(file->filename);
+			thumb_file = feh_thumbnail_get_name(uri);
+			status = feh_thumbnail_get_generated(image, file, thumb_file,
 				orig_w, orig_h);
 
-		D(("uri is %s, thumb_file is %s\n", uri, thumb_file));
-		free(uri);
-		free(thumb_file);
+			if (!status)
+				status = feh_thumbnail_get_from_larger(image, file, uri,
+						thumb_file, orig_w, orig_h);
+
+			if (!status) {
+				/* do not retry files which failed to load before */
+				fail_file = feh_thumbnail_get_fail_name(uri);
+				if (!feh_thumbnail_failed(file->filename, fail_file)
+						&& !(status = feh_thumbnail_generate(image, file,
+								thumb_file, uri, orig_w, orig_h)))
+					feh_thumbnail_record_failure(file->filename, uri,
+							fail_file);
+				free(fail_file);
+			}
+
+			D(("uri is %s, thumb_file is %s\n", uri, thumb_file));
+			free(uri);
+			free(thumb_file);
+		}
 	} else
-		status = feh_load_image(image, file);
+		status = feh_thumbnail_load(image, file, opt.thumb_w, opt.thumb_h,
+				orig_w, orig_h);
+
+	if (status && td.pack) {
+		if (!*orig_w) {
+			*orig_w = gib_imlib_image_get_width(*image);
+			*orig_h = gib_imlib_image_get_height(*image);
+		}
+		feh_imgcache_pack_save(file->filename, *image, td.pack_dim,
+				*orig_w, *orig_h);
+	}
 
 	return status;
 }
 
+/*
+ * Picks the cache tier for the requested thumbnail size and makes sure its
+ * ~/.thumbnails directory exists. Returns 0 if the thumbnails are too large
+ * to be cached.
+ */
+static int feh_thumbnail_cache_setup(void)
+{
+	if (opt.thumb_w > opt.thumb_h)
+		td.cache_dim = opt.thumb_w;
+	else
+		td.cache_dim = opt.thumb_h;
+
+	/* the smallest tier the thumbnails can be scaled down from */
+	for (td.cache_tier = 0; cache_tiers[td.cache_tier].dim
+			&& (cache_tiers[td.cache_tier].dim < td.cache_dim);
+			td.cache_tier++);
+
+	if (!cache_tiers[td.cache_tier].dim) {
+		/* too large for any tier, no caching */
+		td.cache_thumbnails = 0;
+		return (0);
+	}
+
+	td.cache_dim = cache_tiers[td.cache_tier].dim;
+	td.cache_dir = estrdup(cache_tiers[td.cache_tier].dir);
+	feh_thumbnail_setup_thumbnail_dir();
+	return (1);
+}
+
 char *feh_thumbnail_get_name(char *uri)
 {
 	char *home = NULL, *thumb_file = NULL, *md5_name = NULL;
@@ -775,6 +1508,26 @@ char *feh_thumbnail_get_name(char *uri)
 	return thumb_file;
 }
 
+/*
+ * Name of the file recording that uri could not be loaded, see
+ * feh_thumbnail_record_failure
+ */
+char *feh_thumbnail_get_fail_name(char *uri)
+{
+	char *home, *md5_name, *fail_file = NULL;
+
+	md5_name = feh_thumbnail_get_name_md5(uri);
+
+	home = getenv("HOME");
+	if (home)
+		fail_file = estrjoin("/", home, ".thumbnails", "fail", PACKAGE,
+				md5_name, NULL);
+
+	free(md5_name);
+
+	return fail_file;
+}
+
 char *feh_thumbnail_get_name_uri(char *name)
 {
 	char *cwd, *uri = NULL;
@@ -822,42 +1575,60 @@ char *feh_thumbnail_get_name_md5(char *uri)
 	return md5_name;
 }
 
-int feh_thumbnail_generate(Imlib_Image * image, feh_file * file,
-		char *thumb_file, char *uri, int * orig_w, int * orig_h)
+/*
+ * Scales im_temp, showing an orig_w x orig_h image, to the cache size and
+ * queues it to be saved as the thumbnail of file. Returns the scaled image.
+ */
+static Imlib_Image feh_thumbnail_cache_image(Imlib_Image im_temp,
+		feh_file * file, char *thumb_file, char *uri, int orig_w, int orig_h)
 {
-	int w, h, thumb_w, thumb_h;
-	Imlib_Image im_temp;
+	int thumb_w, thumb_h;
+	Imlib_Image image;
 	struct stat sb;
 	char c_width[8], c_height[8];
 
-	if (feh_load_image(&im_temp, file) != 0) {
-		*orig_w = w = gib_imlib_image_get_width(im_temp);
-		*orig_h = h = gib_imlib_image_get_height(im_temp);
-		thumb_w = td.cache_dim;
-		thumb_h = td.cache_dim;
-
-		if ((w > td.cache_dim) || (h > td.cache_dim)) {
-			double ratio = (double) w / h;
-			if (ratio > 1.0)
-				thumb_h = td.cache_dim / ratio;
-			else if (ratio != 1.0)
-				thumb_w = td.cache_dim * ratio;
-		}
+	thumb_w = td.cache_dim;
+	thumb_h = td.cache_dim;
 
-		*image = gib_imlib_create_cropped_scaled_image(im_temp, 0, 0, w, h,
-				thumb_w, thumb_h, 1);
-
-		if (!stat(file->filename, &sb)) {
-			char c_mtime[128];
-			sprintf(c_mtime, "%d", (int)sb.st_mtime);
-			snprintf(c_width, 8, "%d", w);
-			snprintf(c_height, 8, "%d", h);
-			feh_png_write_png(*image, thumb_file, "Thumb::URI", uri,
-					"Thumb::MTime", c_mtime,
-					"Thumb::Image::Width", c_width,
-					"Thumb::Image::Height", c_height);
-		}
+	if ((orig_w > td.cache_dim) || (orig_h > td.cache_dim)) {
+		double ratio = (double) orig_w / orig_h;
+		if (ratio > 1.0)
+			thumb_h = td.cache_dim / ratio;
+		else if (ratio != 1.0)
+			thumb_w = td.cache_dim * ratio;
+	}
+
+	image = gib_imlib_create_cropped_scaled_image(im_temp, 0, 0,
+			gib_imlib_image_get_width(im_temp),
+			gib_imlib_image_get_height(im_temp), thumb_w, thumb_h, 1);
+
+	if (!stat(file->filename, &sb)) {
+		char c_mtime[128];
+		char *comments[] = { "Thumb::URI", uri, "Thumb::MTime", c_mtime,
+			"Thumb::Image::Width", c_width,
+			"Thumb::Image::Height", c_height, NULL };
+
+		sprintf(c_mtime, "%d", (int)sb.st_mtime);
+		snprintf(c_width, 8, "%d", orig_w);
+		snprintf(c_height, 8, "%d", orig_h);
+		imlib_context_set_image(image);
+		feh_thumbwrite_queue(thumb_file,
+				imlib_image_get_data_for_reading_only(),
+				thumb_w, thumb_h, comments);
+	}
+
+	return (image);
+}
+
+int feh_thumbnail_generate(Imlib_Image * image, feh_file * file,
+		char *thumb_file, char *uri, int * orig_w, int * orig_h)
+{
+	Imlib_Image im_temp;
 
+	if (feh_thumbnail_load(&im_temp, file, td.cache_dim, td.cache_dim,
+				orig_w, orig_h) != 0) {
+		*image = feh_thumbnail_cache_image(im_temp, file, thumb_file, uri,
+				*orig_w, *orig_h);
 		gib_imlib_free_image_and_decache(im_temp);
 
 		return (1);
@@ -866,41 +1637,174 @@ int feh_thumbnail_generate(Imlib_Image * image, feh_file * file,
 	return (0);
 }
 
-int feh_thumbnail_get_generated(Imlib_Image * image, feh_file * file,
-	char *thumb_file, int * orig_w, int * orig_h)
+/*
+ * Creates the thumbnail of file from an up-to-date cached one of a larger
+ * tier, the nearest one first, which is much cheaper than loading the file
+ * itself.
+ */
+static int feh_thumbnail_get_from_larger(Imlib_Image * image,
+		feh_file * file, char *uri, char *thumb_file, int *orig_w,
+		int *orig_h)
 {
-	struct stat sb;
-	char *c_mtime;
-	char *c_width, *c_height;
-	time_t mtime = 0;
-	gib_hash *hash;
+	Imlib_Image im_temp = NULL;
+	DATA32 *data;
+	char *home, *md5_name, *larger_file;
+	int tier, w, h, has_alpha, valid;
 
-	if (!stat(file->filename, &sb)) {
-		hash = feh_png_read_comments(thumb_file);
-		if (hash != NULL) {
-			c_mtime  = (char *) gib_hash_get(hash, "Thumb::MTime");
-			c_width  = (char *) gib_hash_get(hash, "Thumb::Image::Width");
-			c_height = (char *) gib_hash_get(hash, "Thumb::Image::Height");
-			if (c_mtime != NULL)
-				mtime = (time_t) strtol(c_mtime, NULL, 10);
-			if (c_width != NULL)
-				*orig_w = atoi(c_width);
-			if (c_height != NULL)
-				*orig_h = atoi(c_height);
-			gib_hash_free_and_data(hash);
+	if (!(home = getenv("HOME")))
+		return (0);
+
+	md5_name = feh_thumbnail_get_name_md5(uri);
+	for (tier = td.cache_tier + 1; !im_temp && cache_tiers[tier].dim;
+			tier++) {
+		larger_file = estrjoin("/", home, ".thumbnails",
+				cache_tiers[tier].dir, md5_name, NULL);
+		data = feh_thumbnail_cache_decode(file->filename, larger_file, &w,
+				&h, orig_w, orig_h, &has_alpha, &valid);
+		if (data) {
+			if ((im_temp = imlib_create_image_using_copied_data(w, h,
+							data))) {
+				imlib_context_set_image(im_temp);
+				imlib_image_set_has_alpha(has_alpha);
+				D(("scaling down %s for %s\n", larger_file,
+						file->filename));
+			}
+			free(data);
 		}
+		free(larger_file);
+	}
+	free(md5_name);
+
+	if (!im_temp)
+		return (0);
+
+	if (!*orig_w || !*orig_h) {
+		*orig_w = w;
+		*orig_h = h;
+	}
+	*image = feh_thumbnail_cache_image(im_temp, file, thumb_file, uri,
+			*orig_w, *orig_h);
+	gib_imlib_free_image_and_decache(im_temp);
 
-		/* FIXME: should we bother about Thumb::URI? */
-		if (mtime == sb.st_mtime) {
-			feh_load_image_char(image, thumb_file);
+	return (1);
+}
 
+int feh_thumbnail_get_generated(Imlib_Image * image, feh_file * file,
+	char *thumb_file, int * orig_w, int * orig_h)
+{
+	DATA32 *data;
+	int w, h, has_alpha, valid;
+
+	data = feh_thumbnail_cache_decode(file->filename, thumb_file, &w, &h,
+			orig_w, orig_h, &has_alpha, &valid);
+	if (data) {
+		*image = imlib_create_image_using_copied_data(w, h, data);
+		free(data);
+		if (*image) {
+			imlib_context_set_image(*image);
+			imlib_image_set_has_alpha(has_alpha);
 			return (1);
 		}
+	} else if (valid) {
+		/* up to date, but not something feh_png_decode handles */
+		feh_load_image_char(image, thumb_file);
+
+		return (1);
 	}
 
 	return (0);
 }
 
+/*
+ * Decodes thumb_file if it is an up-to-date thumbnail of filename, opening
+ * it only once, and stores the size of the original image from its
+ * metadata. *valid is set if the thumbnail is current even when NULL is
+ * returned. Does not use Imlib2 or any thumbnail mode state, so decode
+ * workers may call it.
+ */
+DATA32 *feh_thumbnail_cache_decode(char *filename, char *thumb_file,
+	int * w, int * h, int * orig_w, int * orig_h, int * has_alpha,
+	int * valid)
+{
+	struct stat sb;
+
+	*valid = 0;
+	if (stat(filename, &sb))
+		return (NULL);
+
+	/* FIXME: should we bother about Thumb::URI? */
+	return (feh_png_decode_thumbnail(thumb_file, sb.st_mtime, w, h,
+			orig_w, orig_h, has_alpha, valid));
+}
+
+/*
+ * Checks whether filename failed to load in an earlier run and has not been
+ * modified since then.
+ */
+static int feh_thumbnail_failed(char *filename, char *fail_file)
+{
+	DATA32 *data;
+	int w, h, orig_w, orig_h, has_alpha, valid;
+
+	if (!fail_file)
+		return (0);
+
+	data = feh_thumbnail_cache_decode(filename, fail_file, &w, &h,
+			&orig_w, &orig_h, &has_alpha, &valid);
+	free(data);
+	return (valid);
+}
+
+/*
+ * Remembers that filename could not be loaded, as a 1x1 PNG with the
+ * Thumb::URI and Thumb::MTime of the file in ~/.thumbnails/fail/feh (see
+ * the freedesktop thumbnail specification). Files which are not local are
+ * not recorded, they might load fine next time.
+ */
+static void feh_thumbnail_record_failure(char *filename, char *uri,
+		char *fail_file)
+{
+	struct stat sb;
+	DATA32 pixel = 0;
+	char *dir, *home, c_mtime[128];
+	char *comments[] = { "Thumb::URI", uri, "Thumb::MTime", c_mtime, NULL };
+
+	if (!fail_file || !(home = getenv("HOME")) || stat(filename, &sb))
+		return;
+
+	dir = estrjoin("/", home, ".thumbnails", "fail", NULL);
+	mkdir(dir, 0700);
+	free(dir);
+	dir = estrjoin("/", home, ".thumbnails", "fail", PACKAGE, NULL);
+	mkdir(dir, 0700);
+	free(dir);
+
+	sprintf(c_mtime, "%d", (int)sb.st_mtime);
+	feh_thumbwrite_queue(fail_file, &pixel, 1, 1, comments);
+	D(("recorded failure to load %s in %s\n", filename, fail_file));
+	return;
+}
+
+/*
+ * Name of the cached thumbnail of filename, or NULL if the decode workers
+ * should not bother with it because it failed to load before
+ */
+char *feh_thumbnail_cache_name(char *filename)
+{
+	char *uri, *thumb_file, *fail_file;
+
+	uri = feh_thumbnail_get_name_uri(filename);
+	thumb_file = feh_thumbnail_get_name(uri);
+	fail_file = feh_thumbnail_get_fail_name(uri);
+	if (feh_thumbnail_failed(filename, fail_file)) {
+		free(thumb_file);
+		thumb_file = NULL;
+	}
+	free(uri);
+	free(fail_file);
+	return (thumb_file);
+}
+
 int feh_thumbnail_setup_thumbnail_dir(void)
 {
 	int status = 0;
@@ -933,3 +1837,365 @@ int feh_thumbnail_setup_thumbnail_dir(void)
 
 	return status;
 }
+
+/*
+ * --thumb-cache-gc: removes the thumbnails of files which are gone or have
+ * changed from the ~/.thumbnails tiers and fail/feh, then the least
+ * recently used ones until the cache fits into --thumb-cache-gc MiB (0: no
+ * limit).
+ * Thumbnails are checked by --decode-jobs threads in parallel.
+ */
+
+struct thumb_gc_entry {
+	char *path;
+	off_t size;
+	time_t used;
+	int stale;
+};
+
+struct thumb_gc {
+	struct thumb_gc_entry *entries;
+	int num;
+	int next;
+	pthread_mutex_t lock;
+};
+
+/* Returns the local file a file:// URI refers to, NULL for other URIs */
+static char *feh_thumbnail_uri_path(char *uri)
+{
+	char *path, *p, hex[3] = { 0 };
+
+	if (strncmp(uri, "file://", 7))
+		return(NULL);
+
+	path = p = estrdup(uri + 7);
+	for (uri += 7; *uri; uri++) {
+		if ((uri[0] == '%') && isxdigit((unsigned char) uri[1])
+				&& isxdigit((unsigned char) uri[2])) {
+			hex[0] = uri[1];
+			hex[1] = uri[2];
+			*p++ = strtol(hex, NULL, 16);
+			uri += 2;
+		} else
+			*p++ = *uri;
+	}
+	*p = '\0';
+	return(path);
+}
+
+/*
+ * Checks whether the thumbnail thumb_file is of no use anymore. Thumbnails
+ * of remote files are never stale, and neither are those of files which
+ * cannot be checked right now for other reasons than not existing.
+ */
+static int feh_thumbnail_gc_stale(char *thumb_file)
+{
+	gib_hash *hash;
+	struct stat sb;
+	char *uri, *mtime, *path;
+	int stale = 1;
+
+	if (!(hash = feh_png_read_comments(thumb_file)))
+		return(1);
+
+	uri = gib_hash_get(hash, "Thumb::URI");
+	mtime = gib_hash_get(hash, "Thumb::MTime");
+	if (uri && mtime) {
+		if (!(path = feh_thumbnail_uri_path(uri)))
+			stale = 0;
+		else if (stat(path, &sb))
+			stale = ((errno == ENOENT) || (errno == ENOTDIR));
+		else
+			stale = (sb.st_mtime != (time_t) strtol(mtime, NULL, 10));
+		free(path);
+	}
+
+	gib_hash_free_and_data(hash);
+	return(stale);
+}
+
+static void *feh_thumbnail_gc_worker(void *arg)
+{
+	struct thumb_gc *gc = arg;
+	int i;
+
+	for (;;) {
+		pthread_mutex_lock(&gc->lock);
+		i = gc->next++;
+		pthread_mutex_unlock(&gc->lock);
+		if (i >= gc->num)
+			break;
+		gc->entries[i].stale = feh_thumbnail_gc_stale(gc->entries[i].path);
+	}
+	return(NULL);
+}
+
+static int feh_thumbnail_gc_cmp(const void *a, const void *b)
+{
+	const struct thumb_gc_entry *ea = a, *eb = b;
+
+	return((ea->used > eb->used) - (ea->used < eb->used));
+}
+
+void feh_thumbnail_cache_gc(void)
+{
+	static char *cache_dirs[] = { "normal", "large", "x-large", "xx-large",
+		"fail/" PACKAGE, NULL };
+	struct thumb_gc gc;
+	struct dirent *de;
+	struct stat sb;
+	pthread_t *threads;
+	off_t total = 0, budget, before;
+	char *home, *dir, *path;
+	int size = 0, num_threads, started, stale = 0, evicted = 0, i;
+	DIR *d;
+
+	if (!(home = getenv("HOME")))
+		eprintf("HOME is not set, cannot find the thumbnail cache");
+
+	memset(&gc, 0, sizeof(gc));
+	for (i = 0; cache_dirs[i]; i++) {
+		dir = estrjoin("/", home, ".thumbnails", cache_dirs[i], NULL);
+		if (!(d = opendir(dir))) {
+			free(dir);
+			continue;
+		}
+		while ((de = readdir(d))) {
+			/* <md5 of the URI>.png, leave anything else alone */
+			if ((strlen(de->d_name) < 36)
+					|| strncmp(de->d_name + 32, ".png", 4))
+				continue;
+			path = estrjoin("/", dir, de->d_name, NULL);
+			if (stat(path, &sb) || !S_ISREG(sb.st_mode)) {
+				free(path);
+				continue;
+			}
+			if (strlen(de->d_name) != 36) {
+				/* temporary file of an interrupted feh_png_write_data */
+				if ((strlen(de->d_name) == 43) && (de->d_name[36] == '.')
+						&& (sb.st_mtime < time(NULL) - 3600))
+					unlink(path);
+				free(path);
+				continue;
+			}
+			if (gc.num == size) {
+				size = size ? size * 2 : 256;
+				gc.entries = erealloc(gc.entries,
+						size * sizeof(struct thumb_gc_entry));
+			}
+			gc.entries[gc.num].path = path;
+			gc.entries[gc.num].size = sb.st_size;
+			gc.entries[gc.num].used = (sb.st_atime > sb.st_mtime)
+				? sb.st_atime : sb.st_mtime;
+			gc.entries[gc.num].stale = 0;
+			gc.num++;
+		}
+		closedir(d);
+		free(dir);
+	}
+
+	num_threads = (opt.decode_jobs > 0) ? opt.decode_jobs : 1;
+	if (num_threads > gc.num)
+		num_threads = gc.num;
+	pthread_mutex_init(&gc.lock, NULL);
+	threads = emalloc((num_threads + 1) * sizeof(pthread_t));
+	for (started = 0; started < num_threads; started++)
+		if (pthread_create(&threads[started], NULL, feh_thumbnail_gc_worker,
+					&gc))
+			break;
+	/* also does all the work if no thread could be started */
+	feh_thumbnail_gc_worker(&gc);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	pthread_mutex_destroy(&gc.lock);
+
+	for (i = 0; i < gc.num; i++) {
+		if (gc.entries[i].stale && (!unlink(gc.entries[i].path)
+					|| (errno == ENOENT))) {
+			D(("removed stale thumbnail %s\n", gc.entries[i].path));
+			stale++;
+		} else {
+			gc.entries[i].stale = 0;
+			total += gc.entries[i].size;
+		}
+	}
+
+	before = total;
+	budget = (off_t) opt.thumb_cache_budget * 1024 * 1024;
+	if (budget && (total > budget)) {
+		qsort(gc.entries, gc.num, sizeof(struct thumb_gc_entry),
+				feh_thumbnail_gc_cmp);
+		for (i = 0; (i < gc.num) && (total > budget); i++) {
+			if (gc.entries[i].stale)
+				continue;
+			if (!unlink(gc.entries[i].path) || (errno == ENOENT)) {
+				total -= gc.entries[i].size;
+				evicted++;
+			}
+		}
+	}
+
+	printf(PACKAGE " - %d cached thumbnails: removed %d stale, %d more"
+			" (%d KiB) to fit the budget, %d KiB left\n", gc.num, stale,
+			evicted, (int) ((before - total) / 1024), (int) (total / 1024));
+
+	for (i = 0; i < gc.num; i++)
+		free(gc.entries[i].path);
+	free(gc.entries);
+	return;
+}
+
+/*
+ * --generate-thumbnails: fills the thumbnail cache for all files without
+ * opening a window. --decode-jobs worker processes take the next file from
+ * a counter in shared memory. Up-to-date thumbnails and files which failed
+ * before are skipped, so an interrupted run just picks up where it left
+ * off, and as thumbnails are renamed into place when complete, several
+ * workers (or feh instances) never see a partial one.
+ */
+
+struct thumb_gen_stats {
+	int generated;
+	int fresh;
+	int failed;
+	double bytes;
+};
+
+struct thumb_gen {
+	int next;
+	struct thumb_gen_stats stats[1];	/* one per worker */
+};
+
+static void feh_thumbnail_generate_file(feh_file * file,
+		struct thumb_gen_stats *stats)
+{
+	Imlib_Image image = NULL;
+	DATA32 *data;
+	struct stat sb;
+	char *uri, *thumb_file, *fail_file;
+	int w, h, orig_w, orig_h, has_alpha, valid;
+
+	uri = feh_thumbnail_get_name_uri(file->filename);
+	thumb_file = feh_thumbnail_get_name(uri);
+	fail_file = feh_thumbnail_get_fail_name(uri);
+
+	data = feh_thumbnail_cache_decode(file->filename, thumb_file, &w, &h,
+			&orig_w, &orig_h, &has_alpha, &valid);
+	free(data);
+
+	if (valid)
+		stats->fresh++;
+	else if (feh_thumbnail_failed(file->filename, fail_file))
+		stats->failed++;
+	else if (feh_thumbnail_get_from_larger(&image, file, uri, thumb_file,
+				&orig_w, &orig_h))
+		stats->generated++;
+	else if (feh_thumbnail_generate(&image, file, thumb_file, uri,
+				&orig_w, &orig_h)) {
+		stats->generated++;
+		if (!stat(file->filename, &sb))
+			stats->bytes += sb.st_size;
+	} else {
+		feh_thumbnail_record_failure(file->filename, uri, fail_file);
+		stats->failed++;
+	}
+
+	if (image)
+		gib_imlib_free_image_and_decache(image);
+	free(uri);
+	free(thumb_file);
+	free(fail_file);
+	return;
+}
+
+static void feh_thumbnail_generate_worker(struct thumb_gen *gen,
+		feh_file ** files, int num_files, int worker)
+{
+	int i;
+
+	while ((i = __sync_fetch_and_add(&gen->next, 1)) < num_files)
+		feh_thumbnail_generate_file(files[i], &gen->stats[worker]);
+
+	/* the writer thread has the last thumbnails */
+	feh_thumbwrite_cleanup();
+	feh_thumbnail_cleanup();
+	return;
+}
+
+void feh_thumbnail_generate_all(void)
+{
+	struct thumb_gen *gen;
+	struct thumb_gen_stats total;
+	feh_file **files;
+	gib_list *l;
+	pid_t *pids;
+	size_t gen_size;
+	double start, elapsed;
+	int num_files, num_workers, started = 0, i;
+
+	td.cache_thumbnails = 1;
+	if (!feh_thumbnail_cache_setup())
+		eprintf("--generate-thumbnails: thumbnails larger than %dx%d pixels"
+				" are not cached", 1024, 1024);
+
+	num_files = gib_list_length(filelist);
+	files = emalloc(num_files * sizeof(feh_file *));
+	for (i = 0, l = filelist; l; l = l->next)
+		files[i++] = FEH_FILE(l->data);
+
+	num_workers = (opt.decode_jobs > 0) ? opt.decode_jobs : 1;
+	if (num_workers > num_files)
+		num_workers = num_files;
+
+	gen_size = sizeof(struct thumb_gen)
+		+ num_workers * sizeof(struct thumb_gen_stats);
+	gen = mmap(NULL, gen_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (gen == MAP_FAILED)
+		eprintf("--generate-thumbnails: cannot map shared memory:");
+	memset(gen, 0, gen_size);
+
+	start = feh_get_time();
+
+	pids = emalloc(num_workers * sizeof(pid_t));
+	for (started = 0; started < num_workers; started++) {
+		if ((pids[started] = fork()) < 0) {
+			weprintf("--generate-thumbnails: cannot start worker:");
+			break;
+		}
+		if (!pids[started]) {
+			feh_thumbnail_generate_worker(gen, files, num_files, started);
+			_exit(0);
+		}
+	}
+	/* nothing could be forked, do it all in here */
+	if (!started)
+		feh_thumbnail_generate_worker(gen, files, num_files, 0);
+
+	for (i = 0; i < started; i++)
+		while ((waitpid(pids[i], NULL, 0) == -1) && (errno == EINTR));
+	elapsed = feh_get_time() - start;
+	if (elapsed <= 0.0)
+		elapsed = 0.001;
+
+	memset(&total, 0, sizeof(total));
+	for (i = 0; i < num_workers; i++) {
+		total.generated += gen->stats[i].generated;
+		total.fresh += gen->stats[i].fresh;
+		total.failed += gen->stats[i].failed;
+		total.bytes += gen->stats[i].bytes;
+	}
+
+	printf(PACKAGE " - %d files in %.1fs: %d thumbnails generated, %d up to"
+			" date, %d unloadable\n", num_files, elapsed, total.generated,
+			total.fresh, total.failed);
+	printf("    - %.1f files/s, %.1f MB/s read by %d worker%s\n",
+			num_files / elapsed, total.bytes / elapsed / (1024 * 1024),
+			started ? started : 1, (started > 1) ? "s" : "");
+
+	munmap(gen, gen_size);
+	free(pids);
+	free(files);
+	return;
+}
@@ -61,8 +61,18 @@ typedef struct thumbmode_data {
 	int vertical;            /* FIXME: vertical in what way? */
 
 	int cache_thumbnails;    /* use cached thumbnails from ~/.thumbnails */
-	int cache_dim;           /* 128 = 128x128 ("normal"), 256 = 256x256 ("large") */
-	char *cache_dir;         /* "normal"/"large" (.thumbnails/...) */
+	int cache_tier;          /* index into cache_tiers (thumbnail.c) */
+	int cache_dim;           /* 128 = 128x128 ("normal"), 256 = 256x256 ("large"), ... */
+	char *cache_dir;         /* "normal"/"large"/"x-large"/"xx-large" (.thumbnails/...) */
+
+	int scroll;              /* --thumb-scroll: im_main is only a viewport */
+	int scroll_y;            /* viewport offset into the grid, in pixels */
+	int cell_w, cols;        /* grid cell width and cells per row */
+	int title_area_h;        /* space reserved for the --title-font line */
+	int trans_bg;            /* --bg trans */
+
+	int pack;                /* --thumb-pack */
+	int pack_dim;            /* size of the thumbnails in the pack */
 
 } thumbmode_data;
 
@@ -73,14 +83,21 @@ feh_thumbnail *feh_thumbnail_get_from_file(feh_file * file);
 void feh_thumbnail_mark_removed(feh_file * file, int deleted);
 
 void feh_thumbnail_calculate_geometry(void);
+void feh_thumbnail_scroll(winwidget winwid, int rows, int page);
 
 int feh_thumbnail_get_thumbnail(Imlib_Image * image, feh_file * file, int * orig_w, int * orig_h);
 int feh_thumbnail_generate(Imlib_Image * image, feh_file * file, char *thumb_file, char *uri, int * orig_w, int * orig_h);
 int feh_thumbnail_get_generated(Imlib_Image * image, feh_file * file, char * thumb_file, int * orig_w, int * orig_h);
+DATA32 *feh_thumbnail_cache_decode(char *filename, char *thumb_file, int * w, int * h, int * orig_w, int * orig_h, int * has_alpha, int * valid);
+char *feh_thumbnail_cache_name(char *filename);
 char *feh_thumbnail_get_name(char *uri);
+char *feh_thumbnail_get_fail_name(char *uri);
 char *feh_thumbnail_get_name_uri(char *name);
 char *feh_thumbnail_get_name_md5(char *uri);
 
 int feh_thumbnail_setup_thumbnail_dir(void);
+void feh_thumbnail_cache_gc(void);
+void feh_thumbnail_generate_all(void);
+void feh_thumbnail_cleanup(void);
 
 #endif
@@ -0,0 +1,164 @@
+/* thumbwrite.c
+
+Copyright (C) 2011 by Daniel Friesel
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to
+deal in the Software without restriction, including without limitation the
+rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies of the Software and its documentation and acknowledgment shall be
+given in the documentation and software packages that this Software was
+used.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+#include "feh.h"
+#include "feh_png.h"
+#include "options.h"
+#include "thumbwrite.h"
+
+#include <pthread.h>
+
+/*
+ * Background writer for cached thumbnails. Encoding the PNG is a large part
+ * of generating a thumbnail, so thumbnail mode only copies the pixels and
+ * moves on while a writer thread saves them. The queue is bounded, so a
+ * slow disk holds generation back instead of piling up thumbnails in
+ * memory. Queued thumbnails are written before feh exits.
+ */
+
+#define THUMBWRITE_MAX_QUEUED 64
+#define THUMBWRITE_MAX_COMMENTS 8
+
+struct thumbwrite_job {
+	char *file;
+	DATA32 *data;
+	int w, h;
+	char *comments[2 * THUMBWRITE_MAX_COMMENTS + 1];
+};
+
+static pthread_mutex_t tw_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tw_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t tw_done = PTHREAD_COND_INITIALIZER;
+
+/* jobs not yet written, oldest first. Protected by tw_lock */
+static gib_list *tw_queue = NULL;
+static int tw_queue_len = 0;
+static int tw_shutdown = 0;
+
+static pthread_t writer;
+static int writer_state = 0;	/* 0: not started, 1: running, -1: failed */
+
+static void feh_thumbwrite_job_free(struct thumbwrite_job *job)
+{
+	int i;
+
+	for (i = 0; job->comments[i]; i++)
+		free(job->comments[i]);
+	free(job->file);
+	free(job->data);
+	free(job);
+	return;
+}
+
+static void feh_thumbwrite_job_write(struct thumbwrite_job *job)
+{
+	if (!feh_png_write_data(job->file, job->data, job->w, job->h,
+				job->comments))
+		D(("failed to write thumbnail %s\n", job->file));
+	feh_thumbwrite_job_free(job);
+	return;
+}
+
+static void *feh_thumbwrite_writer(void *arg __attribute__ ((unused)))
+{
+	struct thumbwrite_job *job;
+
+	pthread_mutex_lock(&tw_lock);
+	for (;;) {
+		if (!tw_queue) {
+			if (tw_shutdown)
+				break;
+			pthread_cond_wait(&tw_queued, &tw_lock);
+			continue;
+		}
+		job = tw_queue->data;
+		tw_queue = gib_list_remove(tw_queue, tw_queue);
+		tw_queue_len--;
+		pthread_cond_signal(&tw_done);
+		pthread_mutex_unlock(&tw_lock);
+
+		feh_thumbwrite_job_write(job);
+
+		pthread_mutex_lock(&tw_lock);
+	}
+	pthread_mutex_unlock(&tw_lock);
+	return(NULL);
+}
+
+/*
+ * Saves the w x h ARGB pixels in data as file, with the tEXt key/value
+ * pairs in comments (NULL terminated). Everything is copied, so the caller
+ * may free or change it right away. Falls back to writing the file
+ * directly if no writer thread can be started.
+ */
+void feh_thumbwrite_queue(char *file, DATA32 * data, int w, int h,
+		char **comments)
+{
+	struct thumbwrite_job *job;
+	int i;
+
+	job = emalloc(sizeof(struct thumbwrite_job));
+	job->file = estrdup(file);
+	job->data = emalloc(w * h * sizeof(DATA32));
+	memcpy(job->data, data, w * h * sizeof(DATA32));
+	job->w = w;
+	job->h = h;
+	for (i = 0; comments && comments[i] && (i < 2 * THUMBWRITE_MAX_COMMENTS);
+			i++)
+		job->comments[i] = estrdup(comments[i]);
+	job->comments[i] = NULL;
+
+	if (!writer_state)
+		writer_state = pthread_create(&writer, NULL, feh_thumbwrite_writer,
+				NULL) ? -1 : 1;
+	if (writer_state == -1) {
+		feh_thumbwrite_job_write(job);
+		return;
+	}
+
+	pthread_mutex_lock(&tw_lock);
+	while (tw_queue_len >= THUMBWRITE_MAX_QUEUED)
+		pthread_cond_wait(&tw_done, &tw_lock);
+	tw_queue = gib_list_add_end(tw_queue, job);
+	tw_queue_len++;
+	pthread_cond_signal(&tw_queued);
+	pthread_mutex_unlock(&tw_lock);
+	return;
+}
+
+/* Writes out the remaining queue and stops the writer thread */
+void feh_thumbwrite_cleanup(void)
+{
+	if (writer_state != 1)
+		return;
+
+	pthread_mutex_lock(&tw_lock);
+	tw_shutdown = 1;
+	pthread_cond_signal(&tw_queued);
+	pthread_mutex_unlock(&tw_lock);
+	pthread_join(writer, NULL);
+	writer_state = 0;
+	tw_shutdown = 0;
+	return;
+}
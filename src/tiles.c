@@ -0,0 +1,792 @@
+/* tiles.c
+
+Copyright (C) 2011 by Daniel Friesel
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to
+deal in the Software without restriction, including without limitation the
+rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies of the Software and its documentation and acknowledgment shall be
+given in the documentation and software packages that this Software was
+used.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+#include "feh.h"
+#include "filelist.h"
+#include "options.h"
+#include "winwidget.h"
+#include "tiles.h"
+#include "feh_png.h"
+#include "md5.h"
+
+#include <png.h>
+#include <zlib.h>
+#include <stdint.h>
+
+/*
+ * Tile pyramids for images too large to decode in one piece. The first time
+ * such an image is opened, it is streamed through libpng row by row and cut
+ * into 256x256 tiles at full resolution and at every halved level below it,
+ * down to an overview that fits into 2048x2048. The tiles are stored
+ * compressed in a cache file under $XDG_CACHE_HOME/feh/tiles. The overview
+ * becomes the window image; when zoomed in, only the tiles covering the
+ * visible area are read from the cache file and drawn.
+ */
+
+#define TILE_SIZE     256
+#define TILE_OVERVIEW 2048
+#define TILE_LEVELS   32
+#define TILE_CACHE    128
+#define TILE_MAGIC    "FEHTILE1"
+
+struct tile_header {
+	char magic[8];
+	uint32_t width;
+	uint32_t height;
+	uint32_t tile_size;
+	uint32_t levels;
+	uint32_t has_alpha;
+	uint32_t pad;
+	uint64_t index_offset;
+};
+
+struct tile_entry {
+	uint64_t offset;
+	uint32_t length;
+	uint32_t pad;
+};
+
+struct __feh_tiles {
+	char *filename;
+	int fd;
+	int levels;
+	int has_alpha;
+	int w[TILE_LEVELS];
+	int h[TILE_LEVELS];
+	int cols[TILE_LEVELS];
+	int rows[TILE_LEVELS];
+	struct tile_entry *index[TILE_LEVELS];
+};
+
+/* decoded tiles, most recently used first. Shared by all windows. */
+struct tile_cached {
+	feh_tiles *t;
+	int level, col, row;
+	Imlib_Image im;
+};
+
+static gib_list *tile_cache = NULL;
+static int tile_cache_len = 0;
+
+/* state of one level while the pyramid is being built */
+struct tile_level {
+	int w, h, cols, rows;
+	DATA32 *strip;		/* up to TILE_SIZE rows of this level */
+	int strip_rows;
+	int rows_done;
+	DATA32 *pending;	/* even row waiting for the odd one */
+	int have_pending;
+	DATA32 *down;		/* 2x2 average of pending and the odd row */
+	struct tile_entry *index;
+};
+
+struct tile_build {
+	int fd;
+	uint64_t offset;
+	int levels;
+	struct tile_level lev[TILE_LEVELS];
+	DATA32 *tile;
+	unsigned char *zbuf;
+	uLongf zbuf_size;
+};
+
+static int feh_tiles_count_levels(int w, int h, int *lw, int *lh)
+{
+	int levels = 1;
+
+	lw[0] = w;
+	lh[0] = h;
+	while ((lw[levels - 1] > TILE_OVERVIEW || lh[levels - 1] > TILE_OVERVIEW)
+			&& levels < TILE_LEVELS) {
+		lw[levels] = (lw[levels - 1] + 1) / 2;
+		lh[levels] = (lh[levels - 1] + 1) / 2;
+		levels++;
+	}
+	return(levels);
+}
+
+/*
+ * Returns 1 if filename is a non-interlaced PNG larger than --tile-limit,
+ * and stores its dimensions in width / height (if not NULL). Only the IHDR
+ * chunk is read.
+ */
+int feh_tiles_wanted(char *filename, int *width, int *height)
+{
+	FILE *fp;
+	unsigned char ihdr[33];
+	int w, h;
+
+	if (!opt.tile_limit)
+		return(0);
+	if (!(fp = fopen(filename, "rb")))
+		return(0);
+	if (fread(ihdr, 1, sizeof(ihdr), fp) != sizeof(ihdr)) {
+		fclose(fp);
+		return(0);
+	}
+	fclose(fp);
+
+	if (png_sig_cmp(ihdr, 0, 8) || memcmp(ihdr + 12, "IHDR", 4))
+		return(0);
+
+	w = (ihdr[16] << 24) | (ihdr[17] << 16) | (ihdr[18] << 8) | ihdr[19];
+	h = (ihdr[20] << 24) | (ihdr[21] << 16) | (ihdr[22] << 8) | ihdr[23];
+
+	/* interlaced images cannot be read one row at a time */
+	if (ihdr[28] != 0 || w <= 0 || h <= 0)
+		return(0);
+	if ((double) w * h <= opt.tile_limit * 1000000.0)
+		return(0);
+
+	if (width)
+		*width = w;
+	if (height)
+		*height = h;
+	return(1);
+}
+
+static char *feh_tiles_cache_name(char *filename)
+{
+	static char *dir = NULL;
+	static int dir_ok = -1;
+	struct stat st;
+	char *path, *key, *ret;
+	char stamp[64], hex[33];
+	md5_state_t pms;
+	md5_byte_t digest[16];
+	int i;
+
+	if (dir_ok == -1)
+		dir_ok = ((dir = feh_cache_dir("tiles")) != NULL);
+	if (!dir_ok || stat(filename, &st))
+		return(NULL);
+
+	if (!(path = realpath(filename, NULL)))
+		path = estrdup(filename);
+	snprintf(stamp, sizeof(stamp), ":%ld:%ld", (long) st.st_mtime,
+			(long) st.st_size);
+	key = estrjoin("", path, stamp, NULL);
+	free(path);
+
+	md5_init(&pms);
+	md5_append(&pms, (unsigned char *) key, strlen(key));
+	md5_finish(&pms, digest);
+	free(key);
+
+	for (i = 0; i < 16; i++)
+		sprintf(hex + 2 * i, "%02x", digest[i]);
+
+	ret = estrjoin("", dir, "/", hex, NULL);
+	return(ret);
+}
+
+static int feh_tiles_write(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	ssize_t ret;
+
+	while (len > 0) {
+		if ((ret = write(fd, p, len)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return(0);
+		}
+		p += ret;
+		len -= ret;
+	}
+	return(1);
+}
+
+/* Compresses the tiles in the strip of level l and appends them to the file */
+static int feh_tiles_flush_strip(struct tile_build *b, int l)
+{
+	struct tile_level *lev = &b->lev[l];
+	struct tile_entry *e;
+	int col, y, tw, tr = (lev->rows_done - 1) / TILE_SIZE;
+	uLongf zlen;
+
+	for (col = 0; col < lev->cols; col++) {
+		tw = lev->w - col * TILE_SIZE;
+		if (tw > TILE_SIZE)
+			tw = TILE_SIZE;
+		for (y = 0; y < lev->strip_rows; y++)
+			memcpy(b->tile + y * tw,
+					lev->strip + y * lev->w + col * TILE_SIZE,
+					tw * sizeof(DATA32));
+
+		zlen = b->zbuf_size;
+		if (compress2(b->zbuf, &zlen, (Bytef *) b->tile,
+					tw * lev->strip_rows * sizeof(DATA32), 1) != Z_OK)
+			return(0);
+		if (!feh_tiles_write(b->fd, b->zbuf, zlen))
+			return(0);
+
+		e = &lev->index[tr * lev->cols + col];
+		e->offset = b->offset;
+		e->length = zlen;
+		e->pad = 0;
+		b->offset += zlen;
+	}
+	lev->strip_rows = 0;
+	return(1);
+}
+
+/*
+ * Adds one row to level l. Every second row is averaged with the previous
+ * one and passed on to the next level; the last row of an odd-height level
+ * is paired with itself.
+ */
+static int feh_tiles_push_row(struct tile_build *b, int l, DATA32 *row)
+{
+	struct tile_level *lev = &b->lev[l];
+	struct tile_level *next;
+	DATA32 *a, *c;
+	int x, x0, x1, i, sum;
+
+	memcpy(lev->strip + lev->strip_rows * lev->w, row, lev->w * sizeof(DATA32));
+	lev->strip_rows++;
+	lev->rows_done++;
+	if ((lev->strip_rows == TILE_SIZE) || (lev->rows_done == lev->h))
+		if (!feh_tiles_flush_strip(b, l))
+			return(0);
+
+	if (l + 1 >= b->levels)
+		return(1);
+
+	if (!lev->have_pending) {
+		memcpy(lev->pending, row, lev->w * sizeof(DATA32));
+		lev->have_pending = 1;
+		if (lev->rows_done < lev->h)
+			return(1);
+	}
+	next = &b->lev[l + 1];
+	a = lev->pending;
+	c = (lev->rows_done == lev->h && lev->h % 2) ? lev->pending : row;
+
+	for (x = 0; x < next->w; x++) {
+		x0 = 2 * x;
+		x1 = (x0 + 1 < lev->w) ? x0 + 1 : x0;
+		next->down[x] = 0;
+		for (i = 0; i < 32; i += 8) {
+			sum = ((a[x0] >> i) & 0xff) + ((a[x1] >> i) & 0xff)
+				+ ((c[x0] >> i) & 0xff) + ((c[x1] >> i) & 0xff);
+			next->down[x] |= (DATA32) ((sum + 2) >> 2) << i;
+		}
+	}
+	lev->have_pending = 0;
+	return(feh_tiles_push_row(b, l + 1, next->down));
+}
+
+static void feh_tiles_build_free(struct tile_build *b)
+{
+	int l;
+
+	for (l = 0; l < b->levels; l++) {
+		free(b->lev[l].strip);
+		free(b->lev[l].pending);
+		free(b->lev[l].down);
+		free(b->lev[l].index);
+	}
+	free(b->tile);
+	free(b->zbuf);
+	free(b);
+}
+
+/* Streams filename through libpng and writes its tile pyramid to cachefile */
+static int feh_tiles_build(char *filename, char *cachefile)
+{
+	FILE *fp;
+	png_structp png_ptr;
+	png_infop info_ptr;
+	png_uint_32 w, h;
+	int depth, color_type, interlace, sig_bytes, has_alpha;
+	struct tile_build *b;
+	struct tile_header hdr;
+	unsigned char *row = NULL;
+	DATA32 *argb = NULL;
+	unsigned char *p;
+	char *tmpname;
+	png_uint_32 x, y;
+	int l, lw[TILE_LEVELS], lh[TILE_LEVELS];
+
+	if (!(fp = fopen(filename, "rb")))
+		return(0);
+	if (!(sig_bytes = feh_png_file_is_png(fp))) {
+		fclose(fp);
+		return(0);
+	}
+
+	png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	if (!png_ptr) {
+		fclose(fp);
+		return(0);
+	}
+	info_ptr = png_create_info_struct(png_ptr);
+	if (!info_ptr) {
+		png_destroy_read_struct(&png_ptr, (png_infopp) NULL, (png_infopp) NULL);
+		fclose(fp);
+		return(0);
+	}
+
+	tmpname = estrjoin("", cachefile, ".XXXXXX", NULL);
+	b = emalloc(sizeof(struct tile_build));
+	memset(b, 0, sizeof(struct tile_build));
+	b->fd = -1;
+
+	if (setjmp(png_jmpbuf(png_ptr))) {
+		png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+		fclose(fp);
+		if (b->fd != -1) {
+			close(b->fd);
+			unlink(tmpname);
+		}
+		feh_tiles_build_free(b);
+		free(row);
+		free(argb);
+		free(tmpname);
+		return(0);
+	}
+
+	png_init_io(png_ptr, fp);
+	png_set_sig_bytes(png_ptr, sig_bytes);
+	png_read_info(png_ptr, info_ptr);
+	png_get_IHDR(png_ptr, info_ptr, &w, &h, &depth, &color_type, &interlace,
+			NULL, NULL);
+
+	if (interlace != PNG_INTERLACE_NONE)
+		png_error(png_ptr, "interlaced");
+
+	has_alpha = (color_type & PNG_COLOR_MASK_ALPHA)
+		|| png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS);
+
+	if (depth == 16)
+		png_set_strip_16(png_ptr);
+	png_set_expand(png_ptr);
+	if (!(color_type & PNG_COLOR_MASK_COLOR))
+		png_set_gray_to_rgb(png_ptr);
+	if (!has_alpha)
+		png_set_filler(png_ptr, 0xff, PNG_FILLER_AFTER);
+	png_read_update_info(png_ptr, info_ptr);
+
+	if (png_get_rowbytes(png_ptr, info_ptr) != w * 4)
+		png_error(png_ptr, "unexpected row format");
+
+	b->levels = feh_tiles_count_levels(w, h, lw, lh);
+	for (l = 0; l < b->levels; l++) {
+		struct tile_level *lev = &b->lev[l];
+
+		lev->w = lw[l];
+		lev->h = lh[l];
+		lev->cols = (lev->w + TILE_SIZE - 1) / TILE_SIZE;
+		lev->rows = (lev->h + TILE_SIZE - 1) / TILE_SIZE;
+		lev->strip = emalloc(lev->w * TILE_SIZE * sizeof(DATA32));
+		lev->pending = emalloc(lev->w * sizeof(DATA32));
+		lev->down = emalloc(lev->w * sizeof(DATA32));
+		lev->index = emalloc(lev->cols * lev->rows * sizeof(struct tile_entry));
+	}
+	b->tile = emalloc(TILE_SIZE * TILE_SIZE * sizeof(DATA32));
+	b->zbuf_size = compressBound(TILE_SIZE * TILE_SIZE * sizeof(DATA32));
+	b->zbuf = emalloc(b->zbuf_size);
+	row = emalloc(w * 4);
+	argb = emalloc(w * sizeof(DATA32));
+
+	if ((b->fd = mkstemp(tmpname)) == -1)
+		png_error(png_ptr, "cannot create cache file");
+
+	memset(&hdr, 0, sizeof(hdr));
+	if (!feh_tiles_write(b->fd, &hdr, sizeof(hdr)))
+		png_error(png_ptr, "write error");
+	b->offset = sizeof(hdr);
+
+	if (opt.verbose && !opt.quiet) {
+		fprintf(stdout, "\nfeh: building tiles for %s (%dx%d)\n",
+				filename, (int) w, (int) h);
+		reset_output = 1;
+	}
+
+	for (y = 0; y < h; y++) {
+		png_read_row(png_ptr, row, NULL);
+		for (x = 0, p = row; x < w; x++, p += 4)
+			argb[x] = (p[3] << 24) | (p[0] << 16) | (p[1] << 8) | p[2];
+		if (!feh_tiles_push_row(b, 0, argb))
+			png_error(png_ptr, "write error");
+	}
+
+	memcpy(hdr.magic, TILE_MAGIC, 8);
+	hdr.width = w;
+	hdr.height = h;
+	hdr.tile_size = TILE_SIZE;
+	hdr.levels = b->levels;
+	hdr.has_alpha = has_alpha;
+	hdr.index_offset = b->offset;
+
+	for (l = 0; l < b->levels; l++)
+		if (!feh_tiles_write(b->fd, b->lev[l].index, b->lev[l].cols
+					* b->lev[l].rows * sizeof(struct tile_entry)))
+			png_error(png_ptr, "write error");
+	if ((lseek(b->fd, 0, SEEK_SET) != 0)
+			|| !feh_tiles_write(b->fd, &hdr, sizeof(hdr))
+			|| close(b->fd)) {
+		b->fd = -1;
+		unlink(tmpname);
+		png_error(png_ptr, "write error");
+	}
+	b->fd = -1;
+
+	png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+	fclose(fp);
+	feh_tiles_build_free(b);
+	free(row);
+	free(argb);
+
+	if (rename(tmpname, cachefile)) {
+		unlink(tmpname);
+		free(tmpname);
+		return(0);
+	}
+	free(tmpname);
+	return(1);
+}
+
+/*
+ * Opens the pyramid in cachefile. Returns NULL if it is missing or damaged,
+ * so that it is built again.
+ */
+static feh_tiles *feh_tiles_read(char *filename, char *cachefile)
+{
+	feh_tiles *t;
+	struct tile_header hdr;
+	struct tile_entry *e;
+	struct stat st;
+	int fd, l, lw[TILE_LEVELS], lh[TILE_LEVELS];
+	size_t len, i;
+	uint64_t offset, zmax = compressBound(TILE_SIZE * TILE_SIZE * sizeof(DATA32));
+
+	if ((fd = open(cachefile, O_RDONLY)) == -1)
+		return(NULL);
+	if (fstat(fd, &st)
+			|| (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+			|| memcmp(hdr.magic, TILE_MAGIC, 8)
+			|| (hdr.tile_size != TILE_SIZE) || !hdr.width || !hdr.height
+			|| (feh_tiles_count_levels(hdr.width, hdr.height, lw, lh)
+				!= (int) hdr.levels)
+			|| (hdr.index_offset > (uint64_t) st.st_size)) {
+		close(fd);
+		return(NULL);
+	}
+
+	t = emalloc(sizeof(feh_tiles));
+	t->filename = estrdup(filename);
+	t->fd = fd;
+	t->levels = hdr.levels;
+	t->has_alpha = hdr.has_alpha;
+	offset = hdr.index_offset;
+
+	for (l = 0; l < t->levels; l++) {
+		t->w[l] = lw[l];
+		t->h[l] = lh[l];
+		t->cols[l] = (lw[l] + TILE_SIZE - 1) / TILE_SIZE;
+		t->rows[l] = (lh[l] + TILE_SIZE - 1) / TILE_SIZE;
+		len = (size_t) t->cols[l] * t->rows[l] * sizeof(struct tile_entry);
+		if (len > (uint64_t) st.st_size - offset) {
+			t->levels = l;
+			feh_tiles_close(t);
+			return(NULL);
+		}
+		t->index[l] = emalloc(len);
+		if (pread(fd, t->index[l], len, offset) != (ssize_t) len) {
+			t->levels = l + 1;
+			feh_tiles_close(t);
+			return(NULL);
+		}
+		offset += len;
+
+		/* tiles are decoded with these, don't trust them blindly */
+		for (i = 0; i < len / sizeof(struct tile_entry); i++) {
+			e = &t->index[l][i];
+			if (!e->length || (e->length > zmax)
+					|| (e->offset > (uint64_t) st.st_size)
+					|| (e->length > (uint64_t) st.st_size - e->offset)) {
+				D(("%s: bad index entry, rebuilding\n", cachefile));
+				t->levels = l + 1;
+				feh_tiles_close(t);
+				return(NULL);
+			}
+		}
+	}
+	return(t);
+}
+
+/* Returns the tile pyramid of filename, building it first if necessary */
+feh_tiles *feh_tiles_open(char *filename)
+{
+	feh_tiles *t;
+	char *cachefile;
+
+	if (!(cachefile = feh_tiles_cache_name(filename)))
+		return(NULL);
+
+	if (!(t = feh_tiles_read(filename, cachefile))
+			&& feh_tiles_build(filename, cachefile))
+		t = feh_tiles_read(filename, cachefile);
+
+	if (!t && !opt.quiet)
+		weprintf("%s - cannot build tile cache", filename);
+	free(cachefile);
+	return(t);
+}
+
+void feh_tiles_close(feh_tiles * t)
+{
+	gib_list *l, *next;
+	struct tile_cached *c;
+	int i;
+
+	for (l = tile_cache; l; l = next) {
+		next = l->next;
+		c = l->data;
+		if (c->t == t) {
+			gib_imlib_free_image_and_decache(c->im);
+			free(c);
+			tile_cache = gib_list_remove(tile_cache, l);
+			tile_cache_len--;
+		}
+	}
+
+	for (i = 0; i < t->levels; i++)
+		free(t->index[i]);
+	close(t->fd);
+	free(t->filename);
+	free(t);
+	return;
+}
+
+static Imlib_Image feh_tiles_decode(feh_tiles * t, int level, int col, int row)
+{
+	struct tile_entry *e = &t->index[level][row * t->cols[level] + col];
+	unsigned char *zbuf;
+	DATA32 *data;
+	uLongf len;
+	int tw, th;
+	Imlib_Image im = NULL;
+
+	tw = t->w[level] - col * TILE_SIZE;
+	th = t->h[level] - row * TILE_SIZE;
+	if (tw > TILE_SIZE)
+		tw = TILE_SIZE;
+	if (th > TILE_SIZE)
+		th = TILE_SIZE;
+
+	zbuf = emalloc(e->length);
+	data = emalloc(tw * th * sizeof(DATA32));
+	len = tw * th * sizeof(DATA32);
+
+	if ((pread(t->fd, zbuf, e->length, e->offset) == (ssize_t) e->length)
+			&& (uncompress((Bytef *) data, &len, zbuf, e->length) == Z_OK)
+			&& (len == tw * th * sizeof(DATA32))) {
+		im = imlib_create_image_using_copied_data(tw, th, data);
+		if (im) {
+			imlib_context_set_image(im);
+			imlib_image_set_has_alpha(t->has_alpha);
+		}
+	}
+	free(zbuf);
+	free(data);
+	return(im);
+}
+
+/* Returns a decoded tile, from the tile cache if possible */
+static Imlib_Image feh_tiles_get(feh_tiles * t, int level, int col, int row)
+{
+	gib_list *l, *last = NULL;
+	struct tile_cached *c;
+
+	for (l = tile_cache; l; l = l->next) {
+		c = l->data;
+		if ((c->t == t) && (c->level == level) && (c->col == col)
+				&& (c->row == row)) {
+			if (l != tile_cache) {
+				tile_cache = gib_list_remove(tile_cache, l);
+				tile_cache = gib_list_add_front(tile_cache, c);
+			}
+			return(c->im);
+		}
+		last = l;
+	}
+
+	c = emalloc(sizeof(struct tile_cached));
+	c->t = t;
+	c->level = level;
+	c->col = col;
+	c->row = row;
+	if (!(c->im = feh_tiles_decode(t, level, col, row))) {
+		free(c);
+		return(NULL);
+	}
+
+	if (tile_cache_len >= TILE_CACHE && last) {
+		struct tile_cached *old = last->data;
+
+		gib_imlib_free_image_and_decache(old->im);
+		free(old);
+		tile_cache = gib_list_remove(tile_cache, last);
+		tile_cache_len--;
+	}
+	tile_cache = gib_list_add_front(tile_cache, c);
+	tile_cache_len++;
+	return(c->im);
+}
+
+/* Assembles the smallest level of the pyramid into one image */
+Imlib_Image feh_tiles_overview(char *filename)
+{
+	feh_tiles *t;
+	Imlib_Image im, tile;
+	DATA32 *data, *src;
+	int l, col, row, y, tw, th;
+
+	if (!(t = feh_tiles_open(filename)))
+		return(NULL);
+
+	l = t->levels - 1;
+	if (!(im = imlib_create_image(t->w[l], t->h[l]))) {
+		feh_tiles_close(t);
+		return(NULL);
+	}
+	imlib_context_set_image(im);
+	data = imlib_image_get_data();
+
+	for (row = 0; row < t->rows[l]; row++) {
+		for (col = 0; col < t->cols[l]; col++) {
+			if (!(tile = feh_tiles_decode(t, l, col, row))) {
+				imlib_context_set_image(im);
+				imlib_image_put_back_data(data);
+				imlib_free_image_and_decache();
+				feh_tiles_close(t);
+				return(NULL);
+			}
+			tw = gib_imlib_image_get_width(tile);
+			th = gib_imlib_image_get_height(tile);
+			imlib_context_set_image(tile);
+			src = imlib_image_get_data_for_reading_only();
+			for (y = 0; y < th; y++)
+				memcpy(data + (row * TILE_SIZE + y) * t->w[l] + col * TILE_SIZE,
+						src + y * tw, tw * sizeof(DATA32));
+			imlib_free_image_and_decache();
+		}
+	}
+
+	imlib_context_set_image(im);
+	imlib_image_put_back_data(data);
+	imlib_image_set_has_alpha(t->has_alpha);
+	feh_tiles_close(t);
+	return(im);
+}
+
+/*
+ * Draws the visible part of the window image (dx, dy, dw, dh in window
+ * coordinates) from the tile level matching the current zoom. Returns 0 if
+ * the window should be drawn from its image as usual.
+ */
+int feh_tiles_render(winwidget winwid, int dx, int dy, int dw, int dh, int alias)
+{
+	feh_tiles *t;
+	feh_file *file;
+	Imlib_Image im;
+	double scale;
+	int l, f, x0, y0, x1, y1, col, row, tx, ty, ix0, iy0, ix1, iy1;
+	int sx0, sy0, sx1, sy1;
+
+	if ((winwid->zoom <= 1.0) || !winwid->file)
+		return(0);
+	file = FEH_FILE(winwid->file->data);
+	if (!file->tiled)
+		return(0);
+
+	if (winwid->tiles && strcmp(winwid->tiles->filename, file->filename)) {
+		feh_tiles_close(winwid->tiles);
+		winwid->tiles = NULL;
+	}
+	if (!winwid->tiles && !(winwid->tiles = feh_tiles_open(file->filename))) {
+		file->tiled = 0;
+		return(0);
+	}
+	t = winwid->tiles;
+
+	/* the window image must still be the unmodified overview */
+	if ((winwid->im_w != t->w[t->levels - 1])
+			|| (winwid->im_h != t->h[t->levels - 1]))
+		return(0);
+
+	/* pick the smallest level with at least one pixel per screen pixel */
+	for (l = t->levels - 1, f = 1; l > 0 && f < winwid->zoom; l--)
+		f *= 2;
+
+	/* level pixels -> window pixels */
+	scale = winwid->zoom / f;
+
+	x0 = floor((dx - winwid->im_x) / scale);
+	y0 = floor((dy - winwid->im_y) / scale);
+	x1 = ceil((dx + dw - winwid->im_x) / scale);
+	y1 = ceil((dy + dh - winwid->im_y) / scale);
+	if (x0 < 0)
+		x0 = 0;
+	if (y0 < 0)
+		y0 = 0;
+	if (x1 > t->w[l])
+		x1 = t->w[l];
+	if (y1 > t->h[l])
+		y1 = t->h[l];
+	if ((x0 >= x1) || (y0 >= y1))
+		return(1);
+
+	D(("level %d of %d, level pixels %d,%d - %d,%d\n", l, t->levels,
+				x0, y0, x1, y1));
+
+	for (row = y0 / TILE_SIZE; row <= (y1 - 1) / TILE_SIZE; row++) {
+		for (col = x0 / TILE_SIZE; col <= (x1 - 1) / TILE_SIZE; col++) {
+			if (!(im = feh_tiles_get(t, l, col, row)))
+				continue;
+			tx = col * TILE_SIZE;
+			ty = row * TILE_SIZE;
+			ix0 = (tx > x0) ? tx : x0;
+			iy0 = (ty > y0) ? ty : y0;
+			ix1 = (tx + TILE_SIZE < x1) ? tx + TILE_SIZE : x1;
+			iy1 = (ty + TILE_SIZE < y1) ? ty + TILE_SIZE : y1;
+
+			sx0 = lround(winwid->im_x + ix0 * scale);
+			sy0 = lround(winwid->im_y + iy0 * scale);
+			sx1 = lround(winwid->im_x + ix1 * scale);
+			sy1 = lround(winwid->im_y + iy1 * scale);
+			if ((sx1 <= sx0) || (sy1 <= sy0))
+				continue;
+
+			gib_imlib_render_image_part_on_drawable_at_size(winwid->bg_pmap,
+					im, ix0 - tx, iy0 - ty, ix1 - ix0, iy1 - iy0,
+					sx0, sy0, sx1 - sx0, sy1 - sy0, 1,
+					t->has_alpha, alias);
+		}
+	}
+	return(1);
+}
@@ -234,3 +234,50 @@ char *feh_get_user_name(void)
 	feh_user_name = estrdup(pw->pw_name);
 	return feh_user_name;
 }
+
+static int feh_mkdir(char *dir)
+{
+	struct stat sb;
+
+	if (!stat(dir, &sb)) {
+		if (S_ISDIR(sb.st_mode))
+			return(1);
+		weprintf("%s should be a directory", dir);
+		return(0);
+	}
+	if (mkdir(dir, 0700) == -1) {
+		weprintf("unable to create %s directory:", dir);
+		return(0);
+	}
+	return(1);
+}
+
+/*
+ * Returns $XDG_CACHE_HOME/feh/name (defaulting to ~/.cache/feh/name),
+ * creating it if necessary, or NULL if that fails.
+ */
+char *feh_cache_dir(char *name)
+{
+	char *home, *base, *feh_dir, *dir;
+	int ok;
+
+	if ((base = getenv("XDG_CACHE_HOME")) && *base)
+		base = estrdup(base);
+	else if ((home = getenv("HOME")))
+		base = estrjoin("/", home, ".cache", NULL);
+	else
+		return(NULL);
+
+	feh_dir = estrjoin("/", base, "feh", NULL);
+	dir = estrjoin("/", feh_dir, name, NULL);
+
+	ok = feh_mkdir(base) && feh_mkdir(feh_dir) && feh_mkdir(dir);
+
+	free(base);
+	free(feh_dir);
+	if (!ok) {
+		free(dir);
+		return(NULL);
+	}
+	return(dir);
+}
@@ -41,6 +41,7 @@ char *feh_unique_filename(char *path, char *basename);
 char *ereadfile(char *path);
 char *feh_get_tmp_dir(void);
 char *feh_get_user_name(void);
+char *feh_cache_dir(char *name);
 
 #define ESTRAPPEND(a,b) \
   {\
@@ -28,10 +28,14 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include "filelist.h"
 #include "winwidget.h"
 #include "options.h"
+#include "tiles.h"
+#include "imgcache.h"
 
 static void winwidget_unregister(winwidget win);
 static void winwidget_register(winwidget win);
 static winwidget winwidget_allocate(void);
+static void winwidget_render(winwidget winwid, int resize, int alias, int loading);
+static GC winwidget_get_gc(winwidget winwid);
 
 
 int window_num = 0;		/* For window list */
@@ -73,6 +77,7 @@ static winwidget winwidget_allocate(void)
 	ret->click_offset_x = 0;
 	ret->click_offset_y = 0;
 	ret->has_rotated = 0;
+	ret->tiles = NULL;
 
 	return(ret);
 }
@@ -362,11 +367,38 @@ void winwidget_setup_pixmaps(winwidget winwid)
 	return;
 }
 
+/* The window's GC, drawing in black (see winwidget_setup_pixmaps) */
+static GC winwidget_get_gc(winwidget winwid)
+{
+	if (winwid->gc == None) {
+		XGCValues gcval;
+
+		gcval.foreground = BlackPixel(disp, DefaultScreen(disp));
+		winwid->gc = XCreateGC(disp, winwid->win, GCForeground, &gcval);
+	}
+	return(winwid->gc);
+}
+
 void winwidget_render_image(winwidget winwid, int resize, int alias)
+{
+	winwidget_render(winwid, resize, alias, 0);
+	return;
+}
+
+/*
+ * With loading set, the image is still being decoded: everything is laid out
+ * as usual, but the image area is filled black instead of rendering the
+ * partial image. winwidget_render_image_part draws the decoded rows later.
+ */
+static void winwidget_render(winwidget winwid, int resize, int alias, int loading)
 {
 	int sx, sy, sw, sh, dx, dy, dw, dh;
 	int calc_w, calc_h;
 
+	/* an interrupted slideshow load leaves the window without an image */
+	if (!winwid->im)
+		return;
+
 	if (!winwid->full_screen && resize) {
 		winwidget_resize(winwid, winwid->im_w, winwid->im_h);
 		winwidget_reset_image(winwid);
@@ -528,7 +560,9 @@ void winwidget_render_image(winwidget winwid, int resize, int alias)
 	if (winwid->has_rotated)
 		gib_imlib_render_image_part_on_drawable_at_size_with_rotation
 		    (winwid->bg_pmap, winwid->im, sx, sy, sw, sh, dx, dy, dw, dh, winwid->im_angle, 1, 1, alias);
-	else
+	else if (loading)
+		XFillRectangle(disp, winwid->bg_pmap, winwidget_get_gc(winwid), dx, dy, dw, dh);
+	else if (!feh_tiles_render(winwid, dx, dy, dw, dh, alias))
 		gib_imlib_render_image_part_on_drawable_at_size(winwid->bg_pmap,
 								winwid->im,
 								sx, sy, sw,
@@ -553,6 +587,72 @@ void winwidget_render_image(winwidget winwid, int resize, int alias)
 	return;
 }
 
+/*
+ * Map the image area x, y, w, h to window coordinates, clipped to the
+ * window. Returns 0 if none of it is visible.
+ */
+static int winwidget_image_area(winwidget winwid, int x, int y, int w, int h,
+		int *dx, int *dy, int *dw, int *dh)
+{
+	int x1, y1;
+
+	*dx = winwid->im_x + floor(x * winwid->zoom);
+	*dy = winwid->im_y + floor(y * winwid->zoom);
+	x1 = winwid->im_x + ceil((x + w) * winwid->zoom);
+	y1 = winwid->im_y + ceil((y + h) * winwid->zoom);
+
+	if (*dx < 0)
+		*dx = 0;
+	if (*dy < 0)
+		*dy = 0;
+	if (x1 > winwid->w)
+		x1 = winwid->w;
+	if (y1 > winwid->h)
+		y1 = winwid->h;
+
+	*dw = x1 - *dx;
+	*dh = y1 - *dy;
+	return((*dw > 0) && (*dh > 0));
+}
+
+/*
+ * Set up the window for an image which is still being decoded: position,
+ * zoom and window size are calculated just like for the finished image, but
+ * the image area stays black until winwidget_render_image_part fills it in.
+ */
+void winwidget_render_image_loading(winwidget winwid)
+{
+	winwidget_render(winwid, 1, 0, 1);
+	return;
+}
+
+/* Redraw the (freshly decoded) image area x, y, w, h */
+void winwidget_render_image_part(winwidget winwid, int x, int y, int w, int h)
+{
+	int sx, sy, sw, sh, dx, dy, dw, dh;
+
+	if (!winwid->im || winwid->has_rotated
+			|| !winwidget_image_area(winwid, x, y, w, h, &dx, &dy, &dw, &dh))
+		return;
+
+	sx = (dx - winwid->im_x) / winwid->zoom;
+	sy = (dy - winwid->im_y) / winwid->zoom;
+	sw = ceil(dw / winwid->zoom);
+	sh = ceil(dh / winwid->zoom);
+	if (sx + sw > winwid->im_w)
+		sw = winwid->im_w - sx;
+	if (sy + sh > winwid->im_h)
+		sh = winwid->im_h - sy;
+	if ((sw <= 0) || (sh <= 0))
+		return;
+
+	gib_imlib_render_image_part_on_drawable_at_size(winwid->bg_pmap,
+			winwid->im, sx, sy, sw, sh, dx, dy, dw, dh, 1,
+			gib_imlib_image_has_alpha(winwid->im), 0);
+	XClearArea(disp, winwid->win, dx, dy, dw, dh, False);
+	return;
+}
+
 void winwidget_render_image_cached(winwidget winwid)
 {
 	static GC gc = None;
@@ -677,6 +777,8 @@ void winwidget_destroy(winwidget winwid)
 		XFreeGC(disp, winwid->gc);
 	if (winwid->im)
 		gib_imlib_free_image_and_decache(winwid->im);
+	if (winwid->tiles)
+		feh_tiles_close(winwid->tiles);
 	free(winwid);
 	return;
 }
@@ -711,10 +813,48 @@ winwidget winwidget_get_first_window_of_type(unsigned int type)
 	return(NULL);
 }
 
+/*
+ * The screen size images are shown at, if they may come from the display
+ * cache: in fullscreen mode, unless --zoom asks for a fixed zoom level.
+ */
+static int winwidget_display_size(winwidget winwid, int *w, int *h)
+{
+	if (!opt.cache_display || opt.default_zoom
+			|| !(winwid->win ? winwid->full_screen : opt.full_screen))
+		return(0);
+
+	*w = scr->width;
+	*h = scr->height;
+#ifdef HAVE_LIBXINERAMA
+	if (opt.xinerama && xinerama_screens) {
+		*w = xinerama_screens[xinerama_screen].width;
+		*h = xinerama_screens[xinerama_screen].height;
+	}
+#endif				/* HAVE_LIBXINERAMA */
+	return(1);
+}
+
 int winwidget_loadimage(winwidget winwid, feh_file * file)
 {
+	int max_w, max_h;
+
 	D(("filename %s\n", file->filename));
-	return(feh_load_image(&(winwid->im), file));
+
+	file->prescaled = 0;
+	if (!winwidget_display_size(winwid, &max_w, &max_h))
+		return(feh_load_image(&(winwid->im), file));
+
+	if ((winwid->im = feh_imgcache_display_load(file->filename, max_w, max_h))) {
+		D(("%s loaded from the display cache\n", file->filename));
+		file->prescaled = 1;
+		return(1);
+	}
+
+	if (!feh_load_image(&(winwid->im), file))
+		return(0);
+	if (!file->tiled)
+		feh_imgcache_display_save(file->filename, winwid->im, max_w, max_h);
+	return(1);
 }
 
 void winwidget_show(winwidget winwid)
@@ -892,6 +1032,9 @@ void winwidget_free_image(winwidget w)
 	w->im = NULL;
 	w->im_w = 0;
 	w->im_h = 0;
+	if (w->tiles)
+		feh_tiles_close(w->tiles);
+	w->tiles = NULL;
 	return;
 }
 
@@ -114,6 +114,9 @@ struct __winwidget {
 	int im_click_offset_y;
 
 	unsigned char has_rotated;
+
+	/* tile pyramid of a very large image, opened when zooming in */
+	feh_tiles *tiles;
 };
 
 int winwidget_loadimage(winwidget winwid, feh_file * filename);
@@ -124,6 +127,8 @@ void winwidget_destroy_all(void);
 void winwidget_free_image(winwidget w);
 void winwidget_center_image(winwidget w);
 void winwidget_render_image(winwidget winwid, int resize, int alias);
+void winwidget_render_image_loading(winwidget winwid);
+void winwidget_render_image_part(winwidget winwid, int x, int y, int w, int h);
 void winwidget_rotate_image(winwidget winid, double angle);
 void winwidget_move(winwidget winwid, int x, int y);
 void winwidget_resize(winwidget winwid, int w, int h);
@@ -2,7 +2,11 @@
 use strict;
 use warnings;
 use 5.010;
-use Test::Command tests => 63;
+use Test::Command tests => 75;
+use Test::More;
+use Digest::MD5 qw(md5_hex);
+use File::Copy;
+use File::Temp qw(tempdir);
 
 $ENV{HOME} = 'test';
 
@@ -145,3 +149,68 @@ $cmd = Test::Command->new(cmd =>
 $cmd->exit_is_num(0);
 $cmd->stdout_is_file('test/list/default');
 $cmd->stderr_like($re_list_action);
+
+# --generate-thumbnails and --thumb-cache-gc work on $HOME/.thumbnails, so
+# each gets a HOME of its own
+my $home = tempdir(CLEANUP => 1);
+my $gen_images = 'test/ok/jpg test/ok/png test/fail/png';
+
+sub count_png {
+	my @files = glob("$_[0]/*.png");
+	return scalar @files;
+}
+
+sub thumb_name {
+	my ($thumb_home, $file) = @_;
+	return "${thumb_home}/.thumbnails/normal/" . md5_hex("file://${file}")
+		. '.png';
+}
+
+$cmd = Test::Command->new(
+	cmd => "HOME=$home $feh --generate-thumbnails $gen_images"
+);
+
+$cmd->exit_is_num(0);
+$cmd->stdout_like(qr{^${feh_name} - 3 files in [0-9.]+s: 2 thumbnails generated, 0 up to date, 1 unloadable\n});
+
+$cmd = Test::Command->new(
+	cmd => "HOME=$home $feh --generate-thumbnails $gen_images"
+);
+
+$cmd->exit_is_num(0);
+$cmd->stdout_like(qr{^${feh_name} - 3 files in [0-9.]+s: 0 thumbnails generated, 2 up to date, 1 unloadable\n});
+
+is(count_png("$home/.thumbnails/normal"), 2, 'thumbnails are generated once');
+is(count_png("$home/.thumbnails/fail/${feh_name}"), 1,
+	'unloadable files are remembered');
+
+# --thumb-cache-gc: one thumbnail of a removed file, and two fresh ones of
+# which the least recently used one does not fit into the budget
+my $gc_home = tempdir(CLEANUP => 1);
+my $gc_dir = tempdir(CLEANUP => 1);
+my ($thumb_gone, $thumb_old, $thumb_new)
+	= map { thumb_name($gc_home, "$gc_dir/$_") } qw/gif jpg png/;
+
+copy("test/ok/$_", "$gc_dir/$_") for qw/gif jpg png/;
+
+$cmd = Test::Command->new(cmd => "HOME=$gc_home $feh --generate-thumbnails "
+                               . "$gc_dir/gif $gc_dir/jpg $gc_dir/png");
+$cmd->exit_is_num(0);
+
+unlink("$gc_dir/gif");
+for ([$thumb_old, 2048], [$thumb_new, 256]) {
+	my ($thumb, $kib) = @{$_};
+	open(my $fh, '>>', $thumb) or die("Cannot open $thumb: $!");
+	print {$fh} "\0" x ($kib * 1024);
+	close($fh);
+}
+utime(time - 3600, time - 3600, $thumb_old);
+
+$cmd = Test::Command->new(cmd => "HOME=$gc_home $feh --thumb-cache-gc 1");
+
+$cmd->exit_is_num(0);
+$cmd->stdout_like(qr{^${feh_name} - 3 cached thumbnails: removed 1 stale, 1 more \([0-9]+ KiB\) to fit the budget, [0-9]+ KiB left\n});
+
+ok(! -e $thumb_gone, 'thumbnails of removed files are stale');
+ok(! -e $thumb_old, 'least recently used thumbnails are evicted first');
+ok(-e $thumb_new, 'thumbnails within the budget are kept');